@@ -0,0 +1,42 @@
+# Fails if any source file contains control characters other than tab and
+# newline, such as carriage returns, which break compilers and Doxygen.
+#
+# Usage: cmake -DSOURCE_DIR=<musly source dir> -P CheckSourceBytes.cmake
+
+set(control_chars "")
+foreach (code RANGE 1 31)
+    if (NOT code EQUAL 9 AND NOT code EQUAL 10)
+        string(ASCII ${code} char)
+        set(control_chars "${control_chars}${char}")
+    endif ()
+endforeach ()
+string(ASCII 127 char)
+set(control_chars "${control_chars}${char}")
+
+file(GLOB_RECURSE source_files
+    "${SOURCE_DIR}/include/*"
+    "${SOURCE_DIR}/libmusly/*.h"
+    "${SOURCE_DIR}/libmusly/*.cpp"
+    "${SOURCE_DIR}/libmusly/*.c"
+    "${SOURCE_DIR}/libmusly/*.txt"
+    "${SOURCE_DIR}/musly/*.h"
+    "${SOURCE_DIR}/musly/*.cpp"
+    "${SOURCE_DIR}/musly/*.txt"
+    "${SOURCE_DIR}/test/*.cpp"
+    "${SOURCE_DIR}/test/*.txt"
+    "${SOURCE_DIR}/cmake/*.cmake"
+    "${SOURCE_DIR}/CMakeLists.txt")
+
+set(bad_files "")
+foreach (source_file ${source_files})
+    file(READ "${source_file}" content)
+    string(REGEX MATCH "[${control_chars}]" bad_char "${content}")
+    if (bad_char)
+        list(APPEND bad_files "${source_file}")
+    endif ()
+endforeach ()
+
+if (bad_files)
+    string(REPLACE ";" "\n  " bad_files "${bad_files}")
+    message(FATAL_ERROR "Control characters in source files:\n  ${bad_files}")
+endif ()
@@ -21,6 +21,19 @@ Using the Musly library interface in your application is straightforward:
  5. compute similarities and playlists: musly_jukebox_similarity()
  6. deinitialize musly: musly_jukebox_poweroff()
  
+A musly_jukebox can be used from several threads at once: Any number of
+threads can compute similarities or guess neighbors, while another thread
+modifies the jukebox, e.g., with musly_jukebox_addtracks(). Queries are only
+blocked for the short moment the modification is committed; the expensive
+part of musly_jukebox_addtracks() runs concurrently with them. Modifications
+are carried out one after another.
+
+Analyzing audio with musly_track_analyze_audiofile() or
+musly_track_analyze_pcm() uses buffers of the jukebox and must not be done
+from several threads at once. To analyze audio in parallel, give each thread
+its own musly_analyzer (see musly_analyzer_new()), or let
+musly_track_analyze_audiofiles() do so.
+
 A more detailed description of the libary calls and parameters can be found
 in musly.h. The source code distribution also includes a sample application
 (musly/main.cpp). The demo app can be used to try and evaluate the Musly
@@ -30,6 +43,7 @@ similarity measures. It is our reference implementation.
 #ifndef MUSLY_H_
 #define MUSLY_H_
 
+#include <stddef.h>  // to define size_t
 #include <musly/musly_types.h>
 
 #ifdef MUSLY_SUPPORT_STDIO
@@ -190,6 +204,8 @@ musly_jukebox_setmusicstyle(
  * routines, each Musly track has to be registered with a jukebox. Internally,
  * Musly computes an indexing and normalization vector for each registered
  * track based on the set of tracks passed to musly_jukebox_setmusicstyle().
+ * This is computed for several tracks in parallel on all processor cores,
+ * so adding many tracks in one call is faster than adding them one by one.
  *
  * \param[in] jukebox The Musly jukebox to add the tracks to
  * \param[in] tracks An array of musly_track objects to add to the jukebox
@@ -224,7 +240,10 @@ musly_jukebox_addtracks(
         int generate_ids);
 
 
-/** Deregister tracks from the Musly jukebox.
+/** Deregister tracks from the Musly jukebox. This takes constant time per
+ * track: removed tracks are only marked as such, and the jukebox
+ * compacts its internal state in a single pass once the marked tracks
+ * exceed a configurable fraction of all tracks.
  *
  * \param[in] jukebox The Musly jukebox to remove the tracks from
  * \param[in] trackids The track identifiers of the tracks to remove,
@@ -233,7 +252,8 @@ musly_jukebox_addtracks(
  *
  * \returns 0 on success, -1 on an error
  *
- * \sa musly_jukebox_addtracks(), musly_jukebox_trackcount()
+ * \sa musly_jukebox_addtracks(), musly_jukebox_trackcount(),
+ * musly_jukebox_setcompaction(), musly_jukebox_compact()
  */
 MUSLY_EXPORT int
 musly_jukebox_removetracks(
@@ -242,6 +262,42 @@ musly_jukebox_removetracks(
         int num_tracks);
 
 
+/** Sets when musly_jukebox_removetracks() compacts the internal state of
+ * the Musly jukebox. Removed tracks are only marked as such, and are
+ * dropped in a single pass once they exceed the given fraction of all
+ * tracks (including the removed ones), 0.25 by default.
+ *
+ * \param[in] jukebox The Musly jukebox to configure
+ * \param[in] max_removed_ratio The largest fraction of removed tracks to
+ * keep. 0 compacts on every removal, 1 or more never compacts
+ * automatically, leaving it to musly_jukebox_compact().
+ *
+ * \returns 0 on success, -1 on an error
+ *
+ * \sa musly_jukebox_removetracks(), musly_jukebox_compact()
+ */
+MUSLY_EXPORT int
+musly_jukebox_setcompaction(
+        musly_jukebox* jukebox,
+        float max_removed_ratio);
+
+
+/** Compacts the internal state of the Musly jukebox, dropping all tracks
+ * marked as removed by musly_jukebox_removetracks(). Use this to compact
+ * at a convenient time, e.g., after a large batch of removals. Concurrent
+ * queries are blocked while compacting.
+ *
+ * \param[in] jukebox The Musly jukebox to compact
+ *
+ * \returns 0 on success, -1 on an error
+ *
+ * \sa musly_jukebox_removetracks(), musly_jukebox_setcompaction()
+ */
+MUSLY_EXPORT int
+musly_jukebox_compact(
+        musly_jukebox* jukebox);
+
+
 /** Returns the number of tracks currently registered with the Musly jukebox.
  * Along with musly_jukebox_maxtrackid(), this can be used for versioning the
  * state of a jukebox.
@@ -340,6 +396,145 @@ musly_jukebox_similarity(
         float* similarities);
 
 
+/** Computes the similarities between several seed tracks and a list of other
+ * music tracks. This gives the same results as calling
+ * musly_jukebox_similarity() once for every seed track, but allows the
+ * music similarity method to share work between the seeds (e.g., lookups of
+ * the track ids and buffers), and to process the seed and other tracks in
+ * cache-friendly tiles. Use this to compute large parts of a full similarity
+ * matrix.
+ *
+ * \param[in] jukebox An initialized Musly jukebox object with tracks added
+ * through musly_jukebox_addtracks()
+ * \param[in] seed_tracks An array of seed tracks to compute similarities to
+ * \param[in] seed_trackids An array of musly_trackids corresponding to the
+ * \p seed_tracks array, as returned by or given to musly_jukebox_addtracks()
+ * \param[in] num_seeds The size of the \p seed_tracks and \p seed_trackids
+ * arrays
+ * \param[in] tracks An array of musly_track objects to compute the
+ * similarities to
+ * \param[in] trackids An array of musly_trackids corresponding to the
+ * \p tracks array, as returned by or given to musly_jukebox_addtracks()
+ * \param[in] num_tracks The size of the \p tracks and \p trackids arrays
+ * \param[out] similarities A preallocated float array of
+ * <tt>num_seeds * num_tracks</tt> elements to write the computed
+ * similarities to. The similarities of the i-th seed track are written to
+ * <tt>similarities[i * num_tracks]</tt> to
+ * <tt>similarities[(i + 1) * num_tracks - 1]</tt>.
+ * \returns 0 on success, -1 on an error
+ *
+ * \sa musly_jukebox_similarity()
+ */
+MUSLY_EXPORT int
+musly_jukebox_similarity_batch(
+        musly_jukebox* jukebox,
+        musly_track** seed_tracks,
+        musly_trackid* seed_trackids,
+        int num_seeds,
+        musly_track** tracks,
+        musly_trackid* trackids,
+        int num_tracks,
+        float* similarities);
+
+
+/** Copies musly_track objects into a contiguous track store owned by the
+ * jukebox, so similarities can be computed with
+ * musly_jukebox_similarity_byid() without keeping the tracks in memory
+ * separately. The store keeps the features of all tracks in a single
+ * aligned memory block, which the similarity computation can stream through
+ * much faster than through separately allocated tracks. Using the store is
+ * optional; the tracks have to be registered with musly_jukebox_addtracks()
+ * as usual.
+ *
+ * \param[in] jukebox An initialized Musly jukebox object
+ * \param[in] tracks An array of musly_track objects to store
+ * \param[in] trackids An array of musly_trackids corresponding to the
+ * \p tracks array, as returned by or given to musly_jukebox_addtracks()
+ * \param[in] num_tracks The size of the \p tracks and \p trackids arrays
+ * \returns 0 on success, -1 on an error
+ *
+ * \note Tracks already stored under the same id are overwritten. Tracks are
+ * removed from the store by musly_jukebox_removetracks(). The store is not
+ * part of the jukebox state written by musly_jukebox_tostream(); after
+ * restoring a jukebox, the tracks need to be stored again.
+ *
+ * \sa musly_jukebox_similarity_byid()
+ */
+MUSLY_EXPORT int
+musly_jukebox_storetracks(
+        musly_jukebox* jukebox,
+        musly_track** tracks,
+        musly_trackid* trackids,
+        int num_tracks);
+
+
+/** Computes the similarity between a seed track and a list of other music
+ * tracks, all identified by their track ids. This gives the same results as
+ * musly_jukebox_similarity(), but takes the tracks from the track store
+ * filled with musly_jukebox_storetracks(). Computing similarities to tracks
+ * in the order they were stored is fastest.
+ *
+ * \param[in] jukebox An initialized Musly jukebox object with tracks added
+ * through musly_jukebox_addtracks() and musly_jukebox_storetracks()
+ * \param[in] seed_trackid The id of the seed track
+ * \param[in] trackids An array of musly_trackids of the tracks to compute
+ * the similarities to
+ * \param[in] num_tracks The size of the \p trackids and \p similarities
+ * arrays
+ * \param[out] similarities A preallocated float array to write the computed
+ * similarities to
+ * \returns 0 on success, -1 on an error, e.g., if a track was not stored
+ *
+ * \sa musly_jukebox_storetracks(), musly_jukebox_similarity()
+ */
+MUSLY_EXPORT int
+musly_jukebox_similarity_byid(
+        musly_jukebox* jukebox,
+        musly_trackid seed_trackid,
+        musly_trackid* trackids,
+        int num_tracks,
+        float* similarities);
+
+
+/** Finds the \p k tracks in the track store most similar to a seed track.
+ * This gives the same results as computing the similarities to all stored
+ * tracks with musly_jukebox_similarity_byid() and selecting the smallest ones
+ * with musly_findmin(), but never holds the similarities of all tracks in
+ * memory. Instead, the similarities are computed and ranked in a single pass
+ * over the track store, and methods may skip the full computation for tracks
+ * that cannot be among the \p k most similar ones found so far.
+ *
+ * \param[in] jukebox An initialized Musly jukebox object with tracks added
+ * through musly_jukebox_addtracks() and musly_jukebox_storetracks()
+ * \param[in] seed_trackid The id of the seed track. It is never returned.
+ * \param[in] k The maximum number of tracks to return
+ * \param[in] filter An optional function deciding which stored tracks to
+ * consider, or <tt>NULL</tt> to consider all of them. It is called with the
+ * jukebox locked for reading, so it must not modify the jukebox.
+ * \param[in] user_data A pointer passed on to \p filter.
+ * \param[out] trackids A preallocated array of \p k musly_trackids to write
+ * the ids of the most similar tracks to, the most similar first
+ * \param[out] similarities A preallocated array of \p k floats to write the
+ * similarities of these tracks to, or <tt>NULL</tt>
+ * \returns the number of tracks written (less than \p k if fewer tracks were
+ * considered), or -1 on an error, e.g., if the seed track was not stored
+ *
+ * \note Tracks with an undefined (NaN) similarity are never returned.
+ *
+ * \sa musly_jukebox_storetracks(), musly_jukebox_similarity_byid(),
+ * musly_findmin()
+ */
+MUSLY_EXPORT int
+musly_jukebox_topk(
+        musly_jukebox* jukebox,
+        musly_trackid seed_trackid,
+        int k,
+        musly_track_filter filter,
+        void* user_data,
+        musly_trackid* trackids,
+        float* similarities);
+
+
 /** Tries to guess the most similar neighbors to the given trackid. If
  * similarity measures implement this call, it is usually a very efficient
  * way to pre-filter the whole jukebox collection for possible matches
@@ -349,6 +544,8 @@ musly_jukebox_similarity(
  * maximum of \p num_neighbors track ids is written to the \p neighbors list.
  * The returned neighbors can be used to drastically reduce the number of input
  * tracks (and thus computation time) for musly_jukebox_similarity().
+ * The guess is a heuristic without exactness guarantee: it may miss some of
+ * the nearest neighbors, so rank the returned neighbors by their similarity.
  * If the method is not implemented or all neighbors should be analyzed,
  * -1 is returned. In that case consider all musly_tracks as possible nearest
  * neighbors and thus as input to musly_jukebox_similarity().
@@ -505,7 +702,7 @@ musly_jukebox_tobin(
 MUSLY_EXPORT int
 musly_jukebox_frombin(
         musly_jukebox* jukebox,
-        unsigned char* buffer,
+        const unsigned char* buffer,
         int header,
         int num_tracks);
 
@@ -567,6 +764,12 @@ musly_jukebox_fromstream(
  *
  * \returns the number of bytes written, or -1 in case of an error
  *
+ * \note For music similarity methods that support it, the file is a jukebox
+ * image of aligned flat arrays that musly_jukebox_fromfile() reads in place,
+ * otherwise it has the format of musly_jukebox_tostream(). On POSIX
+ * systems, the file is written under a temporary name and then renamed, so
+ * it can safely replace a file another jukebox still reads from.
+ *
  * \sa musly_jukebox_fromfile(), musly_jukebox_tostream()
  */
 MUSLY_EXPORT int
@@ -589,6 +792,14 @@ musly_jukebox_tofile(
  *
  * \note Any additional data in the file following the jukebox state will
  * be ignored, so you can freely append custom data after writing it.
+ *
+ * \note A jukebox image is memory-mapped and read in place for the lifetime
+ * of the returned jukebox, so restoring it takes constant time, and
+ * processes reading the same file share its memory. Do not modify or
+ * truncate the file until the jukebox is powered off; replacing it with
+ * musly_jukebox_tofile() or by renaming another file over it is safe on
+ * POSIX systems. Files in the format of musly_jukebox_tostream() are read
+ * into memory instead.
  */
 MUSLY_EXPORT musly_jukebox*
 musly_jukebox_fromfile(
@@ -760,6 +971,83 @@ musly_track_analyze_pcm(
         musly_track* track);
 
 
+/** Starts an incremental analysis of a PCM signal. Pass the signal in chunks
+ * of any size to musly_track_analyzer_push() as it is decoded or received,
+ * then compute the musly_track with musly_track_analyzer_finish(). Use this
+ * for signals that are too long to keep in memory, such as radio streams or
+ * hour-long recordings: For the included music similarity methods, the
+ * memory needed by the analysis does not depend on the length of the
+ * signal.
+ *
+ * \note
+ * Unlike musly_track_analyze_pcm(), the analysis always uses the complete
+ * signal passed, since its length is not known in advance. To analyze an
+ * excerpt, only pass the excerpt. Also, the signal is not normalized to its
+ * peak, but assumed to peak at full scale (-1.0 or +1.0). For signals of at
+ * most 60 seconds that peak at full scale, the musly_track equals the one of
+ * musly_track_analyze_pcm(), up to rounding errors.
+ *
+ * \param[in] jukebox A reference to an initialized musly_jukebox object. It
+ * must not be powered off before the analyzer is freed.
+ *
+ * \returns a new analyzer, to be freed with musly_track_analyzer_free(), or
+ * NULL on failure
+ *
+ * \sa musly_track_analyzer_push(), musly_track_analyzer_finish(),
+ * musly_track_analyze_pcm()
+ */
+MUSLY_EXPORT musly_track_analyzer*
+musly_track_analyzer_new(
+        musly_jukebox* jukebox);
+
+
+/** Passes the next chunk of a signal to an incremental analysis. Different
+ * analyzers may be used concurrently from different threads.
+ *
+ * \param[in] analyzer An analyzer created with musly_track_analyzer_new()
+ * \param[in] mono_22khz_pcm The next chunk of the audio signal, as a PCM
+ * float array. The audio signal has to be mono and sampled at 22050 Hz with
+ * float values between -1.0 and +1.0.
+ * \param[in] length_pcm The length of the input float array
+ *
+ * \returns 0 on success, -1 on failure
+ *
+ * \sa musly_track_analyzer_new()
+ */
+MUSLY_EXPORT int
+musly_track_analyzer_push(
+        musly_track_analyzer* analyzer,
+        float* mono_22khz_pcm,
+        int length_pcm);
+
+
+/** Computes a music similarity model (musly_track) from the signal passed to
+ * an incremental analysis so far.
+ *
+ * \param[in] analyzer An analyzer created with musly_track_analyzer_new()
+ * \param[out] track The musly_track to write the music similarity features to
+ *
+ * \returns 0 on success, nonzero on failure (e.g., if the signal was too
+ * short)
+ *
+ * \sa musly_track_analyzer_new(), musly_track_analyzer_free()
+ */
+MUSLY_EXPORT int
+musly_track_analyzer_finish(
+        musly_track_analyzer* analyzer,
+        musly_track* track);
+
+
+/** Frees an analyzer created with musly_track_analyzer_new(), finished or
+ * not.
+ *
+ * \param[in] analyzer The analyzer to free
+ */
+MUSLY_EXPORT void
+musly_track_analyzer_free(
+        musly_track_analyzer* analyzer);
+
+
 /** Compute a music similarity model (musly_track) from the audio file.
  * The audio file is decoded with the decoder selected when initializing
  * the musly_jukebox, down- and re-sampled to a 22050Hz mono signal before
@@ -775,6 +1063,10 @@ musly_track_analyze_pcm(
  * whether the full excerpt is going to be used to build the similarity model.
  * Generally, it is enough to decode 30 to 60 seconds, and it is advisable to
  * exclude nonrepresentative parts such as the intro and outro of a song.
+ * Methods that only use the central part of a longer signal (60 seconds for
+ * the methods included with Musly) let the decoder skip the rest of a
+ * centered excerpt (i.e., if \p excerpt_start is negative) or of the whole
+ * file (if \p excerpt_length is zero).
  *
  * \param[in] jukebox A reference to an initialized musly_jukebox object
  * \param[in] audiofile An audio file. The file will be decoded with the audio
@@ -803,6 +1095,229 @@ musly_track_analyze_audiofile(
         musly_track* track);
 
 
+/** Computes a music similarity model (musly_track) from an audio file held
+ * in memory, like musly_track_analyze_audiofile() does for a file on disk.
+ * The buffer is decoded in place, without writing it to a file first.
+ *
+ * \param[in] jukebox A reference to an initialized musly_jukebox object
+ * \param[in] data The contents of an audio file.
+ * \param[in] length The size of \p data in bytes.
+ * \param[in] excerpt_length The maximum length in seconds of the excerpt to
+ * decode, see musly_track_analyze_audiofile()
+ * \param[in] excerpt_start The starting position in seconds of the excerpt
+ * to decode, see musly_track_analyze_audiofile()
+ * \param[out] track The musly_track to write the music similarity features to
+ *
+ * \returns 0 on success, -1 on failure (also if the audio decoder does not
+ * support decoding from memory)
+ *
+ * \sa musly_track_analyze_audiostream()
+ */
+MUSLY_EXPORT int
+musly_track_analyze_audiobuffer(
+        musly_jukebox* jukebox,
+        const void* data,
+        size_t length,
+        float excerpt_length,
+        float excerpt_start,
+        musly_track* track);
+
+
+/** Computes a music similarity model (musly_track) from an audio file read
+ * through callbacks, like musly_track_analyze_audiofile() does for a file on
+ * disk. This allows to decode audio from any storage without a filesystem
+ * round trip.
+ *
+ * \param[in] jukebox A reference to an initialized musly_jukebox object
+ * \param[in] read A function reading the encoded audio.
+ * \param[in] seek A function seeking in the encoded audio, or NULL if the
+ * stream is not seekable. Without seeking, excerpts are decoded from the
+ * beginning, and some formats cannot be decoded at all.
+ * \param[in] opaque A pointer passed to \p read and \p seek.
+ * \param[in] excerpt_length The maximum length in seconds of the excerpt to
+ * decode, see musly_track_analyze_audiofile()
+ * \param[in] excerpt_start The starting position in seconds of the excerpt
+ * to decode, see musly_track_analyze_audiofile()
+ * \param[out] track The musly_track to write the music similarity features to
+ *
+ * \returns 0 on success, -1 on failure (also if the audio decoder does not
+ * support decoding from callbacks)
+ *
+ * \sa musly_track_analyze_audiobuffer()
+ */
+MUSLY_EXPORT int
+musly_track_analyze_audiostream(
+        musly_jukebox* jukebox,
+        musly_read_callback read,
+        musly_seek_callback seek,
+        void* opaque,
+        float excerpt_length,
+        float excerpt_start,
+        musly_track* track);
+
+
+/** Compute music similarity models (musly_track) from several audio files.
+ * This gives the same results as calling musly_track_analyze_audiofile()
+ * for every file, but analyzes the files in parallel on worker threads
+ * started by Musly, the calling thread being one of them. Each worker
+ * uses its own musly_analyzer (see musly_analyzer_new()) for all of its
+ * files, and fetches the next file as soon as it is done with the previous
+ * one, so files of varying length keep all workers busy.
+ *
+ * \param[in] jukebox A reference to an initialized musly_jukebox object
+ * \param[in] audiofiles An array of audio files to analyze.
+ * \param[in] num_files The size of the \p audiofiles and \p tracks arrays
+ * \param[in] excerpt_length The maximum length in seconds of the excerpts to
+ * decode, see musly_track_analyze_audiofile().
+ * \param[in] excerpt_start The starting position in seconds of the excerpts
+ * to decode, see musly_track_analyze_audiofile().
+ * \param[out] tracks An array of allocated musly_track objects to write the
+ * music similarity features of the corresponding audio files to
+ * \param[in] num_threads The number of worker threads to use, or 0 to use
+ * as many as there are processor cores. No more threads than files are
+ * used.
+ * \param[in] callback An optional function to call whenever a file has been
+ * analyzed, or <tt>NULL</tt>. Calls are never made concurrently, so the
+ * callback does not need to be thread-safe, but the order of calls is
+ * undefined, and they are made from any of the worker threads, not only
+ * the thread that called musly_track_analyze_audiofiles(). Long-running
+ * callbacks stall the other workers.
+ * \param[in] user_data A pointer passed on to \p callback.
+ *
+ * \returns the number of files analyzed successfully, or -1 on failure
+ *
+ * \sa musly_track_analyze_audiofile()
+ */
+MUSLY_EXPORT int
+musly_track_analyze_audiofiles(
+        musly_jukebox* jukebox,
+        const char** audiofiles,
+        int num_files,
+        float excerpt_length,
+        float excerpt_start,
+        musly_track** tracks,
+        int num_threads,
+        musly_track_callback callback,
+        void* user_data);
+
+
+/** Creates a context for analyzing audio in the same way as a jukebox. The
+ * musly_analyzer uses its own instances of the music similarity method and
+ * audio decoder of the jukebox, so the musly_track objects it computes can
+ * be used with the jukebox, but several threads can analyze audio at the
+ * same time, each with its own musly_analyzer. A musly_analyzer itself must
+ * only be used by one thread at a time.
+ *
+ * The decoder of a musly_analyzer keeps its codec contexts, frame buffers
+ * and resamplers from one audio file to the next, so analyzing many files
+ * with one musly_analyzer avoids setting them up for every file.
+ *
+ * \param[in] jukebox A reference to an initialized musly_jukebox object
+ *
+ * \returns a new musly_analyzer, to be freed with musly_analyzer_free(), or
+ * NULL on failure
+ *
+ * \sa musly_analyzer_analyze_audiofile(), musly_analyzer_analyze_pcm()
+ */
+MUSLY_EXPORT musly_analyzer*
+musly_analyzer_new(
+        musly_jukebox* jukebox);
+
+
+/** Frees a musly_analyzer created with musly_analyzer_new().
+ *
+ * \param[in] analyzer The musly_analyzer to free
+ */
+MUSLY_EXPORT void
+musly_analyzer_free(
+        musly_analyzer* analyzer);
+
+
+/** Computes a music similarity model (musly_track) from the given PCM signal,
+ * like musly_track_analyze_pcm(), but using the buffers of a musly_analyzer
+ * instead of the jukebox.
+ *
+ * \param[in] analyzer A musly_analyzer created with musly_analyzer_new()
+ * \param[in] mono_22khz_pcm The audio signal to analyze, see
+ * musly_track_analyze_pcm()
+ * \param[in] length_pcm The length of the input float array
+ * \param[out] track The musly_track to write the music similarity features to
+ *
+ * \returns 0 on success, -1 on failure
+ *
+ * \sa musly_track_analyze_pcm()
+ */
+MUSLY_EXPORT int
+musly_analyzer_analyze_pcm(
+        musly_analyzer* analyzer,
+        float* mono_22khz_pcm,
+        int length_pcm,
+        musly_track* track);
+
+
+/** Computes a music similarity model (musly_track) from an audio file, like
+ * musly_track_analyze_audiofile(), but using the buffers of a
+ * musly_analyzer instead of the jukebox.
+ *
+ * \param[in] analyzer A musly_analyzer created with musly_analyzer_new()
+ * \param[in] audiofile An audio file
+ * \param[in] excerpt_length The maximum length in seconds of the excerpt to
+ * decode, see musly_track_analyze_audiofile()
+ * \param[in] excerpt_start The starting position in seconds of the excerpt
+ * to decode, see musly_track_analyze_audiofile()
+ * \param[out] track The musly_track to write the music similarity features to
+ *
+ * \returns 0 on success, -1 on failure
+ *
+ * \sa musly_track_analyze_audiofile()
+ */
+MUSLY_EXPORT int
+musly_analyzer_analyze_audiofile(
+        musly_analyzer* analyzer,
+        const char* audiofile,
+        float excerpt_length,
+        float excerpt_start,
+        musly_track* track);
+
+
+/** Computes a music similarity model (musly_track) from an audio file held
+ * in memory, like musly_track_analyze_audiobuffer(), but using the buffers
+ * of a musly_analyzer instead of the jukebox.
+ *
+ * \returns 0 on success, -1 on failure
+ *
+ * \sa musly_track_analyze_audiobuffer()
+ */
+MUSLY_EXPORT int
+musly_analyzer_analyze_audiobuffer(
+        musly_analyzer* analyzer,
+        const void* data,
+        size_t length,
+        float excerpt_length,
+        float excerpt_start,
+        musly_track* track);
+
+
+/** Computes a music similarity model (musly_track) from an audio file read
+ * through callbacks, like musly_track_analyze_audiostream(), but using the
+ * buffers of a musly_analyzer instead of the jukebox.
+ *
+ * \returns 0 on success, -1 on failure
+ *
+ * \sa musly_track_analyze_audiostream()
+ */
+MUSLY_EXPORT int
+musly_analyzer_analyze_audiostream(
+        musly_analyzer* analyzer,
+        musly_read_callback read,
+        musly_seek_callback seek,
+        void* opaque,
+        float excerpt_length,
+        float excerpt_start,
+        musly_track* track);
+
+
+
 /** Utility function to find the smallest items in an unordered list of values.
  * This can be used to find the top few tracks in the results of a similarity
  * computation done via one or more musly_jukebox_similarity() calls.
@@ -821,6 +1336,12 @@ musly_track_analyze_audiofile(
  *
  * \returns the number of items written to \p min_values and/or \p min_ids,
  * or -1 in case of an error
+ *
+ * \note NaN values are treated as larger than any other value. Of several
+ * equal values, the ones with the smallest ids are selected (and written
+ * first, if \p ordered is nonzero), taking the indices as ids if \p ids is
+ * <tt>NULL</tt>. This is the order musly_jukebox_topk() uses, so the result
+ * is deterministic and does not depend on the order of the values.
  */
 MUSLY_EXPORT int
 musly_findmin(
@@ -39,6 +39,38 @@ typedef struct {
 } musly_jukebox;
 
 
+/** A context for analyzing audio, created from a musly_jukebox with
+ * musly_analyzer_new(). It has its own instances of the music similarity
+ * method and audio decoder of the jukebox, so each thread can analyze audio
+ * with its own musly_analyzer without interfering with other threads.
+ *
+ * \sa musly_analyzer_new(), musly_analyzer_free()
+ */
+typedef struct {
+    /** A reference to the music similarity method used for analysis. Hides a
+     * C++ musly::method object.
+     */
+    void* method;
+
+    /** A reference to the audio file decoder. Hides a C++ musly::decoder
+     * object.
+     */
+    void* decoder;
+} musly_analyzer;
+
+
+/** An incremental analysis of a PCM signal, for signals too long to be held
+ * in memory or arriving as a stream. It is started with
+ * musly_track_analyzer_new() and fed with musly_track_analyzer_push().
+ */
+typedef struct {
+    /** A reference to the state of the analysis. Hides a C++
+     * musly::analysis object.
+     */
+    void* analysis;
+} musly_track_analyzer;
+
+
 /** A musly_track object typically represents the features extracted with an
  * music similarity method. The features are stored linearly in a float* array.
  * Each music similarity method may write different features into this
@@ -54,4 +86,53 @@ typedef float musly_track;
 typedef int musly_trackid;
 
 
+/** A function called by musly_track_analyze_audiofiles() whenever the
+ * analysis of an audio file has finished. \p index is the position of the
+ * file in the list of files, \p result is 0 if the file was analyzed
+ * successfully and -1 otherwise (for any reason of failure, including
+ * those musly_track_analyze_audiofile() reports with other nonzero codes),
+ * and \p user_data is passed through from the call to
+ * musly_track_analyze_audiofiles().
+ */
+typedef void (*musly_track_callback)(
+        int index,
+        int result,
+        void* user_data);
+
+
+/** A function called by musly_jukebox_topk() to decide whether a track is
+ * considered as a result. \p trackid is the id of the track, and
+ * \p user_data is passed through from the call to musly_jukebox_topk().
+ * Returns nonzero to consider the track, or 0 to skip it.
+ */
+typedef int (*musly_track_filter)(
+        musly_trackid trackid,
+        void* user_data);
+
+
+/** A function reading encoded audio for musly_track_analyze_audiostream().
+ * It copies up to \p size bytes to \p buffer and returns the number of
+ * bytes copied, 0 at the end of the stream, or a negative value on error.
+ * \p opaque is passed through from the call to
+ * musly_track_analyze_audiostream().
+ */
+typedef int (*musly_read_callback)(
+        void* opaque,
+        unsigned char* buffer,
+        int size);
+
+
+/** A function seeking in encoded audio for musly_track_analyze_audiostream().
+ * It moves the read position to \p offset bytes relative to the start
+ * (\p whence is \c SEEK_SET), the current position (\c SEEK_CUR) or the
+ * end of the stream (\c SEEK_END), and returns the new position from the
+ * start, or a negative value on error. \p opaque is passed through from the
+ * call to musly_track_analyze_audiostream().
+ */
+typedef long long (*musly_seek_callback)(
+        void* opaque,
+        long long offset,
+        int whence);
+
+
 #endif // MUSLY_TYPES_H_
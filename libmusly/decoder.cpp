@@ -23,4 +23,15 @@ decoder::~decoder()
 {
 }
 
+std::vector<float>
+decoder::decodestream_22050hz_mono_float(
+        musly_read_callback /*read*/,
+        musly_seek_callback /*seek*/,
+        void* /*opaque*/,
+        float /*excerpt_length*/,
+        float /*excerpt_start*/)
+{
+    return std::vector<float>(0);
+}
+
 } /* namespace musly */
@@ -15,10 +15,15 @@
 
 #include <string>
 #include <vector>
+#include "musly/musly_types.h"
 #include "plugins.h"
 
 namespace musly {
 
+/** Decodes audio files to a 22050 Hz mono signal. A decoder may keep state
+ * from one call to the next to speed up decoding further files, so an
+ * instance must only be used by one thread at a time.
+ */
 class decoder :
         public plugin
 {
@@ -32,6 +37,19 @@ public:
             float excerpt_length,
             float excerpt_start) = 0;
 
+    /** Decodes audio read through callbacks, like
+     * decodeto_22050hz_mono_float() does for a file. \p seek may be NULL
+     * for streams that are not seekable. The default implementation does
+     * not support this and returns an empty signal.
+     */
+    virtual std::vector<float>
+    decodestream_22050hz_mono_float(
+            musly_read_callback read,
+            musly_seek_callback seek,
+            void* opaque,
+            float excerpt_length,
+            float excerpt_start);
+
 };
 
 /** A macro to facilitating registering a decoder class with musly. This macro
@@ -15,6 +15,7 @@
 
 #include <inttypes.h>
 #include <stdint.h>
+#include <cstdio>
 #include <vector>
 #include <algorithm>
 extern "C" {
@@ -27,6 +28,8 @@ extern "C" {
 
 #include "minilog.h"
 #include "resampler.h"
+#include "sampleconversion.h"
+#include "rwlock.h"
 #include "libav.h"
 
 // We define some macros to be compatible to different libav versions
@@ -51,12 +54,36 @@ extern "C" {
 #define AV_PACKET_UNREF av_packet_unref
 #endif
 
+// Old libav versions decode with the codec context of a stream, newer ones
+// need a codec context of their own (libavcodec < 57.14 for libav, < 57.33
+// for ffmpeg).
+#if (LIBAVCODEC_VERSION_INT < AV_VERSION_INT(57, 14, 0)) || ((LIBAVCODEC_VERSION_MICRO >= 100) && (LIBAVCODEC_VERSION_INT < AV_VERSION_INT(57, 33, 100)))
+#define HAVE_STREAM_CODEC_CONTEXT
+#endif
+
+#if LIBAVFORMAT_VERSION_INT < AV_VERSION_INT(57, 80, 100)
+#define AVIO_CONTEXT_FREE av_freep
+#else
+#define AVIO_CONTEXT_FREE avio_context_free
+#endif
+
 namespace musly {
 namespace decoders {
 
+namespace {
+
+/** Serializes the libav calls that are not thread-safe (opening and closing
+ * codecs and inputs) over all decoder instances, which are used from
+ * several threads by musly_track_analyze_audiofiles().
+ */
+rwlock codec_lock;
+
+}  // namespace
+
 MUSLY_DECODER_REGIMPL(libav, 0);
 
-libav::libav()
+libav::libav() :
+        frame(NULL)
 {
 #if LIBAVFORMAT_VERSION_INT < AV_VERSION_INT(58, 9, 100)
     av_register_all();
@@ -66,41 +93,199 @@ libav::libav()
 #endif
 }
 
+libav::~libav()
+{
+#ifndef HAVE_STREAM_CODEC_CONTEXT
+    {
+    write_guard guard(codec_lock);
+    for (std::map<int, cached_codec>::iterator c = codecs.begin();
+            c != codecs.end(); ++c) {
+        avcodec_close(c->second.context);
+        avcodec_free_context(&c->second.context);
+    }
+    }
+#endif
+    if (frame) {
+        AV_FRAME_FREE(&frame);
+    }
+    for (std::map<int, resampler*>::iterator r = resamplers.begin();
+            r != resamplers.end(); ++r) {
+        delete r->second;
+    }
+}
+
+AVCodecContext*
+libav::open_codec(
+        AVStream* st)
+{
+    int avret;
+#ifdef HAVE_STREAM_CODEC_CONTEXT
+    // old libav version: stream has a codec context we can use
+    AVCodecContext* decx = st->codec;
+#else
+    // new libav version: reuse the codec context of an earlier stream if it
+    // was opened with the same parameters, or create one for the stream
+    AVCodecParameters* decp = st->codecpar;
+    std::vector<uint8_t> extradata(decp->extradata,
+            decp->extradata + decp->extradata_size);
+    std::map<int, cached_codec>::iterator c = codecs.find(decp->codec_id);
+    if (c != codecs.end()) {
+        cached_codec& cached = c->second;
+        if ((cached.sample_rate == decp->sample_rate) &&
+                (cached.channels == decp->channels) &&
+                (cached.block_align == decp->block_align) &&
+                (cached.extradata == extradata)) {
+            // reset the decoder state, and the stream properties a decoder
+            // may have updated while decoding the previous stream
+            AVCodecContext* decx = cached.context;
+            avcodec_flush_buffers(decx);
+            decx->sample_rate = decp->sample_rate;
+            decx->channels = decp->channels;
+            decx->channel_layout = decp->channel_layout;
+    #if LIBAVCODEC_VERSION_MICRO >= 100
+    #if LIBAVCODEC_VERSION_INT < AV_VERSION_INT(58,3,102)
+            av_codec_set_pkt_timebase(decx, st->time_base);
+    #endif
+    #endif
+            return decx;
+        }
+
+        // the parameters differ: replace the cached codec context
+        {
+        write_guard guard(codec_lock);
+        avcodec_close(cached.context);
+        avcodec_free_context(&cached.context);
+        }
+        codecs.erase(c);
+    }
+
+    AVCodecContext* decx = avcodec_alloc_context3(NULL);
+    if (!decx) {
+        MINILOG(logERROR) << "Could not allocate codec context";
+        return NULL;
+    }
+    avret = avcodec_parameters_to_context(decx, decp);
+    if (avret < 0) {
+        MINILOG(logERROR) << "Could not set codec context";
+
+        avcodec_free_context(&decx);
+        return NULL;
+    }
+    #if LIBAVCODEC_VERSION_MICRO >= 100
+    #if LIBAVCODEC_VERSION_INT < AV_VERSION_INT(58,3,102)
+    // only available in ffmpeg, deprecated after 58
+    av_codec_set_pkt_timebase(decx, st->time_base);
+    #endif
+    #endif
+#endif
+
+    // find a decoder for the stream
+    AVCodec *dec = avcodec_find_decoder(decx->codec_id);
+    if (!dec) {
+        MINILOG(logERROR) << "Could not find codec.";
+
+#ifndef HAVE_STREAM_CODEC_CONTEXT
+        avcodec_free_context(&decx);
+#endif
+        return NULL;
+    }
+
+    // open the decoder
+    // (kindly ask for stereo downmix and floats, but not all decoders care)
+    decx->request_channel_layout = AV_CH_LAYOUT_STEREO_DOWNMIX;
+    decx->request_sample_fmt = AV_SAMPLE_FMT_FLT;
+    {
+    write_guard guard(codec_lock);
+    avret = avcodec_open2(decx, dec, NULL);
+    }
+    if (avret < 0) {
+        MINILOG(logERROR) << "Could not open codec.";
+
+#ifndef HAVE_STREAM_CODEC_CONTEXT
+        avcodec_free_context(&decx);
+#endif
+        return NULL;
+    }
+
+#ifndef HAVE_STREAM_CODEC_CONTEXT
+    cached_codec cached = {decx, decp->sample_rate, decp->channels,
+            decp->block_align, extradata};
+    codecs[decp->codec_id] = cached;
+#endif
+    return decx;
+}
+
+void
+libav::release_codec(
+        AVCodecContext* decx)
+{
+#ifdef HAVE_STREAM_CODEC_CONTEXT
+    // the codec context belongs to the stream, close it before the stream
+    {
+    write_guard guard(codec_lock);
+    avcodec_close(decx);
+    }
+#else
+    // the codec context stays cached for the next stream
+    (void)decx;
+#endif
+}
+
+resampler*
+libav::get_resampler(
+        int input_rate,
+        int output_rate)
+{
+    // the output rate is always the same, so key by the input rate only
+    std::map<int, resampler*>::iterator r = resamplers.find(input_rate);
+    if (r != resamplers.end()) {
+        return r->second;
+    }
+    resampler* res = new resampler(input_rate, output_rate);
+    resamplers[input_rate] = res;
+    return res;
+}
+
 int
-libav::samples_tofloat(
-        void* const out,
-        const void* const in,
-        const int out_stride,
-        const int in_stride,
-        const AVSampleFormat in_fmt,
+libav::samples_tomono(
+        float* out,
+        const uint8_t* const* data,
+        const AVSampleFormat fmt,
+        int channels,
         int len)
 {
-    const int is = in_stride;
-    const int os = out_stride;
-    const uint8_t* pi = (uint8_t*)in;
-    uint8_t* po = (uint8_t*)out;
-    uint8_t* end = po + os*len;
-
-#define CONVFLOAT(ifmt, ifmtp, expr)\
-if (in_fmt == ifmt || in_fmt == ifmtp) {\
-    do{\
-        *(float*)po = expr; pi += is; po += os;\
-    } while(po < end);\
-}
+    if ((channels != 1) && (channels != 2)) {
+        return -1;
+    }
+    const bool planar = av_sample_fmt_is_planar(fmt);
+
     // Implementation note: We could use av_get_packed_sample_fmt
     // to avoid checking for two formats each time, but we want to
     // stay compatible to libav versions that do not have it yet.
-    CONVFLOAT(AV_SAMPLE_FMT_U8, AV_SAMPLE_FMT_U8P,
-            (*(const uint8_t*)pi - 0x80)*(1.0 / (1<<7)))
-    else CONVFLOAT(AV_SAMPLE_FMT_S16, AV_SAMPLE_FMT_S16P,
-            *(const int16_t*)pi*(1.0 / (1<<15)))
-    else CONVFLOAT(AV_SAMPLE_FMT_S32, AV_SAMPLE_FMT_S32P,
-            *(const int32_t*)pi*(1.0 / (1U<<31)))
-    else CONVFLOAT(AV_SAMPLE_FMT_FLT, AV_SAMPLE_FMT_FLTP,
-            *(const float*)pi)
-    else CONVFLOAT(AV_SAMPLE_FMT_DBL, AV_SAMPLE_FMT_DBLP,
-            *(const double*)pi)
-    else return -1;
+    switch (fmt) {
+    case AV_SAMPLE_FMT_U8:
+    case AV_SAMPLE_FMT_U8P:
+        convert_tomono<uint8_t>(out, data, planar, channels, len);
+        break;
+    case AV_SAMPLE_FMT_S16:
+    case AV_SAMPLE_FMT_S16P:
+        convert_tomono<int16_t>(out, data, planar, channels, len);
+        break;
+    case AV_SAMPLE_FMT_S32:
+    case AV_SAMPLE_FMT_S32P:
+        convert_tomono<int32_t>(out, data, planar, channels, len);
+        break;
+    case AV_SAMPLE_FMT_FLT:
+    case AV_SAMPLE_FMT_FLTP:
+        convert_tomono<float>(out, data, planar, channels, len);
+        break;
+    case AV_SAMPLE_FMT_DBL:
+    case AV_SAMPLE_FMT_DBLP:
+        convert_tomono<double>(out, data, planar, channels, len);
+        break;
+    default:
+        return -1;
+    }
 
     return 0;
 }
@@ -123,17 +308,11 @@ void libav_log_callback(void *ptr, int level, const char *fmt, va_list vargs)
     }
 }
 
-std::vector<float>
-libav::decodeto_22050hz_mono_float(
-        const std::string& file,
-        float excerpt_length,
-        float excerpt_start)
-{
-    MINILOG(logTRACE) << "Decoding: " << file << " started.";
-
-    const int target_rate = 22050;
-    int avret;
+namespace {
 
+void
+set_loglevel()
+{
     // show libav messages only in verbose mode
     if (MiniLog::current_level() >= logTRACE) {
         av_log_set_level(AV_LOG_VERBOSE);
@@ -142,20 +321,148 @@ libav::decodeto_22050hz_mono_float(
     else {
         av_log_set_level(AV_LOG_PANIC);
     }
+}
+
+/** The callbacks of a stream passed to
+ * libav::decodestream_22050hz_mono_float(), as the opaque pointer of an
+ * AVIOContext.
+ */
+struct stream_callbacks {
+    musly_read_callback read;
+    musly_seek_callback seek;
+    void* opaque;
+};
+
+int
+stream_read(
+        void* opaque,
+        uint8_t* buf,
+        int buf_size)
+{
+    stream_callbacks* s = reinterpret_cast<stream_callbacks*>(opaque);
+    int ret = s->read(s->opaque, buf, buf_size);
+    if (ret == 0) {
+        return AVERROR_EOF;
+    }
+    if (ret < 0) {
+        return AVERROR(EIO);
+    }
+    return ret;
+}
+
+int64_t
+stream_seek(
+        void* opaque,
+        int64_t offset,
+        int whence)
+{
+    stream_callbacks* s = reinterpret_cast<stream_callbacks*>(opaque);
+    if (whence & AVSEEK_SIZE) {
+        // libav asks for the size (AVSEEK_FORCE may be set as well); find it
+        // by seeking to the end and back, a negative result means unknown
+        long long pos = s->seek(s->opaque, 0, SEEK_CUR);
+        if (pos < 0) {
+            return -1;
+        }
+        long long size = s->seek(s->opaque, 0, SEEK_END);
+        if (s->seek(s->opaque, pos, SEEK_SET) < 0) {
+            return -1;
+        }
+        return size;
+    }
+    return s->seek(s->opaque, offset, whence & ~AVSEEK_FORCE);
+}
+
+}  // namespace
+
+std::vector<float>
+libav::decodeto_22050hz_mono_float(
+        const std::string& file,
+        float excerpt_length,
+        float excerpt_start)
+{
+    MINILOG(logTRACE) << "Decoding: " << file << " started.";
+    set_loglevel();
 
     // guess input format
     AVFormatContext* fmtx = NULL;
-    avret = avformat_open_input(&fmtx, file.c_str(), NULL, NULL);
+    int avret = avformat_open_input(&fmtx, file.c_str(), NULL, NULL);
     if (avret < 0) {
         MINILOG(logERROR) << "Could not open file, or detect file format";
         return std::vector<float>(0);
     }
 
+    std::vector<float> pcm = decode(fmtx, excerpt_length, excerpt_start);
+    MINILOG(logTRACE) << "Decoding: " << file << " finalized.";
+    return pcm;
+}
+
+std::vector<float>
+libav::decodestream_22050hz_mono_float(
+        musly_read_callback read,
+        musly_seek_callback seek,
+        void* opaque,
+        float excerpt_length,
+        float excerpt_start)
+{
+    MINILOG(logTRACE) << "Decoding stream started.";
+    if (!read) {
+        return std::vector<float>(0);
+    }
+    set_loglevel();
+
+    // let libav read through the callbacks
+    stream_callbacks callbacks = {read, seek, opaque};
+    const int buffer_size = 32768;
+    unsigned char* buffer = (unsigned char*)av_malloc(buffer_size);
+    AVIOContext* avio = NULL;
+    if (buffer) {
+        avio = avio_alloc_context(buffer, buffer_size, 0, &callbacks,
+                stream_read, NULL, seek ? stream_seek : NULL);
+    }
+    AVFormatContext* fmtx = avio ? avformat_alloc_context() : NULL;
+    if (!fmtx) {
+        MINILOG(logERROR) << "Could not allocate stream context";
+        if (avio) {
+            buffer = avio->buffer;
+            AVIO_CONTEXT_FREE(&avio);
+        }
+        av_free(buffer);
+        return std::vector<float>(0);
+    }
+    fmtx->pb = avio;
+
+    // guess input format (on failure, this frees the format context, but
+    // not the AVIOContext we passed in)
+    std::vector<float> pcm;
+    if (avformat_open_input(&fmtx, NULL, NULL, NULL) < 0) {
+        MINILOG(logERROR) << "Could not detect stream format";
+    }
+    else {
+        pcm = decode(fmtx, excerpt_length, excerpt_start);
+    }
+
+    // the AVIOContext and its buffer (which libav may have replaced) are not
+    // freed with the format context
+    av_freep(&avio->buffer);
+    AVIO_CONTEXT_FREE(&avio);
+
+    MINILOG(logTRACE) << "Decoding stream finalized.";
+    return pcm;
+}
+
+std::vector<float>
+libav::decode(
+        AVFormatContext* fmtx,
+        float excerpt_length,
+        float excerpt_start)
+{
+    const int target_rate = 22050;
+    int avret;
+
     // retrieve stream information
-#ifdef _OPENMP
-    #pragma omp critical
-#endif
     {
+    write_guard guard(codec_lock);
     avret = avformat_find_stream_info(fmtx, NULL);
     }
     if (avret < 0) {
@@ -176,61 +483,9 @@ libav::decodeto_22050hz_mono_float(
     }
     AVStream *st = fmtx->streams[audio_stream_idx];
 
-    // find a decoder for the stream
-#if (LIBAVCODEC_VERSION_INT < AV_VERSION_INT(57, 14, 0)) || ((LIBAVCODEC_VERSION_MICRO >= 100) && (LIBAVCODEC_VERSION_INT < AV_VERSION_INT(57, 33, 100)))
-    // old libav version (libavcodec < 57.14 for libav, < 57.33 for ffmpeg):
-    // stream has a codec context we can use
-    AVCodecContext *decx = st->codec;
-    #define AVCODEC_FREE_CONTEXT(x)
-#else
-    // new libav version: need to create codec context for stream
-    AVCodecParameters *decp = st->codecpar;
-    AVCodecContext *decx = avcodec_alloc_context3(NULL);
+    // open a decoder for the stream
+    AVCodecContext* decx = open_codec(st);
     if (!decx) {
-        MINILOG(logERROR) << "Could not allocate codec context";
-
-        avformat_close_input(&fmtx);
-        return std::vector<float>(0);
-    }
-    avret = avcodec_parameters_to_context(decx, decp);
-    if (avret < 0) {
-        MINILOG(logERROR) << "Could not set codec context";
-
-        avcodec_free_context(&decx);
-        avformat_close_input(&fmtx);
-        return std::vector<float>(0);
-    }
-    #if LIBAVCODEC_VERSION_MICRO >= 100
-    #if LIBAVCODEC_VERSION_INT < AV_VERSION_INT(58,3,102)
-    // only available in ffmpeg, deprecated after 58
-    av_codec_set_pkt_timebase(decx, st->time_base);
-    #endif
-    #endif
-    #define AVCODEC_FREE_CONTEXT(x) avcodec_free_context(x)
-#endif
-    AVCodec *dec = avcodec_find_decoder(decx->codec_id);
-    if (!dec) {
-        MINILOG(logERROR) << "Could not find codec.";
-
-        AVCODEC_FREE_CONTEXT(&decx);
-        avformat_close_input(&fmtx);
-        return std::vector<float>(0);
-    }
-
-    // open the decoder
-    // (kindly ask for stereo downmix and floats, but not all decoders care)
-    decx->request_channel_layout = AV_CH_LAYOUT_STEREO_DOWNMIX;
-    decx->request_sample_fmt = AV_SAMPLE_FMT_FLT;
-#ifdef _OPENMP
-    #pragma omp critical
-#endif
-    {
-    avret = avcodec_open2(decx, dec, NULL);
-    }
-    if (avret < 0) {
-        MINILOG(logERROR) << "Could not open codec.";
-
-        AVCODEC_FREE_CONTEXT(&decx);
         avformat_close_input(&fmtx);
         return std::vector<float>(0);
     }
@@ -240,17 +495,19 @@ libav::decodeto_22050hz_mono_float(
         MINILOG(logWARNING) << "Unsupported number of channels: "
                 << decx->channels;
 
-        AVCODEC_FREE_CONTEXT(&decx);
+        release_codec(decx);
         avformat_close_input(&fmtx);
         return std::vector<float>(0);
     }
 
-    // allocate a frame
-    AVFrame* frame = AV_FRAME_ALLOC();
+    // allocate a frame, once for all files
+    if (!frame) {
+        frame = AV_FRAME_ALLOC();
+    }
     if (!frame) {
         MINILOG(logWARNING) << "Could not allocate frame";
 
-        AVCODEC_FREE_CONTEXT(&decx);
+        release_codec(decx);
         avformat_close_input(&fmtx);
         return std::vector<float>(0);
     }
@@ -263,9 +520,6 @@ libav::decodeto_22050hz_mono_float(
     int got_frame = 0;
 
     // configuration
-    const int input_stride = av_get_bytes_per_sample(decx->sample_fmt);
-    const int num_planes = av_sample_fmt_is_planar(decx->sample_fmt) ? decx->channels : 1;
-    const int output_stride = sizeof(float) * num_planes;
     int decode_samples;  // how many samples to decode; zero to decode all
 
     if (st->duration) {  // if the file length is (at least approximately) known:
@@ -335,9 +589,10 @@ libav::decodeto_22050hz_mono_float(
     // read packets
     const int channels = decx->channels;
     const int sample_rate = decx->sample_rate;
-    float* buffer = NULL;
-    int buffersize = 0;
-    std::vector<float> decoded_pcm;
+    decoded_pcm.clear();
+    if (decode_samples > 0) {
+        decoded_pcm.reserve(decode_samples);
+    }
     int subsequent_errors = 0;
     const int subsequent_errors_max = 20;
     while ((decode_samples == 0) || ((int)decoded_pcm.size() < decode_samples))
@@ -400,12 +655,10 @@ libav::decodeto_22050hz_mono_float(
 
                 // if too many frames failed decoding, abort
                 MINILOG(logERROR) << "Too many errors, aborting.";
-                AV_FRAME_FREE(&frame);
+                AV_FRAME_UNREF(frame);
                 AV_PACKET_UNREF(&pkt);
+                release_codec(decx);
                 avformat_close_input(&fmtx);
-                if (buffer) {
-                    delete[] buffer;
-                }
                 return std::vector<float>(0);
             } else {
                 subsequent_errors = 0;
@@ -413,47 +666,22 @@ libav::decodeto_22050hz_mono_float(
 
             // if we got a frame
             if (got_frame) {
-                // do we need to increase the buffer size?
-                int input_samples = frame->nb_samples*decx->channels;
-                if (input_samples > buffersize) {
-                    if (buffer) {
-                        delete[] buffer;
-                    }
-                    buffer = new float[input_samples];
-                    buffersize = input_samples;
-                }
-
-                // convert samples to float
-                // If we have planar samples (num_planes > 1), the channels
-                // are stored in separate frame->data[i] arrays and we
-                // convert to interleaved samples on the way.
-                for (int i = 0; i < num_planes; i++) {
-                    if (samples_tofloat(buffer + i, frame->data[i],
-                            output_stride, input_stride,
-                            decx->sample_fmt,
-                            input_samples / num_planes) < 0) {
-                        MINILOG(logERROR) << "Strange sample format. Abort.";
-
-                        AV_FRAME_FREE(&frame);
-                        AV_PACKET_UNREF(&pkt);
-                        avformat_close_input(&fmtx);
-                        if (buffer) {
-                            delete[] buffer;
-                        }
-                        return decoded_pcm;
-                    }
-                }
-
-                // inplace downmix to mono, if required
-                if (decx->channels == 2) {
-                    for (int i = 0; i < frame->nb_samples; i++) {
-                        buffer[i] = (buffer[i*2] + buffer[i*2+1]) / 2.0f;
-                    }
+                // convert samples to float and downmix to mono, directly
+                // into the decoded signal
+                size_t offset = decoded_pcm.size();
+                decoded_pcm.resize(offset + frame->nb_samples);
+                if (samples_tomono(&decoded_pcm[offset], frame->data,
+                        decx->sample_fmt, decx->channels,
+                        frame->nb_samples) < 0) {
+                    MINILOG(logERROR) << "Strange sample format. Abort.";
+
+                    decoded_pcm.resize(offset);
+                    AV_FRAME_UNREF(frame);
+                    AV_PACKET_UNREF(&pkt);
+                    release_codec(decx);
+                    avformat_close_input(&fmtx);
+                    return decoded_pcm;
                 }
-
-                // store raw pcm data
-                decoded_pcm.insert(decoded_pcm.end(), buffer,
-                        buffer+frame->nb_samples);
             }
 
             // consume the packet
@@ -502,29 +730,23 @@ libav::decodeto_22050hz_mono_float(
     if (target_rate != decx->sample_rate) {
         MINILOG(logTRACE) << "Resampling signal. input="
                 << decx->sample_rate << ", target=" << target_rate;
-        resampler r(decx->sample_rate, target_rate);
-        pcm = r.resample(decoded_pcm.data() + skip_samples, decoded_pcm.size() - skip_samples);
+        resampler* r = get_resampler(decx->sample_rate, target_rate);
+        r->resample(decoded_pcm.data() + skip_samples,
+                decoded_pcm.size() - skip_samples, pcm);
         MINILOG(logTRACE) << "Resampling finished.";
     } else {
         pcm.resize(decoded_pcm.size() - skip_samples);
         std::copy(decoded_pcm.begin() + skip_samples, decoded_pcm.end(), pcm.begin());
     }
 
-    // cleanup
-    if (buffer) {
-        delete[] buffer;
-    }
-    AV_FRAME_FREE(&frame);
-#ifdef _OPENMP
-    #pragma omp critical
-#endif
+    // cleanup (the frame and codec context are kept for the next file)
+    AV_FRAME_UNREF(frame);
+    release_codec(decx);
     {
-    avcodec_close(decx);
-    AVCODEC_FREE_CONTEXT(&decx);
+    write_guard guard(codec_lock);
     avformat_close_input(&fmtx);
     }
 
-    MINILOG(logTRACE) << "Decoding: " << file << " finalized.";
     return pcm;
 }
 
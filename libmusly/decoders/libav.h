@@ -15,9 +15,13 @@
 
 extern "C" {
     #include <libavcodec/avcodec.h>
+    #include <libavformat/avformat.h>
 }
 
+#include <map>
+#include <vector>
 #include "decoder.h"
+#include "resampler.h"
 
 namespace musly {
 namespace decoders {
@@ -28,23 +32,93 @@ class libav :
     MUSLY_DECODER_REGCLASS(libav);
 
 private:
+    /** An opened codec context, kept to decode further streams with the same
+     * codec parameters.
+     */
+    struct cached_codec {
+        AVCodecContext* context;
+        int sample_rate;
+        int channels;
+        int block_align;
+        std::vector<uint8_t> extradata;
+    };
+
+    /** The opened codec contexts by codec id. A libav instance decodes one
+     * file at a time, so it keeps them, its frame and its resamplers across
+     * files instead of setting them up for every file.
+     */
+    std::map<int, cached_codec> codecs;
+
+    /** The frame to decode into.
+     */
+    AVFrame* frame;
+
+    /** The resamplers to 22050 Hz by input sample rate.
+     */
+    std::map<int, resampler*> resamplers;
+
+    /** The decoded signal at the input sample rate.
+     */
+    std::vector<float> decoded_pcm;
+
+    /** Returns an opened codec context for the audio stream \p st, reusing
+     * a cached one if the codec parameters match, or NULL on failure.
+     */
+    AVCodecContext*
+    open_codec(
+            AVStream* st);
+
+    /** Releases a codec context returned by open_codec() after decoding.
+     */
+    void
+    release_codec(
+            AVCodecContext* decx);
+
+    /** Returns the cached resampler from \p input_rate to \p output_rate.
+     */
+    resampler*
+    get_resampler(
+            int input_rate,
+            int output_rate);
+
+    /** Converts \p len samples of each of \p channels channels (1 or 2) in
+     * the sample format \p fmt to a mono float signal, in a single pass.
+     * \returns 0 on success, -1 for an unsupported format.
+     */
     int
-    samples_tofloat(
-            void* const out,
-            const void* const in,
-            const int out_stride,
-            const int in_stride,
-            const AVSampleFormat in_fmt,
+    samples_tomono(
+            float* out,
+            const uint8_t* const* data,
+            const AVSampleFormat fmt,
+            int channels,
             int len);
 
+    /** Decodes the best audio stream of an opened input to a 22050 Hz mono
+     * signal, and closes the input.
+     */
+    std::vector<float>
+    decode(
+            AVFormatContext* fmtx,
+            float excerpt_length,
+            float excerpt_start);
+
 public:
     libav();
+    virtual ~libav();
 
     virtual std::vector<float>
     decodeto_22050hz_mono_float(
             const std::string& file,
             float excerpt_length,
             float excerpt_start);
+
+    virtual std::vector<float>
+    decodestream_22050hz_mono_float(
+            musly_read_callback read,
+            musly_seek_callback seek,
+            void* opaque,
+            float excerpt_length,
+            float excerpt_start);
 };
 
 } /* namespace decoders */
@@ -0,0 +1,96 @@
+/**
+ * Copyright 2013-2014, Dominik Schnitzer <dominik@schnitzer.at>
+ *           2014-2016, Jan Schlueter <jan.schlueter@ofai.at>
+ *
+ * This file is part of Musly, a program for high performance music
+ * similarity computation: http://www.musly.org/.
+ *
+ * This Source Code Form is subject to the terms of the Mozilla
+ * Public License v. 2.0. If a copy of the MPL was not distributed
+ * with this file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+#ifndef MUSLY_DECODERS_SAMPLECONVERSION_H_
+#define MUSLY_DECODERS_SAMPLECONVERSION_H_
+
+#include <stdint.h>
+
+namespace musly {
+namespace decoders {
+
+/** Converts a sample to a float in [-1, 1).
+ */
+inline float
+sample_tofloat(
+        uint8_t s)
+{
+    return (s - 0x80) * (1.0f / (1<<7));
+}
+
+inline float
+sample_tofloat(
+        int16_t s)
+{
+    return s * (1.0f / (1<<15));
+}
+
+inline float
+sample_tofloat(
+        int32_t s)
+{
+    return s * (1.0f / (1U<<31));
+}
+
+inline float
+sample_tofloat(
+        float s)
+{
+    return s;
+}
+
+inline float
+sample_tofloat(
+        double s)
+{
+    return (float)s;
+}
+
+/** Converts \p len mono or stereo samples of type T to mono floats. Planar
+ * stereo samples are read from \p data[0] and \p data[1], all others from
+ * \p data[0]. Each case is a plain loop over contiguous arrays, so the
+ * compiler vectorizes it. This does not depend on libav, so it can be
+ * tested on its own.
+ */
+template <typename T>
+void
+convert_tomono(
+        float* out,
+        const uint8_t* const* data,
+        bool planar,
+        int channels,
+        int len)
+{
+    if (channels == 1) {
+        const T* in = reinterpret_cast<const T*>(data[0]);
+        for (int i = 0; i < len; i++) {
+            out[i] = sample_tofloat(in[i]);
+        }
+    }
+    else if (planar) {
+        const T* left = reinterpret_cast<const T*>(data[0]);
+        const T* right = reinterpret_cast<const T*>(data[1]);
+        for (int i = 0; i < len; i++) {
+            out[i] = (sample_tofloat(left[i]) + sample_tofloat(right[i])) / 2.0f;
+        }
+    }
+    else {
+        const T* in = reinterpret_cast<const T*>(data[0]);
+        for (int i = 0; i < len; i++) {
+            out[i] = (sample_tofloat(in[2*i]) + sample_tofloat(in[2*i+1])) / 2.0f;
+        }
+    }
+}
+
+} /* namespace decoders */
+} /* namespace musly */
+#endif /* MUSLY_DECODERS_SAMPLECONVERSION_H_ */
@@ -0,0 +1,229 @@
+/**
+ * Copyright 2013-2014, Dominik Schnitzer <dominik@schnitzer.at>
+ *                2014, Jan Schlueter <jan.schlueter@ofai.at>
+ *
+ * This file is part of Musly, a program for high performance music
+ * similarity computation: http://www.musly.org/.
+ *
+ * This Source Code Form is subject to the terms of the Mozilla
+ * Public License v. 2.0. If a copy of the MPL was not distributed
+ * with this file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+#define _USE_MATH_DEFINES
+#include <cmath>
+#include <cstdlib>
+#include <algorithm>
+#include "minilog.h"
+#include "fft.h"
+
+#ifndef MUSLY_FFT_DEFAULT
+#define MUSLY_FFT_DEFAULT "lanes"
+#endif
+
+namespace musly {
+
+fft::~fft()
+{
+}
+
+fft*
+fft::create(
+        const Eigen::VectorXf& win_funct)
+{
+    const char* name = getenv("MUSLY_FFT");
+    return create(win_funct, name ? name : MUSLY_FFT_DEFAULT);
+}
+
+fft*
+fft::create(
+        const Eigen::VectorXf& win_funct,
+        const std::string& name)
+{
+    if ((name == "lanes") && lanesfft::supports(win_funct.size())) {
+        return new lanesfft(win_funct);
+    }
+    if (name != "kissfft") {
+        MINILOG(logDEBUG) << "FFT backend '" << name << "' not available "
+                << "for window size " << win_funct.size()
+                << ", using kissfft.";
+    }
+    return new kissfft(win_funct);
+}
+
+
+kissfft::kissfft(
+        const Eigen::VectorXf& win_funct) :
+                win_size(win_funct.size()),
+                win_funct(win_funct)
+{
+    // initialize kiss fft
+    kiss_pcm = (kiss_fft_scalar*)malloc(sizeof(kiss_fft_scalar) * win_size);
+    kiss_freq = (kiss_fft_cpx*)malloc(sizeof(kiss_fft_cpx) * (win_size/2 + 1));
+    kiss_status = kiss_fftr_alloc(win_size, 0, NULL, NULL);
+}
+
+kissfft::~kissfft()
+{
+    free(kiss_status);
+    free(kiss_pcm);
+    free(kiss_freq);
+}
+
+void
+kissfft::power_frames(
+        const float* pcm_samples,
+        int hop,
+        int frames,
+        float scale,
+        float* ps)
+{
+    const int freq_bins = win_size/2 + 1;
+    for (int i = 0; i < frames; i++) {
+
+        // fill pcm
+        for (int j = 0; j < win_size; j++) {
+            kiss_pcm[j] = pcm_samples[i*hop+j] * scale * win_funct(j);
+        }
+
+        // fft
+        kiss_fftr(kiss_status, kiss_pcm, kiss_freq);
+
+        // save powerspectrum frame
+        float* psc = ps + (size_t)i*freq_bins;
+        for (int j = 0; j < freq_bins; j++) {
+            psc[j] =
+                    std::pow(kiss_freq[j].r, 2) + std::pow(kiss_freq[j].i, 2);
+        }
+    }
+}
+
+
+bool
+lanesfft::supports(
+        int win_size)
+{
+    return (win_size >= 4) && ((win_size & (win_size - 1)) == 0);
+}
+
+lanesfft::lanesfft(
+        const Eigen::VectorXf& win_funct) :
+                win_size(win_funct.size()),
+                win_funct(win_funct)
+{
+    const int n = win_size / 2;
+
+    int bits = 0;
+    while ((1 << bits) < n) {
+        bits++;
+    }
+    bitrev.resize(n);
+    for (int i = 0; i < n; i++) {
+        int r = 0;
+        for (int b = 0; b < bits; b++) {
+            r |= ((i >> b) & 1) << (bits - 1 - b);
+        }
+        bitrev[i] = r;
+    }
+
+    twiddle_re.resize(std::max(n/2, 1));
+    twiddle_im.resize(std::max(n/2, 1));
+    for (int k = 0; k < n/2; k++) {
+        twiddle_re[k] = cos(2 * M_PI * k / n);
+        twiddle_im[k] = -sin(2 * M_PI * k / n);
+    }
+
+    split_re.resize(n + 1);
+    split_im.resize(n + 1);
+    for (int k = 0; k <= n; k++) {
+        split_re[k] = cos(2 * M_PI * k / win_size);
+        split_im[k] = -sin(2 * M_PI * k / win_size);
+    }
+
+    re.resize(n * lanes);
+    im.resize(n * lanes);
+}
+
+lanesfft::~lanesfft()
+{
+}
+
+void
+lanesfft::power_frames(
+        const float* pcm_samples,
+        int hop,
+        int frames,
+        float scale,
+        float* ps)
+{
+    const int n = win_size / 2;
+    const int freq_bins = n + 1;
+    for (int f = 0; f < frames; f += lanes) {
+        const int count = std::min(lanes, frames - f);
+
+        // load the windowed frames in bit-reversed order, packing even and
+        // odd samples into the real and imaginary parts
+        const float* pcm[lanes];
+        for (int l = 0; l < lanes; l++) {
+            pcm[l] = pcm_samples + (size_t)(f + std::min(l, count - 1))*hop;
+        }
+        for (int i = 0; i < n; i++) {
+            const float w0 = win_funct(2*i) * scale;
+            const float w1 = win_funct(2*i+1) * scale;
+            float* zr = &re[bitrev[i]*lanes];
+            float* zi = &im[bitrev[i]*lanes];
+            for (int l = 0; l < lanes; l++) {
+                zr[l] = pcm[l][2*i] * w0;
+                zi[l] = pcm[l][2*i+1] * w1;
+            }
+        }
+
+        // radix-2 butterflies, each applied to all lanes at once
+        typedef Eigen::Array<float, lanes, 1> lanes_array;
+        typedef Eigen::Map<lanes_array> lanes_map;
+        for (int half = 1; half < n; half *= 2) {
+            const int step = n / (2*half);
+            for (int start = 0; start < n; start += 2*half) {
+                for (int k = 0; k < half; k++) {
+                    const float wr = twiddle_re[k*step];
+                    const float wi = twiddle_im[k*step];
+                    lanes_map ar(&re[(start + k)*lanes]);
+                    lanes_map ai(&im[(start + k)*lanes]);
+                    lanes_map br(&re[(start + k + half)*lanes]);
+                    lanes_map bi(&im[(start + k + half)*lanes]);
+                    lanes_array tr = br*wr - bi*wi;
+                    lanes_array ti = br*wi + bi*wr;
+                    br = ar - tr;
+                    bi = ai - ti;
+                    ar += tr;
+                    ai += ti;
+                }
+            }
+        }
+
+        // split the complex spectrum Z into the spectrum X of the real
+        // signal, X[k] = E[k] - i exp(-2 pi i k / N) O[k] with
+        // E[k] = (Z[k] + conj(Z[n-k])) / 2 and O[k] = (Z[k] - conj(Z[n-k])) / 2,
+        // and save its squared magnitudes
+        for (int k = 0; k <= n; k++) {
+            const int a = (k == n) ? 0 : k;
+            const int b = (k == 0) ? 0 : n - k;
+            lanes_map ar(&re[a*lanes]);
+            lanes_map ai(&im[a*lanes]);
+            lanes_map br(&re[b*lanes]);
+            lanes_map bi(&im[b*lanes]);
+            lanes_array er = 0.5f * (ar + br);
+            lanes_array ei = 0.5f * (ai - bi);
+            lanes_array or_ = 0.5f * (ar - br);
+            lanes_array oi = 0.5f * (ai + bi);
+            lanes_array xr = er + split_re[k]*oi + split_im[k]*or_;
+            lanes_array xi = ei - split_re[k]*or_ + split_im[k]*oi;
+            lanes_array power = xr.square() + xi.square();
+            for (int l = 0; l < count; l++) {
+                ps[(size_t)(f + l)*freq_bins + k] = power[l];
+            }
+        }
+    }
+}
+
+} /* namespace musly */
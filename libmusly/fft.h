@@ -0,0 +1,187 @@
+/**
+ * Copyright 2013-2014, Dominik Schnitzer <dominik@schnitzer.at>
+ *                2014, Jan Schlueter <jan.schlueter@ofai.at>
+ *
+ * This file is part of Musly, a program for high performance music
+ * similarity computation: http://www.musly.org/.
+ *
+ * This Source Code Form is subject to the terms of the Mozilla
+ * Public License v. 2.0. If a copy of the MPL was not distributed
+ * with this file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+#ifndef MUSLY_FFT_H_
+#define MUSLY_FFT_H_
+
+#include <string>
+#include <vector>
+#include <Eigen/Core>
+extern "C" {
+    #include "kissfft/kiss_fftr.h"
+}
+
+namespace musly {
+
+/** An FFT backend computing the power spectra of windowed frames of a PCM
+ * signal. Use create() to obtain the backend selected for this build.
+ */
+class fft {
+public:
+    virtual
+    ~fft();
+
+    /** Computes the power spectra of consecutive frames. Frame \c i
+     * consists of the window size samples starting at <tt>i * hop</tt>,
+     * multiplied with \p scale and the window function.
+     * \param pcm_samples At least <tt>(frames-1) * hop + window size</tt>
+     * PCM samples.
+     * \param hop The distance of two frames in samples.
+     * \param frames The number of frames to transform.
+     * \param scale The factor to multiply the samples with.
+     * \param ps Receives <tt>window size / 2 + 1</tt> squared magnitudes per
+     * frame, one frame after the other.
+     */
+    virtual void
+    power_frames(
+            const float* pcm_samples,
+            int hop,
+            int frames,
+            float scale,
+            float* ps) = 0;
+
+    /** Returns the name of the backend.
+     */
+    virtual const char*
+    name() const = 0;
+
+    /** Creates an FFT backend for the given window function. The backend is
+     * named by the environment variable \c MUSLY_FFT if set, or else by the
+     * \c MUSLY_FFT_DEFAULT definition given at build time. If the named
+     * backend is unknown or does not support the window size, the
+     * "kissfft" backend is used.
+     */
+    static fft*
+    create(
+            const Eigen::VectorXf& win_funct);
+
+    /** Creates the FFT backend \p name, see create().
+     */
+    static fft*
+    create(
+            const Eigen::VectorXf& win_funct,
+            const std::string& name);
+};
+
+/** The FFT backend based on KissFFT, transforming one frame at a time. It
+ * supports all window sizes.
+ */
+class kissfft :
+        public fft
+{
+private:
+    int win_size;
+    Eigen::VectorXf win_funct;
+
+    /** KissFFT internal representation of the PCM data.
+     */
+    kiss_fft_scalar* kiss_pcm;
+
+    /** KissFFT internal of the frequency spectrum.
+     */
+    kiss_fft_cpx* kiss_freq;
+
+    /** KissFFT internal of the FFT status.
+     */
+    kiss_fftr_cfg kiss_status;
+
+public:
+    kissfft(
+            const Eigen::VectorXf& win_funct);
+
+    virtual
+    ~kissfft();
+
+    virtual void
+    power_frames(
+            const float* pcm_samples,
+            int hop,
+            int frames,
+            float scale,
+            float* ps);
+
+    virtual const char*
+    name() const {
+        return "kissfft";
+    }
+};
+
+/** The bundled FFT backend, transforming #lanes frames in lockstep. The
+ * frames are interleaved sample by sample, so every butterfly is applied to
+ * all lanes at once as a fixed-size Eigen array, which Eigen vectorizes.
+ * Incomplete batches are padded with copies of the last frame. A real FFT of size N is
+ * computed as a complex radix-2 FFT of size N/2. The window function is
+ * applied while loading the frames, and the squared magnitudes are computed
+ * while splitting the complex spectrum. Only supports window sizes that are
+ * powers of two (at least 4).
+ */
+class lanesfft :
+        public fft
+{
+private:
+    int win_size;
+    Eigen::VectorXf win_funct;
+
+    /** The bit-reversed index of each complex sample.
+     */
+    std::vector<int> bitrev;
+
+    /** The twiddle factors exp(-2 pi i k / (N/2)), for k < N/4.
+     */
+    std::vector<float> twiddle_re;
+    std::vector<float> twiddle_im;
+
+    /** The factors exp(-2 pi i k / N) to split the complex spectrum, for
+     * k <= N/2.
+     */
+    std::vector<float> split_re;
+    std::vector<float> split_im;
+
+    /** The real and imaginary parts of the complex samples of all lanes,
+     * interleaved.
+     */
+    std::vector<float> re;
+    std::vector<float> im;
+
+public:
+    /** The number of frames transformed in lockstep.
+     */
+    static const int lanes = 8;
+
+    /** Returns whether the backend supports the given window size.
+     */
+    static bool
+    supports(
+            int win_size);
+
+    lanesfft(
+            const Eigen::VectorXf& win_funct);
+
+    virtual
+    ~lanesfft();
+
+    virtual void
+    power_frames(
+            const float* pcm_samples,
+            int hop,
+            int frames,
+            float scale,
+            float* ps);
+
+    virtual const char*
+    name() const {
+        return "lanes";
+    }
+};
+
+} /* namespace musly */
+#endif /* MUSLY_FFT_H_ */
@@ -0,0 +1,167 @@
+/**
+ * Copyright 2013-2014, Dominik Schnitzer <dominik@schnitzer.at>
+ *                2014, Jan Schlueter <jan.schlueter@ofai.at>
+ *
+ * This file is part of Musly, a program for high performance music
+ * similarity computation: http://www.musly.org/.
+ *
+ * This Source Code Form is subject to the terms of the Mozilla
+ * Public License v. 2.0. If a copy of the MPL was not distributed
+ * with this file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+#include <algorithm>
+#include "minilog.h"
+#include "gaussiananalysis.h"
+
+namespace musly {
+
+gaussian_analysis::gaussian_analysis(
+        const Eigen::VectorXf& win_funct,
+        float hop,
+        melspectrum& mel,
+        mfcc& mfccs,
+        gaussian_statistics& gs,
+        float pcm_scale,
+        int track_mu,
+        int track_covar,
+        int track_covar_inverse,
+        int track_covar_logdet) :
+                own_ps(new powerspectrum(win_funct, hop)),
+                ps(*own_ps),
+                mel(mel),
+                mfccs(mfccs),
+                gs(gs),
+                acc(gs.get_dim()),
+                pcm_scale(pcm_scale),
+                track_mu(track_mu),
+                track_covar(track_covar),
+                track_covar_inverse(track_covar_inverse),
+                track_covar_logdet(track_covar_logdet)
+{
+}
+
+gaussian_analysis::gaussian_analysis(
+        powerspectrum& ps,
+        melspectrum& mel,
+        mfcc& mfccs,
+        gaussian_statistics& gs,
+        float pcm_scale,
+        int track_mu,
+        int track_covar,
+        int track_covar_inverse,
+        int track_covar_logdet) :
+                own_ps(NULL),
+                ps(ps),
+                mel(mel),
+                mfccs(mfccs),
+                gs(gs),
+                acc(gs.get_dim()),
+                pcm_scale(pcm_scale),
+                track_mu(track_mu),
+                track_covar(track_covar),
+                track_covar_inverse(track_covar_inverse),
+                track_covar_logdet(track_covar_logdet)
+{
+}
+
+gaussian_analysis::~gaussian_analysis()
+{
+    delete own_ps;
+}
+
+void
+gaussian_analysis::analyze_frames(
+        const float* pcm,
+        int frames)
+{
+    const int hop_size = ps.get_hopsize();
+    for (int i = 0; i < frames; i += block_frames) {
+        int count = std::min(block_frames, frames - i);
+
+        // PCM --> powerspectrum --> Mel --> MFCC
+        ps.from_pcm_frames(pcm + (size_t)i*hop_size, count, pcm_scale,
+                block_ps);
+        acc.add(mfccs.from_melspectrum(mel.from_powerspectrum(block_ps)));
+    }
+}
+
+void
+gaussian_analysis::analyze_pending()
+{
+    const int win_size = ps.get_windowsize();
+    const int hop_size = ps.get_hopsize();
+    if ((int)pending.size() < win_size) {
+        return;
+    }
+    int frames = (pending.size() - win_size) / hop_size + 1;
+    analyze_frames(&pending[0], frames);
+    pending.erase(pending.begin(), pending.begin() + (size_t)frames*hop_size);
+}
+
+int
+gaussian_analysis::push(
+        const float* pcm,
+        int length)
+{
+    if ((length < 0) || ((length > 0) && !pcm)) {
+        return -1;
+    }
+    const int win_size = ps.get_windowsize();
+    const int hop_size = ps.get_hopsize();
+
+    // complete the frames starting in the samples of previous pushes; this
+    // appends less than a window, after which the pending samples are all
+    // part of pcm as well, so the analysis continues in place
+    if (!pending.empty() && (length > 0)) {
+        int old_size = pending.size();
+        int last_start = (old_size - 1) / hop_size * hop_size;
+        int needed = last_start + win_size - old_size;
+        int count = std::min(length, needed);
+        pending.insert(pending.end(), pcm, pcm + count);
+        analyze_pending();
+        if (count < needed) {
+            return 0;
+        }
+        int next_start = last_start + hop_size - old_size;
+        pending.clear();
+        pcm += next_start;
+        length -= next_start;
+    }
+
+    // analyze the remaining complete frames in place
+    if (length >= win_size) {
+        int frames = (length - win_size) / hop_size + 1;
+        analyze_frames(pcm, frames);
+        pcm += (size_t)frames*hop_size;
+        length -= frames*hop_size;
+    }
+    pending.insert(pending.end(), pcm, pcm + length);
+    return 0;
+}
+
+int
+gaussian_analysis::finish(
+        musly_track* track)
+{
+    MINILOG(logTRACE) << "Incremental analysis finished. frames="
+            << acc.get_count();
+
+    // estimate the Gaussian from the accumulated MFCCs
+    gaussian g = {0, 0, 0, 0};
+    g.mu = &track[track_mu];
+    g.covar = &track[track_covar];
+    if (track_covar_inverse >= 0) {
+        g.covar_inverse = &track[track_covar_inverse];
+    }
+    if (track_covar_logdet >= 0) {
+        g.covar_logdet = &track[track_covar_logdet];
+    }
+    if (gs.estimate_gaussian(acc, g) == false) {
+        MINILOG(logTRACE) << "Gaussian model estimation failed.";
+        return 2;
+    }
+    return 0;
+}
+
+} /* namespace musly */
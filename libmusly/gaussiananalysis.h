@@ -0,0 +1,145 @@
+/**
+ * Copyright 2013-2014, Dominik Schnitzer <dominik@schnitzer.at>
+ *                2014, Jan Schlueter <jan.schlueter@ofai.at>
+ *
+ * This file is part of Musly, a program for high performance music
+ * similarity computation: http://www.musly.org/.
+ *
+ * This Source Code Form is subject to the terms of the Mozilla
+ * Public License v. 2.0. If a copy of the MPL was not distributed
+ * with this file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+#ifndef MUSLY_GAUSSIANANALYSIS_H_
+#define MUSLY_GAUSSIANANALYSIS_H_
+
+#include <vector>
+#include <Eigen/Core>
+#include "method.h"
+#include "powerspectrum.h"
+#include "melspectrum.h"
+#include "mfcc.h"
+#include "gaussianstatistics.h"
+
+namespace musly {
+
+/** An incremental analysis modeling the MFCCs of a signal with a single
+ * Gaussian, as done by the timbre and mandelellis methods. Frames are
+ * transformed to MFCCs in small blocks as soon as enough samples have been
+ * pushed, and only the running moments of the MFCCs are kept, so the memory
+ * used does not grow with the length of the signal.
+ *
+ * The analysis has its own FFT buffers, but shares the (read-only) filters
+ * of the method that started it, so any number of analyses can run
+ * concurrently. Methods also use it to analyze a complete signal frame by
+ * frame in analyze_track(), passing their own powerspectrum instead.
+ */
+class gaussian_analysis :
+        public analysis
+{
+private:
+    /** The powerspectrum created by the analysis, or NULL if it uses the
+     * one of the method.
+     */
+    powerspectrum* own_ps;
+    powerspectrum& ps;
+    melspectrum& mel;
+    mfcc& mfccs;
+    gaussian_statistics& gs;
+    gaussian_accumulator acc;
+
+    /** The factor PCM samples are scaled with, see
+     * powerspectrum::get_pcmscale().
+     */
+    float pcm_scale;
+
+    /** The fields of the Gaussian as offsets into a musly_track, or -1.
+     */
+    int track_mu;
+    int track_covar;
+    int track_covar_inverse;
+    int track_covar_logdet;
+
+    /** The samples pushed, but not yet analyzed. This is less than a window
+     * after each push().
+     */
+    std::vector<float> pending;
+
+    /** The powerspectrum of a block of frames.
+     */
+    Eigen::MatrixXf block_ps;
+
+    /** Analyzes \p frames frames of the given samples.
+     */
+    void
+    analyze_frames(
+            const float* pcm,
+            int frames);
+
+    /** Analyzes all complete frames of the pending samples and removes the
+     * samples no longer needed.
+     */
+    void
+    analyze_pending();
+
+public:
+    /** The number of frames transformed at once. The powerspectrum of a
+     * block is small enough to stay in the cache until it has been turned
+     * into MFCCs.
+     */
+    static const int block_frames = 16;
+
+    /** Starts an analysis.
+     *
+     * \param win_funct The window function of the powerspectrum.
+     * \param hop The hop size relative to the window size.
+     * \param pcm_scale The factor to scale PCM samples with before the FFT.
+     * \param track_mu The offset of the mean in a musly_track.
+     * \param track_covar The offset of the covariance in a musly_track.
+     * \param track_covar_inverse The offset of the inverse covariance in a
+     * musly_track, or -1 if it is not needed.
+     * \param track_covar_logdet The offset of the log determinant of the
+     * covariance in a musly_track, or -1 if it is not needed.
+     */
+    gaussian_analysis(
+            const Eigen::VectorXf& win_funct,
+            float hop,
+            melspectrum& mel,
+            mfcc& mfccs,
+            gaussian_statistics& gs,
+            float pcm_scale,
+            int track_mu,
+            int track_covar,
+            int track_covar_inverse,
+            int track_covar_logdet);
+
+    /** Starts an analysis using the given powerspectrum, which must not be
+     * used elsewhere until the analysis is finished. The other parameters
+     * are the same as above.
+     */
+    gaussian_analysis(
+            powerspectrum& ps,
+            melspectrum& mel,
+            mfcc& mfccs,
+            gaussian_statistics& gs,
+            float pcm_scale,
+            int track_mu,
+            int track_covar,
+            int track_covar_inverse,
+            int track_covar_logdet);
+
+    virtual
+    ~gaussian_analysis();
+
+    virtual int
+    push(
+            const float* pcm,
+            int length);
+
+    virtual int
+    finish(
+            musly_track* track);
+};
+
+} /* namespace musly */
+#endif /* MUSLY_GAUSSIANANALYSIS_H_ */
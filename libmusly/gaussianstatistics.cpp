@@ -13,9 +13,11 @@
 #include <limits>
 #include <algorithm>
 #include <Eigen/Core>
+#include <Eigen/Cholesky>
 #include <Eigen/QR>
 #include "minilog.h"
 #include "gaussianstatistics.h"
+#include "targetclones.h"
 
 
 namespace musly {
@@ -61,18 +63,51 @@ gaussian_statistics::estimate_gaussian(
         return false;
     }
 
-    // always compute sample mean
-    Eigen::VectorXf mu = m.rowwise().mean();
+    // always compute sample mean and covariance
+    gaussian_accumulator acc(d);
+    acc.add(m);
+    return estimate_gaussian(acc, g);
+}
+
+bool
+gaussian_statistics::estimate_gaussian(
+        const gaussian_accumulator& acc,
+        gaussian& g)
+{
+    MINILOG(logTRACE) << "Estimating Gaussian from " << acc.get_count()
+            << " accumulated samples";
+
+    if (acc.get_count() <= d) {
+        MINILOG(logTRACE) << "could not estimate Gaussian. "
+                << "Too few input samples. count=" << acc.get_count();
+        return false;
+    }
+
+    Eigen::VectorXd mu;
+    Eigen::MatrixXd covar;
+    acc.get_moments(mu, covar);
+    if ((mu.size() != d) || (covar.rows() != d)) {
+        MINILOG(logTRACE) << "could not estimate Gaussian. "
+                << "Wrong dimension (d=" << d << " vs. " << mu.size() << ")";
+        return false;
+    }
+
+    set_gaussian(mu, covar, g);
+    return true;
+}
+
+void
+gaussian_statistics::set_gaussian(
+        const Eigen::VectorXd& mu,
+        Eigen::MatrixXd& covar,
+        gaussian& g)
+{
     if (g.mu) {
         for (int i = 0; i < d; i++) {
             g.mu[i] = mu(i);
         }
     }
 
-    // always compute sample covariance
-    Eigen::MatrixXf covar  = (m.colwise()-mu) * (m.colwise()-mu).transpose()
-            / (static_cast<float>(m.cols()) - 1.0f);
-
     // Add Gaussian noise to the data to avoid singular covariance matrices
     // in case the input data was silence.
     covar.diagonal().array() += 1e-4;
@@ -88,16 +123,29 @@ gaussian_statistics::estimate_gaussian(
 
     // Check if we need to set logdet or inversecovar fields of the Gaussian
     if (g.covar_inverse || g.covar_logdet) {
-        Eigen::FullPivHouseholderQR<Eigen::MatrixXf> qr =
-                covar.fullPivHouseholderQr();
-/*        if (!qr.isInvertible()) {
-            MINILOG(logDEBUG1) << "Could not compute inverse Gaussian "
-                    << "covariance matrix";
-            return false;
-        }
-*/
+        // the covariance is symmetric positive definite, so a Cholesky
+        // decomposition suffices; only fall back to a QR decomposition if
+        // rounding errors made it fail
+        Eigen::MatrixXd covar_inverse;
+        double logdet;
+        Eigen::LLT<Eigen::MatrixXd> llt(covar);
+        if (llt.info() == Eigen::Success) {
+            logdet = 2 * llt.matrixLLT().diagonal().array().log().sum();
+            if (g.covar_inverse) {
+                covar_inverse = llt.solve(Eigen::MatrixXd::Identity(d, d));
+            }
+        } else {
+            MINILOG(logDEBUG) << "Cholesky decomposition of the covariance "
+                    << "failed, using a QR decomposition.";
+            Eigen::FullPivHouseholderQR<Eigen::MatrixXd> qr =
+                    covar.fullPivHouseholderQr();
+            logdet = qr.logAbsDeterminant();
+            if (g.covar_inverse) {
+                covar_inverse = qr.inverse();
+            }
+        }
+
         if (g.covar_inverse) {
-            Eigen::MatrixXf covar_inverse = qr.inverse();
             int idx_ij = 0;
             for (int i = 0; i < d; i++) {
                 for (int j = i; j < d; j++) {
@@ -108,12 +156,54 @@ gaussian_statistics::estimate_gaussian(
         }
 
         if (g.covar_logdet) {
-            *(g.covar_logdet) = qr.logAbsDeterminant();
+            *(g.covar_logdet) = logdet;
         }
     }
+}
 
 
-    return true;
+gaussian_accumulator::gaussian_accumulator(
+        int gaussian_dim) :
+                d(gaussian_dim),
+                count(0),
+                shift(Eigen::VectorXd::Zero(gaussian_dim)),
+                sum(Eigen::VectorXd::Zero(gaussian_dim)),
+                sum_outer(Eigen::MatrixXd::Zero(gaussian_dim, gaussian_dim))
+{
+}
+
+void
+gaussian_accumulator::add(
+        const Eigen::MatrixXf& m)
+{
+    if (m.cols() == 0) {
+        return;
+    }
+    if (count == 0) {
+        shift = m.col(0).cast<double>();
+    }
+    Eigen::MatrixXd centered = m.cast<double>().colwise() - shift;
+    sum += centered.rowwise().sum();
+    sum_outer.selfadjointView<Eigen::Upper>().rankUpdate(centered);
+    count += m.cols();
+}
+
+long
+gaussian_accumulator::get_count() const
+{
+    return count;
+}
+
+void
+gaussian_accumulator::get_moments(
+        Eigen::VectorXd& mu,
+        Eigen::MatrixXd& covar) const
+{
+    Eigen::VectorXd mean = sum / count;
+    covar = sum_outer.selfadjointView<Eigen::Upper>();
+    covar -= count * mean * mean.transpose();
+    covar /= count - 1.0;
+    mu = shift + mean;
 }
 
 
@@ -183,6 +273,140 @@ gaussian_statistics::jensenshannon(
     return std::sqrt(std::max(0.0f, jsd));
 }
 
+int
+gaussian_statistics::get_lanes_tmpsize()
+{
+    return (d + covar_elems) * lanes;
+}
+
+MUSLY_TARGET_CLONES
+void
+gaussian_statistics::jensenshannon_lanes(
+        const gaussian& g0,
+        const float* mu,
+        const float* covar,
+        const float* covar_logdet,
+        int stride,
+        float* tmp,
+        float* jsd)
+{
+    // This is jensenshannon() with every operation applied to all lanes in
+    // turn, so the innermost loops run over contiguous lanes and can be
+    // vectorized. Operations and their order per lane are unchanged.
+    const int l_n = lanes;
+    float* tmp_mu = tmp;
+    float* tmp_covar = tmp + d*l_n;
+    bool failed[lanes];
+
+    for (int l = 0; l < l_n; l++) {
+        jsd[l] = -0.25f * (*(g0.covar_logdet) + covar_logdet[l]);
+        failed[l] = false;
+    }
+
+    // merge the mean and covariance matrices to get the merged Gaussian
+    for (int i = 0; i < d; i++) {
+        const float* mu_i = mu + i*stride;
+        float* tmp_mu_i = tmp_mu + i*l_n;
+        for (int l = 0; l < l_n; l++) {
+            tmp_mu_i[l] = 0.5f*(g0.mu[i] - mu_i[l]);
+        }
+    }
+    int idx_covar = 0;
+    for (int i = 0; i < d; i++) {
+        const float* tmp_mu_i = tmp_mu + i*l_n;
+        for (int j = i; j < d; j++) {
+            const float* tmp_mu_j = tmp_mu + j*l_n;
+            const float* covar_ij = covar + idx_covar*stride;
+            float* tmp_covar_ij = tmp_covar + idx_covar*l_n;
+            for (int l = 0; l < l_n; l++) {
+                tmp_covar_ij[l] = 0.5f*(g0.covar[idx_covar] + covar_ij[l]) +
+                        tmp_mu_i[l]*tmp_mu_j[l];
+            }
+            idx_covar++;
+        }
+    }
+
+    // Do an inplace cholesky decompositon and compute logdet of the merged
+    // Gaussians.
+    int idx_ii = 0;
+    for (int i = 0; i < d; i++) {
+        float* c_ii = tmp_covar + idx_ii*l_n;
+        int idx_k = i;
+        for (int k = 0; k < i; k++) {
+            const float* c_k = tmp_covar + idx_k*l_n;
+            for (int l = 0; l < l_n; l++) {
+                c_ii[l] -= c_k[l]*c_k[l];
+            }
+            idx_k += d - k - 1;
+        }
+
+        for (int l = 0; l < l_n; l++) {
+            if (c_ii[l] <= 0) {
+                failed[l] = true;
+            }
+            c_ii[l] = std::sqrt(c_ii[l]);
+        }
+        for (int l = 0; l < l_n; l++) {
+            jsd[l] += std::log(c_ii[l]);
+        }
+
+        int idx_ij = idx_ii;
+        for (int j = i+1; j < d; j++) {
+            idx_ij++;
+            float* c_ij = tmp_covar + idx_ij*l_n;
+
+            int idx_k = 0;
+            for (int k = 0; k < i; k++) {
+                const float* c_ki = tmp_covar + (idx_k+i)*l_n;
+                const float* c_kj = tmp_covar + (idx_k+j)*l_n;
+                for (int l = 0; l < l_n; l++) {
+                    c_ij[l] -= c_ki[l] * c_kj[l];
+                }
+                idx_k += d - k - 1;
+            }
+            for (int l = 0; l < l_n; l++) {
+                c_ij[l] /= c_ii[l];
+            }
+        }
+
+        idx_ii += d - i;
+    }
+
+    for (int l = 0; l < l_n; l++) {
+        if (failed[l]) {
+            jsd[l] = -1;
+        } else if (std::isnan(jsd[l]) || std::isinf(jsd[l])) {
+            jsd[l] = std::numeric_limits<float>::max();
+        } else {
+            jsd[l] = std::sqrt(std::max(0.0f, jsd[l]));
+        }
+    }
+}
+
+const char*
+gaussian_statistics::get_kernel()
+{
+#ifdef MUSLY_HAVE_TARGET_CLONES
+    // the instruction sets of MUSLY_TARGET_CLONES, in the loader's order
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f")) {
+        return "avx512f";
+    }
+    if (__builtin_cpu_supports("avx2")) {
+        return "avx2";
+    }
+    return "sse2";
+#elif defined(__AVX2__)
+    return "avx2";
+#elif defined(__SSE2__) || defined(_M_X64)
+    return "sse2";
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+    return "neon";
+#else
+    return "generic";
+#endif
+}
+
 float
 gaussian_statistics::symmetric_kullbackleibler(
         const gaussian& g0,
@@ -243,4 +467,105 @@ gaussian_statistics::symmetric_kullbackleibler(
     return std::max(skld/4 - d/2, 0.0f);
 }
 
+MUSLY_TARGET_CLONES
+void
+gaussian_statistics::symmetric_kullbackleibler_lanes(
+        const gaussian& g0,
+        const float* mu,
+        const float* covar,
+        const float* covar_inverse,
+        int stride,
+        float* tmp,
+        float* skld)
+{
+    // This is symmetric_kullbackleibler() with every operation applied to
+    // all lanes in turn, like jensenshannon_lanes(). The trace terms are dot
+    // products of the seed's packed (inverse) covariance with those of all
+    // lanes, and the quadratic mean term is a matrix-vector product per
+    // lane; both run over contiguous lanes in their innermost loops.
+    const int l_n = lanes;
+    float* tmp_mu = tmp;
+    float* tmp_covar_inverse = tmp + d*l_n;
+
+    // add the two inverted covariances
+    for (int e = 0; e < covar_elems; e++) {
+        const float* covar_inverse_e = covar_inverse + e*stride;
+        float* tmp_covar_inverse_e = tmp_covar_inverse + e*l_n;
+        for (int l = 0; l < l_n; l++) {
+            tmp_covar_inverse_e[l] = g0.covar_inverse[e] + covar_inverse_e[l];
+        }
+    }
+
+    for (int l = 0; l < l_n; l++) {
+        skld[l] = 0;
+    }
+    for (int i = 0; i < d; i++) {
+        int idx = i*d - (i*i+i)/2;
+
+        const float* covar_ii = covar + (idx+i)*stride;
+        const float* covar_inverse_ii = covar_inverse + (idx+i)*stride;
+        for (int l = 0; l < l_n; l++) {
+            skld[l] += g0.covar[idx+i] * covar_inverse_ii[l] +
+                    covar_ii[l] * g0.covar_inverse[idx+i];
+        }
+
+        for (int k = i+1; k < d; k++) {
+            const float* covar_ik = covar + (idx+k)*stride;
+            const float* covar_inverse_ik = covar_inverse + (idx+k)*stride;
+            for (int l = 0; l < l_n; l++) {
+                skld[l] += 2*g0.covar[idx+k] * covar_inverse_ik[l] +
+                        2*covar_ik[l] * g0.covar_inverse[idx+k];
+            }
+        }
+    }
+
+    // compute the difference of the two means
+    for (int i = 0; i < d; i++) {
+        const float* mu_i = mu + i*stride;
+        float* tmp_mu_i = tmp_mu + i*l_n;
+        for (int l = 0; l < l_n; l++) {
+            tmp_mu_i[l] = g0.mu[i] - mu_i[l];
+        }
+    }
+
+    float tmp1[lanes];
+    for (int i = 0; i < d; i++) {
+        int idx = i - d;
+        for (int l = 0; l < l_n; l++) {
+            tmp1[l] = 0;
+        }
+
+        for (int k = 0; k <= i; k++) {
+            idx += d - k;
+            const float* c = tmp_covar_inverse + idx*l_n;
+            const float* tmp_mu_k = tmp_mu + k*l_n;
+            for (int l = 0; l < l_n; l++) {
+                tmp1[l] += c[l] * tmp_mu_k[l];
+            }
+        }
+
+        for (int k = i + 1; k < d; k++) {
+            idx++;
+            const float* c = tmp_covar_inverse + idx*l_n;
+            const float* tmp_mu_k = tmp_mu + k*l_n;
+            for (int l = 0; l < l_n; l++) {
+                tmp1[l] += c[l] * tmp_mu_k[l];
+            }
+        }
+
+        const float* tmp_mu_i = tmp_mu + i*l_n;
+        for (int l = 0; l < l_n; l++) {
+            skld[l] += tmp1[l] * tmp_mu_i[l];
+        }
+    }
+
+    for (int l = 0; l < l_n; l++) {
+        if (std::isnan(skld[l]) || std::isinf(skld[l])) {
+            skld[l] = std::numeric_limits<float>::max();
+        } else {
+            skld[l] = std::max(skld[l]/4 - d/2, 0.0f);
+        }
+    }
+}
+
 } /* namespace musly */
@@ -18,6 +18,42 @@
 
 namespace musly {
 
+/** Accumulates the sample mean and covariance of a stream of samples in
+ * constant memory. The moments are accumulated in double precision relative
+ * to the first sample, so long streams do not lose precision.
+ */
+class gaussian_accumulator {
+private:
+    int d;
+    long count;
+    Eigen::VectorXd shift;
+    Eigen::VectorXd sum;
+    Eigen::MatrixXd sum_outer;
+
+public:
+    gaussian_accumulator(
+            int gaussian_dim);
+
+    /** Adds samples, given as the columns of \p m.
+     */
+    void
+    add(
+            const Eigen::MatrixXf& m);
+
+    /** Returns the number of samples added so far.
+     */
+    long
+    get_count() const;
+
+    /** Computes the sample mean and the (unbiased) sample covariance of the
+     * samples added so far. Requires at least two samples.
+     */
+    void
+    get_moments(
+            Eigen::VectorXd& mu,
+            Eigen::MatrixXd& covar) const;
+};
+
 /** A class to compute
  *
  */
@@ -27,6 +63,16 @@ private:
 
     int covar_elems;
 
+    /** Fills the fields of \p g from a sample mean and covariance. The log
+     * determinant and inverse of the covariance are obtained from its
+     * Cholesky decomposition.
+     */
+    void
+    set_gaussian(
+            const Eigen::VectorXd& mu,
+            Eigen::MatrixXd& covar,
+            gaussian& g);
+
 public:
     /** A musly Gaussian representation.
      *
@@ -38,22 +84,86 @@ public:
 
     int get_dim();
 
+    /** Estimates a Gaussian from the samples given as the columns of \p m,
+     * in a single pass over the samples.
+     */
     bool
     estimate_gaussian(
             const Eigen::MatrixXf& m,
             gaussian& g);
 
+    /** Estimates a Gaussian from the samples collected by an accumulator,
+     * like estimate_gaussian() does for a matrix of samples.
+     */
+    bool
+    estimate_gaussian(
+            const gaussian_accumulator& acc,
+            gaussian& g);
+
     float
     jensenshannon(
             const gaussian &g0,
             const gaussian &g1,
             gaussian &tmp);
 
+    /** The number of Gaussians jensenshannon_lanes() compares in lockstep.
+     */
+    static const int lanes = 8;
+
+    /** Returns the number of floats jensenshannon_lanes() and
+     * symmetric_kullbackleibler_lanes() need as temporary buffer.
+     */
+    int
+    get_lanes_tmpsize();
+
+    /** Computes the Jensen-Shannon divergence between \p g0 and #lanes other
+     * Gaussians at once. The other Gaussians are stored interleaved: element
+     * \c e of Gaussian \c l is found at <tt>mu[e*stride + l]</tt>, and
+     * likewise for \p covar and \p covar_logdet. The results equal those of
+     * jensenshannon(), except that lanes are never detected to be identical
+     * to \p g0. The instruction set is chosen at runtime, see get_kernel().
+     * \param tmp A buffer of get_lanes_tmpsize() floats.
+     * \param jsd The #lanes divergences are written here.
+     */
+    void
+    jensenshannon_lanes(
+            const gaussian &g0,
+            const float* mu,
+            const float* covar,
+            const float* covar_logdet,
+            int stride,
+            float* tmp,
+            float* jsd);
+
+    /** Returns the name of the instruction set used by
+     * jensenshannon_lanes() on this machine.
+     */
+    static const char*
+    get_kernel();
+
     float
     symmetric_kullbackleibler(
             const gaussian& g0,
             const gaussian& g1,
             gaussian& tmp);
+
+    /** Computes the symmetric Kullback-Leibler divergence between \p g0 and
+     * #lanes other Gaussians at once, which are stored interleaved like for
+     * jensenshannon_lanes(), with \p covar_inverse in place of the log
+     * determinants. The results equal those of symmetric_kullbackleibler(),
+     * except that lanes are never detected to be identical to \p g0.
+     * \param tmp A buffer of get_lanes_tmpsize() floats.
+     * \param skld The #lanes divergences are written here.
+     */
+    void
+    symmetric_kullbackleibler_lanes(
+            const gaussian &g0,
+            const float* mu,
+            const float* covar,
+            const float* covar_inverse,
+            int stride,
+            float* tmp,
+            float* skld);
 };
 
 } /* namespace musly */
@@ -20,14 +20,20 @@
  * By using this mapping and registering an ordered_idpool_observer with the
  * ordered_idpool to be informed of updates to the mapping, a music similarity
  * measure can store per-track metadata efficiently in an array.
+ * Ids can also be removed lazily with ordered_idpool::tombstone_ids(), which
+ * leaves a tombstone at their position instead of moving any other id; the
+ * positions are made consecutive again by ordered_idpool::compact().
  */
 
 #ifndef MUSLY_IDPOOL_H_
 #define MUSLY_IDPOOL_H_
 
+#include <algorithm>
 #include <set>
 #include <map>
 #include <vector>
+#include "mappedarray.h"
+#include "jukeboximage.h"
 
 namespace musly {
 
@@ -59,7 +65,7 @@ public:
     /** Register a bunch of ids and return how many of them were new
      */
     virtual int
-    add_ids(T* ids, int length) = 0;
+    add_ids(const T* ids, int length) = 0;
 
     /** Generate and register a bunch of ids, starting with get_max_seen() + 1
      */
@@ -99,7 +105,7 @@ public:
     }
 
     int
-    add_ids(T* ids, int length) {
+    add_ids(const T* ids, int length) {
         int added = 0;
         for (int i = 0; i < length; i++) {
             if (registered_ids.insert(ids[i]).second) {
@@ -146,6 +152,15 @@ public:
 
     virtual void
     swapped_positions(int pos_a, int pos_b) = 0;
+
+    /** Called by ordered_idpool::compact() after dropping all tombstones:
+     * for \c i from 0 to <tt>count - 1</tt>, the id at position
+     * <tt>old_positions[i]</tt> moved to position \c i. The old positions
+     * are ascending, so the per-position metadata can be moved in place in
+     * a single pass, and then truncated to \p count items.
+     */
+    virtual void
+    compacted_positions(const int* old_positions, int count) = 0;
 };
 
 
@@ -155,11 +170,123 @@ class ordered_idpool :
 {
 private:
     ordered_idpool_observer* observer;
-    std::vector<T> registered_ids;
-    std::map<T,int> positions;
+    mapped_array<T> registered_ids;
+
+    /** The positions of the ids from 0 to <tt>dense_positions.size() - 1</tt>,
+     * or -1 for ids not registered. Ids are usually generated consecutively,
+     * so most are looked up directly here.
+     */
+    mapped_array<int> dense_positions;
+
+    /** The number of ids registered in dense_positions.
+     */
+    int dense_count;
+
+    /** The positions of all other registered ids.
+     */
+    std::map<T,int> sparse_positions;
+
+    /** Per position of registered_ids, 1 if its id was removed by
+     * tombstone_ids(), 0 otherwise.
+     */
+    mapped_array<unsigned char> tombstones;
+
+    /** The number of tombstones.
+     */
+    int tombstone_count;
+
+    /** The number of tombstones per block of #tombstone_block positions, so
+     * nth_position() can skip over whole blocks.
+     */
+    std::vector<int> block_tombstones;
+    static const int tombstone_block = 1024;
+
+    void
+    resize_tombstones(int size) {
+        tombstones.owned().resize(size, 0);
+        block_tombstones.resize((size + tombstone_block - 1) /
+                tombstone_block, 0);
+    }
+
+    void
+    set_tombstone(int pos, unsigned char value) {
+        if (tombstones[pos] != value) {
+            block_tombstones[pos / tombstone_block] += value ? 1 : -1;
+            tombstones.owned()[pos] = value;
+        }
+    }
+
+    /** Returns the position of a registered id for modification, or NULL.
+     */
+    inline int*
+    find_position(T id) {
+        if ((id >= 0) && (id < (T)dense_positions.size())) {
+            int* pos = &dense_positions.owned()[id];
+            return (*pos >= 0) ? pos : NULL;
+        }
+        typename std::map<T,int>::iterator it = sparse_positions.find(id);
+        if (it != sparse_positions.end()) {
+            return &it->second;
+        }
+        return NULL;
+    }
+
+    /** Extends dense_positions to cover \p id if that keeps it at most
+     * about twice as large as the number of registered ids, moving the
+     * sparse ids it then covers.
+     */
+    void
+    extend_dense(T id) {
+        T limit = 2 * (T)registered_ids.size() + 1024;
+        if ((id < (T)dense_positions.size()) || (id >= limit)) {
+            return;
+        }
+        T old_size = dense_positions.size();
+        T new_size = std::min(limit, std::max(id + 1, 2 * old_size));
+        std::vector<int>& dense = dense_positions.owned();
+        dense.resize(new_size, -1);
+        typename std::map<T,int>::iterator first =
+                sparse_positions.lower_bound(old_size);
+        typename std::map<T,int>::iterator last =
+                sparse_positions.lower_bound(new_size);
+        for (typename std::map<T,int>::iterator it = first; it != last; ++it) {
+            dense[it->first] = it->second;
+            dense_count++;
+        }
+        sparse_positions.erase(first, last);
+    }
+
+    void
+    set_position(T id, int pos) {
+        if (id >= 0) {
+            extend_dense(id);
+        }
+        if ((id >= 0) && (id < (T)dense_positions.size())) {
+            if (dense_positions[id] < 0) {
+                dense_count++;
+            }
+            dense_positions.owned()[id] = pos;
+        }
+        else {
+            sparse_positions[id] = pos;
+        }
+    }
 
     void
-    swap_positions(int pos_a, int pos_b, typename std::map<T,int>::iterator map_a) {
+    erase_position(T id) {
+        if ((id >= 0) && (id < (T)dense_positions.size())) {
+            if (dense_positions[id] >= 0) {
+                dense_count--;
+            }
+            dense_positions.owned()[id] = -1;
+        }
+        else {
+            sparse_positions.erase(id);
+        }
+    }
+
+    void
+    swap_positions(int pos_a, int pos_b, int* mapped_a) {
         if (pos_a == pos_b) {
             return;
         }
@@ -167,11 +294,16 @@ private:
         T id_a = registered_ids[pos_a];
         T id_b = registered_ids[pos_b];
         // swap in `registered_ids`
-        registered_ids[pos_a] = id_b;
-        registered_ids[pos_b] = id_a;
-        // swap in `positions`
-        map_a->second = pos_b;
-        positions[id_b] = pos_a;
+        registered_ids.owned()[pos_a] = id_b;
+        registered_ids.owned()[pos_b] = id_a;
+        // swap in the position mapping; tombstones are not mapped
+        *mapped_a = pos_b;
+        if (!tombstones[pos_b]) {
+            *find_position(id_b) = pos_a;
+        }
+        unsigned char tombstone_a = tombstones[pos_a];
+        set_tombstone(pos_a, tombstones[pos_b]);
+        set_tombstone(pos_b, tombstone_a);
         // notify observer (if any)
         if (observer) {
             observer->swapped_positions(pos_a, pos_b);
@@ -179,19 +311,26 @@ private:
     }
 
 public:
-    ordered_idpool() : observer(NULL) {};
+    ordered_idpool() : observer(NULL), dense_count(0), tombstone_count(0) {};
 
     void
     set_observer(ordered_idpool_observer* observer) {
         this->observer = observer;
     }
 
-    inline const std::vector<T>& idlist() const {
+    /** Return the ids by position. Positions holding a tombstone keep the
+     * id that was removed there, see is_tombstone().
+     */
+    inline const mapped_array<T>& idlist() const {
         return registered_ids;
     }
 
-    inline const std::map<T,int>& posmap() const {
-        return positions;
+    /** Return the number of ids in the mapping from ids to positions, which
+     * equals get_size()
+     */
+    inline int
+    get_mapped_count() const {
+        return dense_count + sparse_positions.size();
     }
 
     inline const T& operator[](int const& index) const {
@@ -200,29 +339,98 @@ public:
 
     inline int
     position_of(T id) {
-        typename std::map<T,int>::iterator it = positions.find(id);
-        if (it != positions.end()) {
+        if ((id >= 0) && (id < (T)dense_positions.size())) {
+            return dense_positions[id];
+        }
+        typename std::map<T,int>::iterator it = sparse_positions.find(id);
+        if (it != sparse_positions.end()) {
             return it->second;
         }
         return -1;
     }
 
+    /** Write the positions of \p length ids to \p positions, -1 for unknown
+     * ids, and return how many ids were known
+     */
+    int
+    positions_of(const T* ids, int length, int* positions) {
+        const T dense_size = dense_positions.size();
+        const int* dense = dense_positions.data();
+        int known = 0;
+        for (int i = 0; i < length; i++) {
+            T id = ids[i];
+            int pos = ((id >= 0) && (id < dense_size)) ? dense[id] :
+                    position_of(id);
+            positions[i] = pos;
+            known += (pos >= 0);
+        }
+        return known;
+    }
+
+    /** Return the number of registered ids, not counting tombstones
+     */
     inline int
     get_size() {
+        return registered_ids.size() - tombstone_count;
+    }
+
+    /** Return the number of positions, including tombstones
+     */
+    inline int
+    get_slotcount() const {
         return registered_ids.size();
     }
 
+    inline int
+    get_tombstonecount() const {
+        return tombstone_count;
+    }
+
+    inline bool
+    is_tombstone(int position) const {
+        return tombstones[position] != 0;
+    }
+
+    /** Return the position of the \p n-th registered id in the order of
+     * idlist(), skipping tombstones, or -1 if there are fewer ids
+     */
+    int
+    nth_position(int n) const {
+        const int size = registered_ids.size();
+        if (tombstone_count == 0) {
+            return (n < size) ? n : -1;
+        }
+        // skip whole blocks first, then the positions of the last block
+        int pos = 0;
+        for (int b = 0; b < (int)block_tombstones.size(); b++) {
+            int live = (size - pos < tombstone_block) ? size - pos :
+                    tombstone_block;
+            live -= block_tombstones[b];
+            if (n < live) {
+                break;
+            }
+            n -= live;
+            pos += tombstone_block;
+        }
+        for (; pos < size; pos++) {
+            if (!tombstones[pos] && (n-- == 0)) {
+                return pos;
+            }
+        }
+        return -1;
+    }
+
     /** Move a bunch of ids to the end of idlist(), in their given order.
      * Unknown ids are skipped. Returns how many ids were known (and moved).
      */
     int
-    move_to_end(T* ids, int length) {
+    move_to_end(const T* ids, int length) {
         int start = registered_ids.size();
         for (int i = length - 1; i >= 0; i--) {
-            typename std::map<T,int>::iterator it = positions.find(ids[i]);
-            if (it != positions.end()) {
+            int* pos = find_position(ids[i]);
+            if (pos) {
                 start--;
-                swap_positions(it->second, start, it);
+                swap_positions(*pos, start, pos);
             }
         }
         return registered_ids.size() - start;
@@ -232,16 +440,18 @@ public:
      * After calling, the last \p length items of idlist() equal \p ids
      */
     int
-    add_ids(T* ids, int length) {
+    add_ids(const T* ids, int length) {
         // move all known ids to the end
         int num_known = move_to_end(ids, length);
         // make enough room to add unknown ids
         int start = registered_ids.size() - num_known;
-        registered_ids.resize(start + length);
+        std::vector<T>& registered = registered_ids.owned();
+        registered.resize(start + length);
+        resize_tombstones(start + length);
         // overwrite the last `length` elements with the given `ids`
         for (int i = 0; i < length; i++) {
-            registered_ids[start + i] = ids[i];
-            positions[ids[i]] = start + i;
+            registered[start + i] = ids[i];
+            set_position(ids[i], start + i);
             if (ids[i] > idpool<T>::max_seen) {
                 idpool<T>::max_seen = ids[i];
             }
@@ -260,11 +470,13 @@ public:
         }
         // make enough room to add all ids
         int size = registered_ids.size();
-        registered_ids.reserve(size + length);
+        std::vector<T>& registered = registered_ids.owned();
+        registered.reserve(size + length);
+        resize_tombstones(size + length);
         // append ids to the end
         for (int i = 0; i < length; i++) {
-            registered_ids.push_back(ids[i]);
-            positions[ids[i]] = size++;
+            registered.push_back(ids[i]);
+            set_position(ids[i], size++);
         }
     }
 
@@ -278,15 +490,140 @@ public:
         return num_known;
     }
 
-    /** Deregisters the given number of ids from the end of idlist()
+    /** Deregister a bunch of ids without moving any other id, leaving a
+     * tombstone at their positions. Returns how many ids were known.
+     */
+    int
+    tombstone_ids(T* ids, int length) {
+        int num_known = 0;
+        for (int i = 0; i < length; i++) {
+            int* pos = find_position(ids[i]);
+            if (pos) {
+                set_tombstone(*pos, 1);
+                erase_position(ids[i]);
+                num_known++;
+            }
+        }
+        tombstone_count += num_known;
+        return num_known;
+    }
+
+    /** Drop all tombstones in a single pass, moving the registered ids to
+     * consecutive positions in their current order
+     */
+    void
+    compact() {
+        if (tombstone_count == 0) {
+            return;
+        }
+        std::vector<int> old_positions;
+        old_positions.reserve(get_size());
+        std::vector<T>& registered = registered_ids.owned();
+        for (int pos = 0; pos < (int)registered.size(); pos++) {
+            if (!tombstones[pos]) {
+                int new_pos = old_positions.size();
+                registered[new_pos] = registered[pos];
+                *find_position(registered[new_pos]) = new_pos;
+                old_positions.push_back(pos);
+            }
+        }
+        registered.resize(old_positions.size());
+        tombstones.owned().assign(old_positions.size(), 0);
+        block_tombstones.assign((old_positions.size() + tombstone_block - 1) /
+                tombstone_block, 0);
+        tombstone_count = 0;
+        // notify observer (if any)
+        if (observer) {
+            observer->compacted_positions(old_positions.data(),
+                    old_positions.size());
+        }
+    }
+
+    /** Writes the registered ids, their positions and the tombstones to a
+     * jukebox image, see map_image().
+     */
+    bool
+    write_image(image_writer& image) const {
+        std::vector<T> sparse_ids;
+        std::vector<int> sparse_pos;
+        for (typename std::map<T,int>::const_iterator it =
+                sparse_positions.begin(); it != sparse_positions.end(); ++it) {
+            sparse_ids.push_back(it->first);
+            sparse_pos.push_back(it->second);
+        }
+        return image.write_value(idpool<T>::max_seen) &&
+                image.write_value(dense_count) &&
+                image.write_value(tombstone_count) &&
+                image.write_array(registered_ids.data(), registered_ids.size()) &&
+                image.write_array(dense_positions.data(), dense_positions.size()) &&
+                image.write_array(tombstones.data(), tombstones.size()) &&
+                image.write_array(block_tombstones.data(), block_tombstones.size()) &&
+                image.write_array(sparse_ids.data(), sparse_ids.size()) &&
+                image.write_array(sparse_pos.data(), sparse_pos.size());
+    }
+
+    /** Replaces all ids with those of a jukebox image written by
+     * write_image(). The ids, positions and tombstones are read in place, so
+     * the image has to stay mapped until they are modified; only the few ids
+     * outside of the dense range are copied. The observer is not notified.
+     */
+    bool
+    map_image(image_reader& image) {
+        T max_seen;
+        int dense, stones;
+        const T* ids;
+        const int* positions;
+        const unsigned char* stone_flags;
+        const int* blocks;
+        const T* sparse_ids;
+        const int* sparse_pos;
+        size_t num_ids, num_positions, num_stones, num_blocks, num_sparse,
+                num_sparse_pos;
+        if (!image.read_value(max_seen) || !image.read_value(dense) ||
+                !image.read_value(stones) ||
+                !image.read_array(ids, num_ids) ||
+                !image.read_array(positions, num_positions) ||
+                !image.read_array(stone_flags, num_stones) ||
+                !image.read_array(blocks, num_blocks) ||
+                !image.read_array(sparse_ids, num_sparse) ||
+                !image.read_array(sparse_pos, num_sparse_pos) ||
+                (num_stones != num_ids) ||
+                (num_blocks != (num_ids + tombstone_block - 1) /
+                        tombstone_block) ||
+                (num_sparse_pos != num_sparse)) {
+            return false;
+        }
+        idpool<T>::max_seen = max_seen;
+        dense_count = dense;
+        tombstone_count = stones;
+        registered_ids.map(ids, num_ids);
+        dense_positions.map(positions, num_positions);
+        tombstones.map(stone_flags, num_stones);
+        block_tombstones.assign(blocks, blocks + num_blocks);
+        sparse_positions.clear();
+        for (size_t i = 0; i < num_sparse; i++) {
+            sparse_positions[sparse_ids[i]] = sparse_pos[i];
+        }
+        return true;
+    }
+
+    /** Deregisters the given number of ids from the end of idlist(),
+     * including tombstones
      */
     void
     remove_last(int length) {
         int start = registered_ids.size() - length;
         for (int i = start; i < start + length; i++) {
-            positions.erase(registered_ids[i]);
+            if (tombstones[i]) {
+                set_tombstone(i, 0);
+                tombstone_count--;
+            }
+            else {
+                erase_position(registered_ids[i]);
+            }
         }
-        registered_ids.resize(start);
+        registered_ids.owned().resize(start);
+        resize_tombstones(start);
     }
 };
 
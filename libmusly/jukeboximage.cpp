@@ -0,0 +1,263 @@
+/**
+ * Copyright 2013-2014, Dominik Schnitzer <dominik@schnitzer.at>
+ *                2014, Jan Schlueter <jan.schlueter@ofai.at>
+ *
+ * This file is part of Musly, a program for high performance music
+ * similarity computation: http://www.musly.org/.
+ *
+ * This Source Code Form is subject to the terms of the Mozilla
+ * Public License v. 2.0. If a copy of the MPL was not distributed
+ * with this file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+#if defined(WIN32) || defined(_WIN32) || defined(__WIN32__)
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+#include <stdint.h>
+#include <cstring>
+
+#include "jukeboximage.h"
+
+namespace musly {
+
+namespace {
+
+const char image_magic[8] = {'M', 'U', 'S', 'L', 'Y', 'I', 'M', 'G'};
+const uint32_t image_byteorder = 0x01020304;
+
+/** The header of an array, padded to image_alignment bytes.
+ */
+struct array_header {
+    uint64_t count;
+    uint64_t item_size;
+};
+
+}  // namespace
+
+image_writer::image_writer(
+        FILE* stream) :
+                stream(stream),
+                written(0),
+                array_end(0)
+{
+}
+
+bool
+image_writer::write_header()
+{
+    const uint32_t version = image_version;
+    return write_raw(image_magic, sizeof(image_magic)) &&
+            write_raw(&version, sizeof(version)) &&
+            write_raw(&image_byteorder, sizeof(image_byteorder)) && pad();
+}
+
+bool
+image_writer::write_string(
+        const char* str)
+{
+    return write_array(str, strlen(str) + 1);
+}
+
+bool
+image_writer::begin_array(
+        size_t count,
+        size_t item_size)
+{
+    array_header header;
+    header.count = count;
+    header.item_size = item_size;
+    if (!pad() || !write_raw(&header, sizeof(header)) || !pad()) {
+        return false;
+    }
+    array_end = written + count * item_size;
+    return true;
+}
+
+bool
+image_writer::write_raw(
+        const void* data,
+        size_t bytes)
+{
+    if (bytes && (fwrite(data, 1, bytes, stream) != bytes)) {
+        return false;
+    }
+    written += bytes;
+    return true;
+}
+
+bool
+image_writer::end_array()
+{
+    // the items have to match the announced size exactly
+    return written == array_end;
+}
+
+size_t
+image_writer::get_written() const
+{
+    return written;
+}
+
+bool
+image_writer::pad()
+{
+    static const char zeros[image_alignment] = {0};
+    return write_raw(zeros, (image_alignment - written % image_alignment)
+            % image_alignment);
+}
+
+image_reader::image_reader(
+        const unsigned char* data,
+        size_t size) :
+                data(data),
+                size(size),
+                pos(0)
+{
+}
+
+bool
+image_reader::read_header(
+        int& version,
+        bool& native_byteorder)
+{
+    uint32_t fields[2];
+    if ((size < sizeof(image_magic) + sizeof(fields)) ||
+            (memcmp(data, image_magic, sizeof(image_magic)) != 0)) {
+        return false;
+    }
+    memcpy(fields, data + sizeof(image_magic), sizeof(fields));
+    version = fields[0];
+    native_byteorder = (fields[1] == image_byteorder);
+    pos = image_alignment;
+    return true;
+}
+
+bool
+image_reader::read_string(
+        std::string& str)
+{
+    const char* chars;
+    size_t count;
+    if (!read_array(chars, count) || (count == 0) ||
+            (chars[count - 1] != '\0')) {
+        return false;
+    }
+    str.assign(chars, count - 1);
+    return true;
+}
+
+bool
+image_reader::read_raw(
+        const void*& items,
+        size_t& count,
+        size_t& item_size)
+{
+    // the header and the items both start at the next aligned position
+    pos = (pos + image_alignment - 1) / image_alignment * image_alignment;
+    if ((pos > size) || (size - pos < image_alignment)) {
+        return false;
+    }
+    array_header header;
+    memcpy(&header, data + pos, sizeof(header));
+    pos += image_alignment;
+    if ((header.item_size == 0) ||
+            (header.count > (size - pos) / header.item_size)) {
+        return false;
+    }
+    items = data + pos;
+    count = header.count;
+    item_size = header.item_size;
+    pos += count * item_size;
+    return true;
+}
+
+image_file::image_file() :
+        data(NULL),
+        size(0)
+{
+}
+
+image_file::~image_file()
+{
+    if (data) {
+#if defined(WIN32) || defined(_WIN32) || defined(__WIN32__)
+        UnmapViewOfFile(data);
+#else
+        munmap((void*)data, size);
+#endif
+    }
+}
+
+bool
+image_file::open(
+        const char* filename)
+{
+    if (data) {
+        return false;
+    }
+#if defined(WIN32) || defined(_WIN32) || defined(__WIN32__)
+    HANDLE file = CreateFileA(filename, GENERIC_READ, FILE_SHARE_READ, NULL,
+            OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file == INVALID_HANDLE_VALUE) {
+        return false;
+    }
+    LARGE_INTEGER file_size;
+    if (!GetFileSizeEx(file, &file_size) || (file_size.QuadPart <= 0) ||
+            ((unsigned long long)file_size.QuadPart > (size_t)-1)) {
+        CloseHandle(file);
+        return false;
+    }
+    // the view keeps the mapping and the file open
+    HANDLE mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+    CloseHandle(file);
+    if (!mapping) {
+        return false;
+    }
+    void* view = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+    CloseHandle(mapping);
+    if (!view) {
+        return false;
+    }
+    data = (const unsigned char*)view;
+    size = (size_t)file_size.QuadPart;
+#else
+    int fd = ::open(filename, O_RDONLY);
+    if (fd < 0) {
+        return false;
+    }
+    struct stat st;
+    if ((fstat(fd, &st) != 0) || (st.st_size <= 0)) {
+        close(fd);
+        return false;
+    }
+    // the mapping keeps the file open
+    void* view = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (view == MAP_FAILED) {
+        return false;
+    }
+    data = (const unsigned char*)view;
+    size = st.st_size;
+#endif
+    return true;
+}
+
+const unsigned char*
+image_file::get_data() const
+{
+    return data;
+}
+
+size_t
+image_file::get_size() const
+{
+    return size;
+}
+
+} /* namespace musly */
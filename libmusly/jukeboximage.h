@@ -0,0 +1,202 @@
+/**
+ * Copyright 2013-2014, Dominik Schnitzer <dominik@schnitzer.at>
+ *                2014, Jan Schlueter <jan.schlueter@ofai.at>
+ *
+ * This file is part of Musly, a program for high performance music
+ * similarity computation: http://www.musly.org/.
+ *
+ * This Source Code Form is subject to the terms of the Mozilla
+ * Public License v. 2.0. If a copy of the MPL was not distributed
+ * with this file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+#ifndef MUSLY_JUKEBOXIMAGE_H_
+#define MUSLY_JUKEBOXIMAGE_H_
+
+#include <cstddef>
+#include <cstdio>
+#include <string>
+
+namespace musly {
+
+/** The version of the jukebox image format written by image_writer.
+ */
+const int image_version = 1;
+
+/** The alignment of the arrays in a jukebox image in bytes.
+ */
+const int image_alignment = 64;
+
+/** Writes a jukebox image, the file format of musly_jukebox_tofile(). It
+ * consists of a header with a magic string, the image_version and a byte
+ * order mark, followed by flat arrays. Each array is preceded by its length
+ * and item size, and its items start at a multiple of image_alignment
+ * bytes, so they can be read in place from a memory map, see image_reader.
+ * Values are written as arrays of a single item.
+ */
+class image_writer {
+public:
+    image_writer(
+            FILE* stream);
+
+    bool
+    write_header();
+
+    template <typename T>
+    bool
+    write_array(
+            const T* items,
+            size_t count) {
+        return begin_array(count, sizeof(T)) &&
+                write_raw(items, count * sizeof(T)) && end_array();
+    }
+
+    template <typename T>
+    bool
+    write_value(
+            const T& value) {
+        return write_array(&value, 1);
+    }
+
+    /** Writes a string as an array of chars, including the terminating
+     * null character.
+     */
+    bool
+    write_string(
+            const char* str);
+
+    /** Starts an array of \p count items of \p item_size bytes, to be
+     * written piece by piece with write_raw() and finished with end_array().
+     */
+    bool
+    begin_array(
+            size_t count,
+            size_t item_size);
+
+    bool
+    write_raw(
+            const void* data,
+            size_t bytes);
+
+    bool
+    end_array();
+
+    /** Returns the number of bytes written so far.
+     */
+    size_t
+    get_written() const;
+
+private:
+    FILE* stream;
+    size_t written;
+
+    /** The number of bytes written once the current array is complete.
+     */
+    size_t array_end;
+
+    bool
+    pad();
+};
+
+/** Reads the arrays of a jukebox image written by image_writer in place,
+ * from a memory block aligned to at least image_alignment bytes. All reads
+ * check the bounds of the block and the item sizes.
+ */
+class image_reader {
+public:
+    image_reader(
+            const unsigned char* data,
+            size_t size);
+
+    /** Reads the header.
+     *
+     * \param version Receives the image version.
+     * \param native_byteorder Receives whether the image was written with
+     * the byte order of this platform.
+     * \returns false if the memory block does not start with an image
+     * header.
+     */
+    bool
+    read_header(
+            int& version,
+            bool& native_byteorder);
+
+    template <typename T>
+    bool
+    read_array(
+            const T*& items,
+            size_t& count) {
+        const void* raw;
+        size_t item_size;
+        if (!read_raw(raw, count, item_size) || (item_size != sizeof(T))) {
+            return false;
+        }
+        items = (const T*)raw;
+        return true;
+    }
+
+    template <typename T>
+    bool
+    read_value(
+            T& value) {
+        const T* items;
+        size_t count;
+        if (!read_array(items, count) || (count != 1)) {
+            return false;
+        }
+        value = *items;
+        return true;
+    }
+
+    bool
+    read_string(
+            std::string& str);
+
+private:
+    const unsigned char* data;
+    size_t size;
+    size_t pos;
+
+    bool
+    read_raw(
+            const void*& items,
+            size_t& count,
+            size_t& item_size);
+};
+
+/** A file mapped read-only into memory. Pages are only read from the file
+ * when they are accessed, and processes mapping the same file share them.
+ * The file must not be modified while it is mapped.
+ */
+class image_file {
+public:
+    image_file();
+    ~image_file();
+
+    /** Maps a file, or returns false if it cannot be mapped.
+     */
+    bool
+    open(
+            const char* filename);
+
+    const unsigned char*
+    get_data() const;
+
+    size_t
+    get_size() const;
+
+private:
+    const unsigned char* data;
+    size_t size;
+
+    // the file owns its mapping, so it cannot be copied (not implemented)
+    image_file(
+            const image_file&);
+
+    image_file&
+    operator=(
+            const image_file&);
+};
+
+} /* namespace musly */
+#endif /* MUSLY_JUKEBOXIMAGE_H_ */
@@ -16,8 +16,11 @@ typedef u_long uint32_t;
 typedef unsigned char uint8_t;
 #else
 #include <arpa/inet.h>
+#include <fcntl.h>
+#include <unistd.h>
 #endif
 #include <algorithm>
+#include <climits>
 #include <vector>
 #include <sstream>
 #include <cstdio>
@@ -29,6 +32,8 @@ typedef unsigned char uint8_t;
 #include "plugins.h"
 #include "decoder.h"
 #include "method.h"
+#include "jukeboximage.h"
+#include "workers.h"
 
 #ifdef BUILD_STATIC
 // Implementation note: Each plugin is supposed to register itself with
@@ -176,6 +181,8 @@ musly_jukebox_setmusicstyle(
 {
     if (jukebox && jukebox->method) {
         musly::method* m = reinterpret_cast<musly::method*>(jukebox->method);
+        musly::write_guard update(m->get_updatelock());
+        musly::write_guard guard(m->get_statelock());
         return m->set_musicstyle(tracks, num_tracks);
     } else {
         return -1;
@@ -192,6 +199,8 @@ musly_jukebox_addtracks(
 {
     if (jukebox && jukebox->method) {
         musly::method* m = reinterpret_cast<musly::method*>(jukebox->method);
+        musly::write_guard update(m->get_updatelock());
+        // the method acquires the state lock itself, see method::add_tracks()
         return m->add_tracks(tracks, trackids, length, (generate_ids != 0));
     } else {
         return -1;
@@ -206,19 +215,54 @@ musly_jukebox_removetracks(
 {
 	if (jukebox && jukebox->method) {
 	    musly::method* m = reinterpret_cast<musly::method*>(jukebox->method);
+	    musly::write_guard update(m->get_updatelock());
+	    musly::write_guard guard(m->get_statelock());
 		m->remove_tracks(trackids, length);
+		m->unstore_tracks(trackids, length);
 		return 0;
 	} else {
 		return -1;
 	}
 }
 
+int
+musly_jukebox_setcompaction(
+        musly_jukebox* jukebox,
+        float max_removed_ratio)
+{
+    if (jukebox && jukebox->method && (max_removed_ratio >= 0)) {
+        musly::method* m = reinterpret_cast<musly::method*>(jukebox->method);
+        musly::write_guard update(m->get_updatelock());
+        musly::write_guard guard(m->get_statelock());
+        m->set_compaction(max_removed_ratio);
+        return 0;
+    } else {
+        return -1;
+    }
+}
+
+int
+musly_jukebox_compact(
+        musly_jukebox* jukebox)
+{
+    if (jukebox && jukebox->method) {
+        musly::method* m = reinterpret_cast<musly::method*>(jukebox->method);
+        musly::write_guard update(m->get_updatelock());
+        musly::write_guard guard(m->get_statelock());
+        m->compact();
+        return 0;
+    } else {
+        return -1;
+    }
+}
+
 int
 musly_jukebox_trackcount(
         musly_jukebox* jukebox)
 {
     if (jukebox && jukebox->method) {
         musly::method* m = reinterpret_cast<musly::method*>(jukebox->method);
+        musly::read_guard guard(m->get_statelock());
         return m->get_trackcount();
     } else {
         return -1;
@@ -231,6 +275,7 @@ musly_jukebox_maxtrackid(
 {
     if (jukebox && jukebox->method) {
         musly::method* m = reinterpret_cast<musly::method*>(jukebox->method);
+        musly::read_guard guard(m->get_statelock());
         return m->get_maxtrackid();
     } else {
         return -1;
@@ -243,6 +288,7 @@ musly_jukebox_gettrackids(
         musly_trackid* trackids) {
     if (jukebox && jukebox->method) {
         musly::method* m = reinterpret_cast<musly::method*>(jukebox->method);
+        musly::read_guard guard(m->get_statelock());
         return m->get_trackids(trackids);
     } else {
         return -1;
@@ -261,6 +307,7 @@ musly_jukebox_similarity(
 {
     if (jukebox && jukebox->method) {
         musly::method* m = reinterpret_cast<musly::method*>(jukebox->method);
+        musly::read_guard guard(m->get_statelock());
         return m->similarity(
                 seed_track, seed_trackid,
                 tracks, trackids,
@@ -270,6 +317,85 @@ musly_jukebox_similarity(
     }
 }
 
+int
+musly_jukebox_similarity_batch(
+        musly_jukebox* jukebox,
+        musly_track** seed_tracks,
+        musly_trackid* seed_trackids,
+        int num_seeds,
+        musly_track** tracks,
+        musly_trackid* trackids,
+        int num_tracks,
+        float* similarities)
+{
+    if (jukebox && jukebox->method) {
+        musly::method* m = reinterpret_cast<musly::method*>(jukebox->method);
+        musly::read_guard guard(m->get_statelock());
+        return m->similarity_batch(
+                seed_tracks, seed_trackids, num_seeds,
+                tracks, trackids,
+                num_tracks, similarities);
+    } else {
+        return -1;
+    }
+}
+
+int
+musly_jukebox_storetracks(
+        musly_jukebox* jukebox,
+        musly_track** tracks,
+        musly_trackid* trackids,
+        int num_tracks)
+{
+    if (jukebox && jukebox->method) {
+        musly::method* m = reinterpret_cast<musly::method*>(jukebox->method);
+        musly::write_guard update(m->get_updatelock());
+        musly::write_guard guard(m->get_statelock());
+        return m->store_tracks(tracks, trackids, num_tracks);
+    } else {
+        return -1;
+    }
+}
+
+int
+musly_jukebox_similarity_byid(
+        musly_jukebox* jukebox,
+        musly_trackid seed_trackid,
+        musly_trackid* trackids,
+        int num_tracks,
+        float* similarities)
+{
+    if (jukebox && jukebox->method) {
+        musly::method* m = reinterpret_cast<musly::method*>(jukebox->method);
+        musly::read_guard guard(m->get_statelock());
+        return m->similarity_stored(
+                seed_trackid, trackids,
+                num_tracks, similarities);
+    } else {
+        return -1;
+    }
+}
+
+int
+musly_jukebox_topk(
+        musly_jukebox* jukebox,
+        musly_trackid seed_trackid,
+        int k,
+        musly_track_filter filter,
+        void* user_data,
+        musly_trackid* trackids,
+        float* similarities)
+{
+    if (jukebox && jukebox->method && (k >= 0) && trackids) {
+        musly::method* m = reinterpret_cast<musly::method*>(jukebox->method);
+        musly::read_guard guard(m->get_statelock());
+        return m->similarity_topk(seed_trackid, k, filter, user_data,
+                trackids, similarities);
+    } else {
+        return -1;
+    }
+}
+
 int
 musly_jukebox_guessneighbors(
         musly_jukebox* jukebox,
@@ -292,6 +418,7 @@ musly_jukebox_guessneighbors_filtered(
 {
     if (jukebox && jukebox->method) {
         musly::method* m = reinterpret_cast<musly::method*>(jukebox->method);
+        musly::read_guard guard(m->get_statelock());
         return m->guess_neighbors(seed, neighbors, num_neighbors, limit_to, num_limit_to);
     } else {
         return -1;
@@ -305,6 +432,7 @@ musly_jukebox_binsize(
         int num_tracks) {
     if (jukebox && jukebox->method) {
         musly::method* m = reinterpret_cast<musly::method*>(jukebox->method);
+        musly::read_guard guard(m->get_statelock());
         int binsize = 0;
         if (header) {
             binsize = m->serialize_metadata(NULL);
@@ -337,6 +465,7 @@ musly_jukebox_tobin(
         int skip_tracks) {
     if (jukebox && jukebox->method && (skip_tracks >= 0)) {
         musly::method* m = reinterpret_cast<musly::method*>(jukebox->method);
+        musly::read_guard guard(m->get_statelock());
         int written = 0;
         if (header) {
             written += m->serialize_metadata(buffer);
@@ -360,11 +489,13 @@ musly_jukebox_tobin(
 int
 musly_jukebox_frombin(
         musly_jukebox* jukebox,
-        unsigned char* buffer,
+        const unsigned char* buffer,
         int header,
         int num_tracks) {
     if (jukebox && jukebox->method && ((num_tracks >= 0) || header)) {
         musly::method* m = reinterpret_cast<musly::method*>(jukebox->method);
+        musly::write_guard update(m->get_updatelock());
+        musly::write_guard guard(m->get_statelock());
         if (header) {
             int expected_tracks = m->deserialize_metadata(buffer);
             if (expected_tracks < 0) {
@@ -376,7 +507,7 @@ musly_jukebox_frombin(
             else if (num_tracks < 0) {
                 num_tracks = expected_tracks;
             }
-            buffer += musly_jukebox_binsize(jukebox, 1, 0);
+            buffer += m->serialize_metadata(NULL);
         }
         if (num_tracks) {
             num_tracks = m->deserialize_trackdata(buffer, num_tracks);
@@ -397,6 +528,10 @@ musly_jukebox_tostream(
         return -1;
     }
 
+    // keep the jukebox from being modified until everything is written
+    musly::method* m = reinterpret_cast<musly::method*>(jukebox->method);
+    musly::write_guard update(m->get_updatelock());
+
     // obtain size of serialized jukebox header and track information
     const int size_head = musly_jukebox_binsize(jukebox, 1, 0);
     const int size_track = musly_jukebox_binsize(jukebox, 0, 1);
@@ -489,10 +624,10 @@ musly_jukebox_fromstream(
                 << ", expected " << MUSLY_VERSION;
         return NULL;
     }
-    uint8_t intsize;
+    uint8_t intsize = 0;
     if (fread(&intsize, sizeof(intsize), 1, stream) != 1 ||
             intsize != sizeof(int)) {
-        MINILOG(logERROR) << "File was written with integer size " << intsize
+        MINILOG(logERROR) << "File was written with integer size " << (int)intsize
                 << ", expected " << sizeof(int);
         return NULL;
     }
@@ -558,21 +693,300 @@ musly_jukebox_fromstream(
     return jukebox;
 }
 
+namespace {
+
+/** Reads a null-terminated string from a memory block, advancing \p pos.
+ */
+bool
+read_string(
+        const unsigned char*& pos,
+        const unsigned char* end,
+        std::string& str)
+{
+    const unsigned char* stop = (const unsigned char*)memchr(pos, '\0',
+            end - pos);
+    if (!stop) {
+        return false;
+    }
+    str.assign((const char*)pos, stop - pos);
+    pos = stop + 1;
+    return true;
+}
+
+/** Reads a plain value from a memory block, advancing \p pos.
+ */
+template <typename T>
+bool
+read_value(
+        const unsigned char*& pos,
+        const unsigned char* end,
+        T& value)
+{
+    if ((size_t)(end - pos) < sizeof(T)) {
+        return false;
+    }
+    memcpy(&value, pos, sizeof(T));
+    pos += sizeof(T);
+    return true;
+}
+
+/** Restores a jukebox from a memory block holding the format written by
+ * musly_jukebox_tostream(). All tracks are restored in a single call.
+ */
+musly_jukebox*
+jukebox_frommemory(
+        const unsigned char* data,
+        size_t size)
+{
+    const unsigned char* pos = data;
+    const unsigned char* end = data + size;
+
+    // read musly version and platform information
+    std::string version;
+    if (!read_string(pos, end, version) ||
+            version.compare(MUSLY_VERSION) != 0) {
+        MINILOG(logERROR) << "File was written with musly version " << version
+                << ", expected " << MUSLY_VERSION;
+        return NULL;
+    }
+    uint8_t intsize = 0;
+    if (!read_value(pos, end, intsize) || intsize != sizeof(int)) {
+        MINILOG(logERROR) << "File was written with integer size " << (int)intsize
+                << ", expected " << sizeof(int);
+        return NULL;
+    }
+    uint32_t byteorder;
+    if (!read_value(pos, end, byteorder) ||
+            byteorder != (uint32_t)0x01020304) {
+        MINILOG(logERROR) << "File was written with different byte order";
+        return NULL;
+    }
+
+    // read general jukebox information
+    std::string method;
+    std::string decoder;
+    if (!read_string(pos, end, method) || !read_string(pos, end, decoder)) {
+        return NULL;
+    }
+
+    // create empty jukebox
+    musly_jukebox* jukebox = musly_jukebox_poweron(method.c_str(), decoder.c_str());
+    if (!jukebox) {
+        return NULL;
+    }
+
+    // read jukebox-specific header, copied as it is not necessarily aligned
+    int size_head;
+    if (!read_value(pos, end, size_head) || (size_head < 0) ||
+            ((size_t)(end - pos) < (size_t)size_head)) {
+        musly_jukebox_poweroff(jukebox);
+        return NULL;
+    }
+    std::vector<unsigned char> head(pos, pos + size_head);
+    pos += size_head;
+    int expected_tracks;
+    if ((size_head == 0) ||
+            (expected_tracks = musly_jukebox_frombin(jukebox, &head[0], 1, 0)) < 0) {
+        musly_jukebox_poweroff(jukebox);
+        return NULL;
+    }
+
+    // read jukebox-specific track information in one go
+    const int size_track = musly_jukebox_binsize(jukebox, 0, 1);
+    if ((size_track <= 0) ||
+            ((size_t)(end - pos) < (size_t)expected_tracks * size_track)) {
+        musly_jukebox_poweroff(jukebox);
+        return NULL;
+    }
+    if (expected_tracks) {
+        // the track data can be read in place if it is suitably aligned
+        std::vector<unsigned char> copy;
+        const unsigned char* tracks = pos;
+        if ((size_t)pos % sizeof(int)) {
+            copy.assign(pos, pos + (size_t)expected_tracks * size_track);
+            tracks = &copy[0];
+        }
+        if (musly_jukebox_frombin(jukebox, tracks, 0, expected_tracks) < 0) {
+            musly_jukebox_poweroff(jukebox);
+            return NULL;
+        }
+    }
+
+    return jukebox;
+}
+
+/** Writes the jukebox state as a jukebox image, see musly::image_writer.
+ */
+int
+jukebox_toimage(
+        musly_jukebox* jukebox,
+        FILE* stream)
+{
+    // keep the jukebox from being modified until everything is written
+    musly::method* m = reinterpret_cast<musly::method*>(jukebox->method);
+    musly::write_guard update(m->get_updatelock());
+    musly::read_guard guard(m->get_statelock());
+
+    // write the header, musly version and platform information, and the
+    // general jukebox information, followed by the method's arrays
+    musly::image_writer image(stream);
+    const uint8_t intsize = sizeof(int);
+    if (!image.write_header() ||
+            !image.write_string(musly_version()) ||
+            !image.write_value(intsize) ||
+            !image.write_string(jukebox->method_name) ||
+            !image.write_string(jukebox->decoder_name) ||
+            (m->write_image(&image) < 0)) {
+        return -1;
+    }
+    return (int)std::min(image.get_written(), (size_t)INT_MAX);
+}
+
+/** Restores a jukebox from a jukebox image. The jukebox takes ownership of
+ * the mapped \p file and reads the arrays of the image in place.
+ */
+musly_jukebox*
+jukebox_fromimage(
+        musly::image_file* file)
+{
+    musly::image_reader image(file->get_data(), file->get_size());
+
+    // read the header, musly version and platform information
+    int image_version = 0;
+    bool native_byteorder = false;
+    image.read_header(image_version, native_byteorder);
+    if (!native_byteorder) {
+        MINILOG(logERROR) << "File was written with different byte order";
+        delete file;
+        return NULL;
+    }
+    if (image_version != musly::image_version) {
+        MINILOG(logERROR) << "File has jukebox image version " << image_version
+                << ", expected " << musly::image_version;
+        delete file;
+        return NULL;
+    }
+    std::string version;
+    if (!image.read_string(version) || version.compare(MUSLY_VERSION) != 0) {
+        MINILOG(logERROR) << "File was written with musly version " << version
+                << ", expected " << MUSLY_VERSION;
+        delete file;
+        return NULL;
+    }
+    uint8_t intsize = 0;
+    if (!image.read_value(intsize) || intsize != sizeof(int)) {
+        MINILOG(logERROR) << "File was written with integer size " << (int)intsize
+                << ", expected " << sizeof(int);
+        delete file;
+        return NULL;
+    }
+
+    // read general jukebox information
+    std::string method;
+    std::string decoder;
+    if (!image.read_string(method) || !image.read_string(decoder)) {
+        delete file;
+        return NULL;
+    }
+
+    // create empty jukebox, which keeps the image mapped from now on
+    musly_jukebox* jukebox = musly_jukebox_poweron(method.c_str(), decoder.c_str());
+    if (!jukebox) {
+        delete file;
+        return NULL;
+    }
+    musly::method* m = reinterpret_cast<musly::method*>(jukebox->method);
+    m->set_image(file);
+    int result;
+    {
+        musly::write_guard update(m->get_updatelock());
+        musly::write_guard guard(m->get_statelock());
+        result = m->map_image(image);
+    }
+    if (result < 0) {
+        musly_jukebox_poweroff(jukebox);
+        return NULL;
+    }
+    return jukebox;
+}
+
+}  // namespace
+
 int
 musly_jukebox_tofile(
         musly_jukebox* jukebox,
         const char* filename) {
+    if (!jukebox || !jukebox->method) {
+        return -1;
+    }
+
+    // methods without support for jukebox images write the stream format
+    musly::method* m = reinterpret_cast<musly::method*>(jukebox->method);
+    if (m->write_image(NULL) < 0) {
+        if (FILE* f = fopen(filename, "wb")) {
+            int result = musly_jukebox_tostream(jukebox, f);
+            fclose(f);
+            return result;
+        }
+        return -1;
+    }
+
+#if !defined(WIN32) && !defined(_WIN32) && !defined(__WIN32__)
+    // write to a temporary file replacing the file when complete, so
+    // jukeboxes still mapping the old file keep reading it unharmed
+    std::ostringstream tempname;
+    tempname << filename << ".tmp" << getpid() << "." << (size_t)jukebox;
+    int fd = open(tempname.str().c_str(), O_WRONLY | O_CREAT | O_EXCL, 0666);
+    if (fd < 0) {
+        return -1;
+    }
+    FILE* f = fdopen(fd, "wb");
+    if (!f) {
+        close(fd);
+        remove(tempname.str().c_str());
+        return -1;
+    }
+    int result = jukebox_toimage(jukebox, f);
+    if ((fclose(f) != 0) || (result < 0) ||
+            (rename(tempname.str().c_str(), filename) != 0)) {
+        remove(tempname.str().c_str());
+        return -1;
+    }
+    return result;
+#else
+    // Windows does not allow to replace a mapped file, so this fails for
+    // files mapped by a jukebox
     if (FILE* f = fopen(filename, "wb")) {
-        int result = musly_jukebox_tostream(jukebox, f);
-        fclose(f);
+        int result = jukebox_toimage(jukebox, f);
+        if ((fclose(f) != 0) || (result < 0)) {
+            return -1;
+        }
         return result;
     }
     return -1;
+#endif
 }
 
 musly_jukebox*
 musly_jukebox_fromfile(
         const char* filename) {
+    // map the file into memory: jukebox images are read in place for the
+    // lifetime of the jukebox, the stream format is restored from the
+    // mapping in one go
+    musly::image_file* file = new musly::image_file();
+    if (file->open(filename)) {
+        musly::image_reader image(file->get_data(), file->get_size());
+        int image_version;
+        bool native_byteorder;
+        if (image.read_header(image_version, native_byteorder)) {
+            return jukebox_fromimage(file);
+        }
+        musly_jukebox* result = jukebox_frommemory(file->get_data(),
+                file->get_size());
+        delete file;
+        return result;
+    }
+    delete file;
     if (FILE* f = fopen(filename, "rb")) {
         musly_jukebox* result = musly_jukebox_fromstream(f);
         fclose(f);
@@ -711,6 +1125,202 @@ musly_track_analyze_pcm(
     }
 }
 
+musly_track_analyzer*
+musly_track_analyzer_new(
+        musly_jukebox* jukebox)
+{
+    if (jukebox && jukebox->method) {
+        musly::method* m = reinterpret_cast<musly::method*>(jukebox->method);
+        musly::analysis* a = m->analysis_begin();
+        if (!a) {
+            return NULL;
+        }
+        musly_track_analyzer* analyzer = new musly_track_analyzer;
+        analyzer->analysis = reinterpret_cast<void*>(a);
+        return analyzer;
+    } else {
+        return NULL;
+    }
+}
+
+int
+musly_track_analyzer_push(
+        musly_track_analyzer* analyzer,
+        float* mono_22khz_pcm,
+        int length_pcm)
+{
+    if (analyzer && analyzer->analysis) {
+        musly::analysis* a =
+                reinterpret_cast<musly::analysis*>(analyzer->analysis);
+        return a->push(mono_22khz_pcm, length_pcm);
+    } else {
+        return -1;
+    }
+}
+
+int
+musly_track_analyzer_finish(
+        musly_track_analyzer* analyzer,
+        musly_track* track)
+{
+    if (analyzer && analyzer->analysis && track) {
+        musly::analysis* a =
+                reinterpret_cast<musly::analysis*>(analyzer->analysis);
+        return a->finish(track);
+    } else {
+        return -1;
+    }
+}
+
+void
+musly_track_analyzer_free(
+        musly_track_analyzer* analyzer)
+{
+    if (!analyzer) {
+        return;
+    }
+    if (analyzer->analysis) {
+        musly::analysis* a =
+                reinterpret_cast<musly::analysis*>(analyzer->analysis);
+        delete a;
+    }
+    delete analyzer;
+}
+
+namespace {
+
+/** Narrows the excerpt to decode to the central part of it the method
+ * analyzes (see musly::method::get_max_pcmlength()), so the decoder can seek
+ * past and stop before the samples the method would discard. Only excerpts
+ * the decoder centers in the file are narrowed, as they keep their center.
+ */
+void
+limit_excerpt(
+        musly::method* m,
+        float& excerpt_length,
+        float& excerpt_start)
+{
+    int max_pcmlength = m->get_max_pcmlength();
+    if (max_pcmlength <= 0) {
+        return;
+    }
+    const float max_length = (float)max_pcmlength / 22050;
+    if (excerpt_length <= 0) {
+        // the whole file: center the excerpt without limiting its start
+        // (10000 seconds is long enough for any track, and short enough
+        // not to overflow sample counts of files of unknown length)
+        excerpt_length = max_length;
+        excerpt_start = -10000;
+    }
+    else if ((excerpt_length > max_length) && (excerpt_start < 0)) {
+        // a centered excerpt: keep its center
+        excerpt_start -= (excerpt_length - max_length) / 2;
+        excerpt_length = max_length;
+    }
+}
+
+/** Decodes an audio file and analyzes it, see
+ * musly_track_analyze_audiofile().
+ */
+int
+analyze_audiofile(
+        musly::method* m,
+        musly::decoder* d,
+        const char* audiofile,
+        float excerpt_length,
+        float excerpt_start,
+        musly_track* track)
+{
+    // decode the specified excerpt, as far as the method uses it
+    limit_excerpt(m, excerpt_length, excerpt_start);
+    std::vector<float> pcm =
+            d->decodeto_22050hz_mono_float(audiofile, excerpt_length, excerpt_start);
+    if (pcm.size() == 0) {
+        return -1;
+    }
+
+    // pass it on to build the similarity model
+    return m->analyze_track(pcm.data(), pcm.size(), track);
+}
+
+/** Decodes an audio stream and analyzes it, see
+ * musly_track_analyze_audiostream().
+ */
+int
+analyze_audiostream(
+        musly::method* m,
+        musly::decoder* d,
+        musly_read_callback read,
+        musly_seek_callback seek,
+        void* opaque,
+        float excerpt_length,
+        float excerpt_start,
+        musly_track* track)
+{
+    limit_excerpt(m, excerpt_length, excerpt_start);
+    std::vector<float> pcm = d->decodestream_22050hz_mono_float(
+            read, seek, opaque, excerpt_length, excerpt_start);
+    if (pcm.size() == 0) {
+        return -1;
+    }
+    return m->analyze_track(pcm.data(), pcm.size(), track);
+}
+
+/** An encoded audio file held in memory, read through memory_read() and
+ * memory_seek().
+ */
+struct memory_stream {
+    const unsigned char* data;
+    size_t length;
+    size_t pos;
+};
+
+int
+memory_read(
+        void* opaque,
+        unsigned char* buffer,
+        int size)
+{
+    memory_stream* s = reinterpret_cast<memory_stream*>(opaque);
+    if (size <= 0) {
+        return 0;
+    }
+    size_t count = std::min((size_t)size, s->length - s->pos);
+    memcpy(buffer, s->data + s->pos, count);
+    s->pos += count;
+    return (int)count;
+}
+
+long long
+memory_seek(
+        void* opaque,
+        long long offset,
+        int whence)
+{
+    memory_stream* s = reinterpret_cast<memory_stream*>(opaque);
+    long long pos;
+    switch (whence) {
+    case SEEK_SET:
+        pos = offset;
+        break;
+    case SEEK_CUR:
+        pos = (long long)s->pos + offset;
+        break;
+    case SEEK_END:
+        pos = (long long)s->length + offset;
+        break;
+    default:
+        return -1;
+    }
+    if ((pos < 0) || (pos > (long long)s->length)) {
+        return -1;
+    }
+    s->pos = (size_t)pos;
+    return pos;
+}
+
+}  // namespace
+
 int
 musly_track_analyze_audiofile(
         musly_jukebox* jukebox,
@@ -719,33 +1329,400 @@ musly_track_analyze_audiofile(
         float excerpt_start,
         musly_track* track)
 {
-    if (jukebox && jukebox->decoder) {
+    if (jukebox && jukebox->method && jukebox->decoder) {
+        return analyze_audiofile(
+                reinterpret_cast<musly::method*>(jukebox->method),
+                reinterpret_cast<musly::decoder*>(jukebox->decoder),
+                audiofile, excerpt_length, excerpt_start, track);
+    } else {
+        return -1;
+    }
+}
 
-        // try decoding the given audio file
-        musly::decoder* d = reinterpret_cast<musly::decoder*>(jukebox->decoder);
+int
+musly_track_analyze_audiobuffer(
+        musly_jukebox* jukebox,
+        const void* data,
+        size_t length,
+        float excerpt_length,
+        float excerpt_start,
+        musly_track* track)
+{
+    if (!data) {
+        return -1;
+    }
+    memory_stream s = {
+            reinterpret_cast<const unsigned char*>(data), length, 0};
+    return musly_track_analyze_audiostream(jukebox, memory_read, memory_seek,
+            &s, excerpt_length, excerpt_start, track);
+}
 
-        // decode the specified excerpt
-        std::vector<float> pcm =
-                d->decodeto_22050hz_mono_float(audiofile, excerpt_length, excerpt_start);
-        if (pcm.size() == 0) {
-            return -1;
-        }
+int
+musly_track_analyze_audiostream(
+        musly_jukebox* jukebox,
+        musly_read_callback read,
+        musly_seek_callback seek,
+        void* opaque,
+        float excerpt_length,
+        float excerpt_start,
+        musly_track* track)
+{
+    if (jukebox && jukebox->method && jukebox->decoder && read) {
+        return analyze_audiostream(
+                reinterpret_cast<musly::method*>(jukebox->method),
+                reinterpret_cast<musly::decoder*>(jukebox->decoder),
+                read, seek, opaque, excerpt_length, excerpt_start, track);
+    } else {
+        return -1;
+    }
+}
+
+musly_analyzer*
+musly_analyzer_new(
+        musly_jukebox* jukebox)
+{
+    if (!jukebox || !jukebox->method_name || !jukebox->decoder_name) {
+        return NULL;
+    }
+
+    // instantiate the method and decoder of the jukebox once more
+    std::string method_str(jukebox->method_name);
+    musly::method* m = reinterpret_cast<musly::method*>(
+            musly::plugins::instantiate_plugin(
+                    musly::plugins::METHOD_TYPE, method_str));
+    if (!m) {
+        return NULL;
+    }
+    std::string decoder_str(jukebox->decoder_name);
+    musly::decoder* d = reinterpret_cast<musly::decoder*>(
+            musly::plugins::instantiate_plugin(
+                    musly::plugins::DECODER_TYPE, decoder_str));
+    if (!d) {
+        delete m;
+        return NULL;
+    }
+
+    musly_analyzer* analyzer = new musly_analyzer;
+    analyzer->method = reinterpret_cast<void*>(m);
+    analyzer->decoder = reinterpret_cast<void*>(d);
+    return analyzer;
+}
+
+void
+musly_analyzer_free(
+        musly_analyzer* analyzer)
+{
+    if (!analyzer) {
+        return;
+    }
+    if (analyzer->method) {
+        musly::method* m = reinterpret_cast<musly::method*>(analyzer->method);
+        delete m;
+    }
+    if (analyzer->decoder) {
+        musly::decoder* d = reinterpret_cast<musly::decoder*>(analyzer->decoder);
+        delete d;
+    }
+    delete analyzer;
+}
 
-        // pass it on to build the similarity model
-        return musly_track_analyze_pcm(jukebox, pcm.data(), pcm.size(), track);
+int
+musly_analyzer_analyze_pcm(
+        musly_analyzer* analyzer,
+        float* mono_22khz_pcm,
+        int length_pcm,
+        musly_track* track)
+{
+    if (analyzer && analyzer->method) {
+        musly::method* m = reinterpret_cast<musly::method*>(analyzer->method);
+        return m->analyze_track(mono_22khz_pcm, length_pcm, track);
+    } else {
+        return -1;
+    }
+}
+
+int
+musly_analyzer_analyze_audiofile(
+        musly_analyzer* analyzer,
+        const char* audiofile,
+        float excerpt_length,
+        float excerpt_start,
+        musly_track* track)
+{
+    if (analyzer && analyzer->method && analyzer->decoder) {
+        return analyze_audiofile(
+                reinterpret_cast<musly::method*>(analyzer->method),
+                reinterpret_cast<musly::decoder*>(analyzer->decoder),
+                audiofile, excerpt_length, excerpt_start, track);
+    } else {
+        return -1;
+    }
+}
+
+int
+musly_analyzer_analyze_audiobuffer(
+        musly_analyzer* analyzer,
+        const void* data,
+        size_t length,
+        float excerpt_length,
+        float excerpt_start,
+        musly_track* track)
+{
+    if (!data) {
+        return -1;
+    }
+    memory_stream s = {
+            reinterpret_cast<const unsigned char*>(data), length, 0};
+    return musly_analyzer_analyze_audiostream(analyzer, memory_read,
+            memory_seek, &s, excerpt_length, excerpt_start, track);
+}
 
+int
+musly_analyzer_analyze_audiostream(
+        musly_analyzer* analyzer,
+        musly_read_callback read,
+        musly_seek_callback seek,
+        void* opaque,
+        float excerpt_length,
+        float excerpt_start,
+        musly_track* track)
+{
+    if (analyzer && analyzer->method && analyzer->decoder && read) {
+        return analyze_audiostream(
+                reinterpret_cast<musly::method*>(analyzer->method),
+                reinterpret_cast<musly::decoder*>(analyzer->decoder),
+                read, seek, opaque, excerpt_length, excerpt_start, track);
     } else {
         return -1;
     }
-    return 0;
 }
 
-typedef std::pair<float, musly_trackid> knn;
-struct knn_comp {
-    bool operator()(knn const& lhs, knn const& rhs) {
-        return lhs.first < rhs.first;
+namespace {
+
+/** Analyzes the audio files of musly_track_analyze_audiofiles() on one of
+ * several worker threads.
+ */
+class analyze_task : public musly::worker_task {
+public:
+    analyze_task(
+            musly_jukebox* jukebox,
+            const char** audiofiles,
+            int num_files,
+            float excerpt_length,
+            float excerpt_start,
+            musly_track** tracks,
+            musly_track_callback callback,
+            void* user_data) :
+                    jukebox(jukebox),
+                    audiofiles(audiofiles),
+                    excerpt_length(excerpt_length),
+                    excerpt_start(excerpt_start),
+                    tracks(tracks),
+                    callback(callback),
+                    user_data(user_data),
+                    files(num_files),
+                    analyzed(0)
+    {
     }
-} knn_comp;
+
+    virtual void
+    run(
+            int worker)
+    {
+        // each worker analyzes with its own analyzer, so it has its own
+        // decoder, resampler and feature extraction state
+        musly_analyzer* analyzer = musly_analyzer_new(jukebox);
+
+        // fetch one file at a time, as decoding times differ per file
+        int i;
+        while (files.next(i)) {
+            int ret;
+            if (analyzer) {
+                ret = musly_analyzer_analyze_audiofile(analyzer,
+                        audiofiles[i], excerpt_length, excerpt_start,
+                        tracks[i]);
+            } else {
+                // fall back to the state of the jukebox, one worker at a time
+                musly::write_guard guard(shared_lock);
+                ret = musly_track_analyze_audiofile(jukebox, audiofiles[i],
+                        excerpt_length, excerpt_start, tracks[i]);
+            }
+            // the analysis may fail with other codes than -1 (e.g., if the
+            // Gaussian model cannot be estimated), the callback only tells
+            // success or failure
+            ret = (ret == 0) ? 0 : -1;
+            musly::write_guard guard(callback_lock);
+            if (ret == 0) {
+                analyzed++;
+            }
+            if (callback) {
+                callback(i, ret, user_data);
+            }
+        }
+
+        musly_analyzer_free(analyzer);
+    }
+
+    int
+    get_analyzed() const
+    {
+        return analyzed;
+    }
+
+private:
+    musly_jukebox* jukebox;
+    const char** audiofiles;
+    float excerpt_length;
+    float excerpt_start;
+    musly_track** tracks;
+    musly_track_callback callback;
+    void* user_data;
+    musly::work_queue files;
+
+    /** Serializes analyses with the jukebox state.
+     */
+    musly::rwlock shared_lock;
+
+    /** Serializes calls of the callback and protects analyzed.
+     */
+    musly::rwlock callback_lock;
+    int analyzed;
+};
+
+}  // namespace
+
+int
+musly_track_analyze_audiofiles(
+        musly_jukebox* jukebox,
+        const char** audiofiles,
+        int num_files,
+        float excerpt_length,
+        float excerpt_start,
+        musly_track** tracks,
+        int num_threads,
+        musly_track_callback callback,
+        void* user_data)
+{
+    if (!jukebox || !jukebox->method || !jukebox->decoder || (num_files < 0)
+            || ((num_files > 0) && (!audiofiles || !tracks))) {
+        return -1;
+    }
+
+    if (num_threads <= 0) {
+        num_threads = musly::hardware_threads();
+    }
+    analyze_task task(jukebox, audiofiles, num_files, excerpt_length,
+            excerpt_start, tracks, callback, user_data);
+    musly::run_workers(task, std::min(num_threads, num_files));
+    return task.get_analyzed();
+}
+
+namespace {
+
+/** A candidate of musly_findmin(): a value, its id and its index in the
+ * input.
+ */
+struct knn {
+    float value;
+    musly_trackid id;
+    int index;
+};
+
+/** Orders candidates by value, with NaN values last, equal values by their
+ * id, like musly::topk does, and equal ids by their index. This is a strict
+ * total order, so all selection strategies of musly_findmin() agree on the
+ * result.
+ */
+inline bool
+knn_less(
+        const knn& lhs,
+        const knn& rhs) {
+    if (lhs.value < rhs.value) {
+        return true;
+    }
+    if (rhs.value < lhs.value) {
+        return false;
+    }
+    bool lhs_nan = (lhs.value != lhs.value);
+    bool rhs_nan = (rhs.value != rhs.value);
+    if (lhs_nan != rhs_nan) {
+        return rhs_nan;
+    }
+    if (lhs.id != rhs.id) {
+        return lhs.id < rhs.id;
+    }
+    return lhs.index < rhs.index;
+}
+
+/** Selects the \p min_count smallest values with a bounded max-heap, in
+ * a single pass. Most values are rejected by a single comparison against
+ * the largest value in the heap, so this is fastest if \p min_count is
+ * small compared to \p count.
+ */
+void
+select_heap(
+        const float* values,
+        const musly_trackid* ids,
+        int count,
+        int min_count,
+        bool ordered,
+        std::vector<knn>& selected) {
+    selected.resize(min_count);
+    for (int i = 0; i < min_count; i++) {
+        selected[i].value = values[i];
+        selected[i].id = ids ? ids[i] : i;
+        selected[i].index = i;
+    }
+    std::make_heap(selected.begin(), selected.end(), knn_less);
+    float worst = selected.front().value;
+    for (int i = min_count; i < count; i++) {
+        // quick check first; equal and NaN values need the full comparison
+        if (values[i] > worst) {
+            continue;
+        }
+        knn item = {values[i], ids ? ids[i] : i, i};
+        if (knn_less(item, selected.front())) {
+            std::pop_heap(selected.begin(), selected.end(), knn_less);
+            selected.back() = item;
+            std::push_heap(selected.begin(), selected.end(), knn_less);
+            worst = selected.front().value;
+        }
+    }
+    if (ordered) {
+        std::sort_heap(selected.begin(), selected.end(), knn_less);
+    }
+}
+
+/** Selects the \p min_count smallest values by partitioning all of them
+ * with std::nth_element(), sorting only the selected ones if needed. Its
+ * cost hardly depends on \p min_count, so this is fastest if \p min_count
+ * is a large fraction of \p count.
+ */
+void
+select_partition(
+        const float* values,
+        const musly_trackid* ids,
+        int count,
+        int min_count,
+        bool ordered,
+        std::vector<knn>& selected) {
+    selected.resize(count);
+    for (int i = 0; i < count; i++) {
+        selected[i].value = values[i];
+        selected[i].id = ids ? ids[i] : i;
+        selected[i].index = i;
+    }
+    if (min_count < count) {
+        std::nth_element(selected.begin(), selected.begin() + (min_count-1),
+                selected.end(), knn_less);
+    }
+    selected.resize(min_count);
+    if (ordered) {
+        std::sort(selected.begin(), selected.end(), knn_less);
+    }
+}
+
+}  // namespace
 
 int
 musly_findmin(
@@ -764,65 +1741,34 @@ musly_findmin(
     if (min_count > count) {
         min_count = count;
     }
-    if (!min_count) {
+    if (min_count <= 0) {
         return 0;
     }
     if (!min_values && !min_ids) {
         return -1;
     }
 
-    // Find the top `min_count` items by iterating over `values` and
-    // possibly `ids` and collecting the best items in a heap
-    // TODO: Depending on `count`, `min_count` and `ordered`,
-    // std::partial_sort() or std::nth_element() may be faster.
-    std::vector<knn> heap(0);
-    heap.reserve(min_count);
-
-    if (ids) {
-        // Fill heap with first `min_count` (value, id) pairs
-        for (int i = 0; i < min_count; i++) {
-            heap.push_back(std::make_pair(values[i], ids[i]));
-            std::push_heap(heap.begin(), heap.end(), knn_comp);
-        }
-        // Update heap as needed
-        for (int i = min_count; i < count; i++) {
-            if (values[i] < heap.front().first) {
-                std::pop_heap(heap.begin(), heap.end(), knn_comp);
-                heap.back() = std::make_pair(values[i], ids[i]);
-                std::push_heap(heap.begin(), heap.end(), knn_comp);
-            }
-        }
-    }
-    else {
-        // Fill heap with first `min_count` (value, index) pairs
-        for (int i = 0; i < min_count; i++) {
-            heap.push_back(std::make_pair(values[i], (musly_trackid)i));
-            std::push_heap(heap.begin(), heap.end(), knn_comp);
-        }
-        // Update heap as needed
-        for (int i = min_count; i < count; i++) {
-            if (values[i] < heap.front().first) {
-                std::pop_heap(heap.begin(), heap.end(), knn_comp);
-                heap.back() = std::make_pair(values[i], (musly_trackid)i);
-                std::push_heap(heap.begin(), heap.end(), knn_comp);
-            }
-        }
-    }
-
-    if (ordered) {
-        // transform into sorted list
-        std::sort_heap(heap.begin(), heap.end(), knn_comp);
+    // Select the `min_count` smallest items. Benchmarks with uniformly
+    // distributed values for `count` from 1e3 to 1e6 showed the heap to be
+    // faster up to `min_count` of about 1/32 of `count`, whether ordered or
+    // not; beyond that, partitioning wins by up to 5x.
+    std::vector<knn> selected;
+    if ((size_t)min_count * 32 <= (size_t)count) {
+        select_heap(values, ids, count, min_count, ordered != 0, selected);
+    } else {
+        select_partition(values, ids, count, min_count, ordered != 0,
+                selected);
     }
 
     // Copy out the results
     if (min_values) {
         for (int i = 0; i < min_count; i++) {
-            min_values[i] = heap[i].first;
+            min_values[i] = values[selected[i].index];
         }
     }
     if (min_ids) {
         for (int i = 0; i < min_count; i++) {
-            min_ids[i] = heap[i].second;
+            min_ids[i] = selected[i].id;
         }
     }
     return min_count;
@@ -0,0 +1,96 @@
+/**
+ * Copyright 2013-2014, Dominik Schnitzer <dominik@schnitzer.at>
+ *                2014, Jan Schlueter <jan.schlueter@ofai.at>
+ *
+ * This file is part of Musly, a program for high performance music
+ * similarity computation: http://www.musly.org/.
+ *
+ * This Source Code Form is subject to the terms of the Mozilla
+ * Public License v. 2.0. If a copy of the MPL was not distributed
+ * with this file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+#ifndef MUSLY_MAPPEDARRAY_H_
+#define MUSLY_MAPPEDARRAY_H_
+
+#include <algorithm>
+#include <cstddef>
+#include <vector>
+
+namespace musly {
+
+/** A flat array that either owns its items or reads them in place from a
+ * jukebox image, see image_reader. Items are only accessed read-only; to
+ * modify them, call owned(), which copies mapped items into an owned
+ * std::vector on first use (copy on write).
+ */
+template <typename T>
+class mapped_array {
+private:
+    std::vector<T> items;
+
+    /** The mapped items, or NULL if the items are owned.
+     */
+    const T* view;
+    size_t count;
+
+public:
+    mapped_array() : view(NULL), count(0) {}
+
+    inline size_t
+    size() const {
+        return view ? count : items.size();
+    }
+
+    inline bool
+    empty() const {
+        return size() == 0;
+    }
+
+    inline const T*
+    data() const {
+        return view ? view : (items.empty() ? NULL : &items[0]);
+    }
+
+    inline const T&
+    operator[](size_t index) const {
+        return view ? view[index] : items[index];
+    }
+
+    inline bool
+    is_mapped() const {
+        return view != NULL;
+    }
+
+    /** Reads \p count items in place from \p items, which have to stay
+     * valid until the array is modified or mapped again.
+     */
+    void
+    map(const T* items, size_t count) {
+        std::vector<T>().swap(this->items);
+        view = count ? items : NULL;
+        this->count = count;
+    }
+
+    /** Returns the items for modification, copying mapped items first.
+     */
+    std::vector<T>&
+    owned() {
+        if (view) {
+            items.assign(view, view + count);
+            view = NULL;
+            count = 0;
+        }
+        return items;
+    }
+
+    void
+    swap(mapped_array& other) {
+        items.swap(other.items);
+        std::swap(view, other.view);
+        std::swap(count, other.count);
+    }
+};
+
+} /* namespace musly */
+#endif /* MUSLY_MAPPEDARRAY_H_ */
@@ -19,7 +19,8 @@ melspectrum::melspectrum(
         int powerspectrum_bins,
         int mel_bins,
         int sample_rate) :
-                filterbank(mel_bins, powerspectrum_bins)
+                band_start(mel_bins),
+                band_weights(mel_bins)
 {
     // our mel filters start at a minimum frequency of 20hz
     float min_freq = 20;
@@ -52,24 +53,39 @@ melspectrum::melspectrum(
     }
     Eigen::VectorXf heights = 2.0f / (right.array() - left.array());
 
-    // construct filterbank
+    // construct filterbank, keeping the band of nonzero weights of each
+    // filter
+    Eigen::RowVectorXf filter(powerspectrum_bins);
     for (int i = 0; i < mel_bins; i++) {
+        filter.setZero();
         for (int j = 0; j < powerspectrum_bins; j++) {
             if ((ps_freq(j) > left(i)) && (ps_freq(j) <= center(i))) {
                 float weight = heights(i) *
                         ((ps_freq(j) - left(i)) / (center(i) - left(i)));
-                filterbank.insert(i, j) = weight;
+                filter(j) = weight;
             }
 
             if ((ps_freq(j) > center(i)) && (ps_freq(j) < right(i))) {
                 float weight = heights(i) *
                         ((right(i) - ps_freq(j)) / (right(i) - center(i)));
-                filterbank.insert(i, j) = weight;
+                filter(j) = weight;
             }
         }
-    }
 
-    MINILOG(logTRACE) << "Mel filterbank: " << filterbank;
+        int first = 0;
+        while ((first < powerspectrum_bins) && (filter(first) == 0)) {
+            first++;
+        }
+        int last = powerspectrum_bins - 1;
+        while ((last >= first) && (filter(last) == 0)) {
+            last--;
+        }
+        band_start[i] = first;
+        band_weights[i] = filter.segment(first, last - first + 1);
+
+        MINILOG(logTRACE) << "Mel filter " << i << ": bins=" << first
+                << "-" << last << " weights=" << band_weights[i];
+    }
 }
 
 melspectrum::~melspectrum()
@@ -82,10 +98,11 @@ melspectrum::from_powerspectrum(const Eigen::MatrixXf& ps)
     MINILOG(logTRACE) << "Mel filtering specturm. size=" << ps.rows()
             << "x" << ps.cols();
 
-    // iterate over each frame and apply the triangular mel filters
-    Eigen::MatrixXf mels(filterbank.rows(), ps.cols());
-    for (int i = 0; i < ps.cols(); i++) {
-        mels.col(i) = filterbank * ps.col(i);
+    // apply each triangular mel filter to its band of all frames
+    Eigen::MatrixXf mels(band_weights.size(), ps.cols());
+    for (int i = 0; i < (int)band_weights.size(); i++) {
+        mels.row(i).noalias() = band_weights[i] *
+                ps.middleRows(band_start[i], band_weights[i].size());
     }
 
     MINILOG(logTRACE) << "Mel specturm computed. size=" << mels.rows()
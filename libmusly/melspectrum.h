@@ -14,15 +14,20 @@
 
 #include <vector>
 #include <Eigen/Core>
-#include <Eigen/Sparse>
 
 namespace musly {
 
 class melspectrum {
 private:
-    /** Stores the triangular filterbank for each mel bin.
+    /** The first powerspectrum bin covered by the triangular filter of each
+     * mel bin.
      */
-    Eigen::SparseMatrix<float> filterbank;
+    std::vector<int> band_start;
+
+    /** The weights of the triangular filter of each mel bin, for the
+     * contiguous powerspectrum bins starting at band_start.
+     */
+    std::vector<Eigen::RowVectorXf> band_weights;
 
 public:
     /** Initializes the Mel filterbanks. The Mel filterbanks are computed using
@@ -42,7 +47,9 @@ public:
     virtual ~melspectrum();
 
     /** Computes the Mel spectrum from the given powerspectrum. The triangular
-     * filterbank is precomputed in the constructor.
+     * filterbank is precomputed in the constructor. Each filter is applied to
+     * all frames at once, as a product of its weights with the band of
+     * powerspectrum bins it covers.
      * \param ps The powerspectrum as a matrix (frequency, time).
      * \returns The Mel spectrum as a matrix (frequency, time). Column major.
      */
@@ -11,17 +11,24 @@
  */
 
 #include <cstdio>
+#include <algorithm>
+#include <vector>
 #include "method.h"
+#include "topk.h"
 
 namespace musly {
 
 method::method() :
-        track_size(0)
+        track_size(0),
+        image(NULL),
+        max_tombstone_ratio(0.25f)
 {
 }
 
 method::~method()
 {
+    // nothing reads from the image once the method is destroyed
+    delete image;
 }
 
 
@@ -49,12 +56,39 @@ method::track_getsize()
     return track_size;
 }
 
+rwlock&
+method::get_statelock()
+{
+    return state_lock;
+}
+
+rwlock&
+method::get_updatelock()
+{
+    return update_lock;
+}
+
 musly_track*
 method::track_alloc()
 {
     return new musly_track[track_size];
 }
 
+void
+method::track_interleave(
+        musly_track** tracks,
+        int count,
+        int lanes,
+        float* tile)
+{
+    for (int l = 0; l < lanes; l++) {
+        const musly_track* t = tracks[(l < count) ? l : 0];
+        for (int e = 0; e < track_size; e++) {
+            tile[e*lanes + l] = t[e];
+        }
+    }
+}
+
 const char*
 method::track_tostr(
         musly_track* track)
@@ -85,6 +119,200 @@ method::set_musicstyle(
     return 0;
 }
 
+namespace {
+
+/** The default incremental analysis, collecting the signal for
+ * method::analyze_track().
+ */
+class buffered_analysis :
+        public analysis
+{
+private:
+    method* m;
+    std::vector<float> pcm;
+
+public:
+    buffered_analysis(method* m) : m(m) {}
+
+    virtual int
+    push(
+            const float* pcm,
+            int length) {
+        if ((length < 0) || ((length > 0) && !pcm)) {
+            return -1;
+        }
+        this->pcm.insert(this->pcm.end(), pcm, pcm + length);
+        return 0;
+    }
+
+    virtual int
+    finish(
+            musly_track* track) {
+        return m->analyze_track(pcm.data(), pcm.size(), track);
+    }
+};
+
+}  // namespace
+
+int
+method::get_max_pcmlength()
+{
+    return 0;
+}
+
+analysis*
+method::analysis_begin()
+{
+    return new buffered_analysis(this);
+}
+
+int
+method::similarity_batch(
+        musly_track** seed_tracks,
+        musly_trackid* seed_trackids,
+        int num_seeds,
+        musly_track** tracks,
+        musly_trackid* trackids,
+        int length,
+        float* similarities)
+{
+    if ((num_seeds <= 0) || !seed_tracks || !seed_trackids) {
+        return -1;
+    }
+
+    // one row of similarities per seed
+    for (int i = 0; i < num_seeds; i++) {
+        int res = similarity(seed_tracks[i], seed_trackids[i],
+                tracks, trackids, length, similarities + (size_t)i*length);
+        if (res != 0) {
+            return res;
+        }
+    }
+    return 0;
+}
+
+int
+method::store_tracks(
+        musly_track** tracks,
+        musly_trackid* trackids,
+        int length)
+{
+    if ((length < 0) || ((length > 0) && (!tracks || !trackids))) {
+        return -1;
+    }
+    store.set_tracksize(track_size);
+    store.add_tracks(tracks, trackids, length);
+    return 0;
+}
+
+void
+method::unstore_tracks(
+        musly_trackid* trackids,
+        int length)
+{
+    store.remove_tracks(trackids, length);
+    if (store.get_tombstonecount() >
+            max_tombstone_ratio * store.get_slotcount()) {
+        store.compact();
+    }
+}
+
+void
+method::set_compaction(
+        float max_tombstone_ratio)
+{
+    this->max_tombstone_ratio = max_tombstone_ratio;
+}
+
+void
+method::compact()
+{
+    store.compact();
+}
+
+int
+method::similarity_stored(
+        musly_trackid seed_trackid,
+        musly_trackid* trackids,
+        int length,
+        float* similarities)
+{
+    if ((length <= 0) || !trackids || !similarities) {
+        return -1;
+    }
+
+    // lookup the tracks in the store
+    int seed_position = store.position_of(seed_trackid);
+    if (seed_position < 0) {
+        return -1;
+    }
+    std::vector<int> positions(length);
+    if (store.positions_of(trackids, length, positions.data()) < length) {
+        return -1;
+    }
+
+    // copy them out, the seed track first
+    std::vector<musly_track> buffer((size_t)(length + 1) * track_size);
+    store.gather(&seed_position, 1, &buffer[0]);
+    store.gather(&positions[0], length, &buffer[track_size]);
+    std::vector<musly_track*> tracks(length);
+    for (int i = 0; i < length; i++) {
+        // point the seed track to itself, so methods recognize it
+        tracks[i] = (trackids[i] == seed_trackid) ? &buffer[0] :
+                &buffer[(size_t)(i + 1) * track_size];
+    }
+
+    return similarity(&buffer[0], seed_trackid, &tracks[0], trackids,
+            length, similarities);
+}
+
+int
+method::similarity_topk(
+        musly_trackid seed_trackid,
+        int k,
+        musly_track_filter filter,
+        void* user_data,
+        musly_trackid* trackids,
+        float* similarities)
+{
+    if ((k < 0) || !trackids || (store.position_of(seed_trackid) < 0)) {
+        return -1;
+    }
+
+    // compute the similarities to a block of stored tracks at a time and
+    // keep the best ones
+    topk best(k);
+    const int block = 1024;
+    std::vector<musly_trackid> ids;
+    ids.reserve(block);
+    std::vector<float> sims(block);
+    const int size = store.get_slotcount();
+    for (int p0 = 0; p0 < size; p0 += block) {
+        const int p1 = std::min(p0 + block, size);
+        ids.clear();
+        for (int p = p0; p < p1; p++) {
+            if (store.is_tombstone(p)) {
+                continue;
+            }
+            musly_trackid id = store.trackid_at(p);
+            if ((id != seed_trackid) && (!filter || filter(id, user_data))) {
+                ids.push_back(id);
+            }
+        }
+        if (ids.empty()) {
+            continue;
+        }
+        if (similarity_stored(seed_trackid, &ids[0], ids.size(),
+                &sims[0]) != 0) {
+            return -1;
+        }
+        for (int i = 0; i < (int)ids.size(); i++) {
+            best.offer(sims[i], ids[i]);
+        }
+    }
+    return best.finish(trackids, similarities);
+}
+
 int
 method::guess_neighbors(
         musly_trackid seed,
@@ -108,8 +336,8 @@ method::serialize_metadata(
 
 int
 method::deserialize_metadata(
-        unsigned char* buffer) {
-    int expected_tracks = *(int*)(buffer);
+        const unsigned char* buffer) {
+    int expected_tracks = *(const int*)(buffer);
     return expected_tracks;
 }
 
@@ -124,11 +352,32 @@ method::serialize_trackdata(
 
 int
 method::deserialize_trackdata(
-        unsigned char* buffer,
+        const unsigned char* buffer,
         int num_tracks) {
     // default: not implemented
     return -1;
 }
 
+int
+method::write_image(
+        image_writer* image) {
+    // default: not implemented
+    return -1;
+}
+
+int
+method::map_image(
+        image_reader& image) {
+    // default: not implemented
+    return -1;
+}
+
+void
+method::set_image(
+        image_file* image) {
+    delete this->image;
+    this->image = image;
+}
+
 
 } /* namespace musly */
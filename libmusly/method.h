@@ -16,10 +16,42 @@
 #include <string>
 #include <vector>
 #include "plugins.h"
+#include "trackstore.h"
+#include "jukeboximage.h"
+#include "rwlock.h"
 #include "musly/musly_types.h"
 
 namespace musly {
 
+/** An incremental analysis of a PCM signal, as started by
+ * method::analysis_begin(). The signal is passed in chunks of any size with
+ * push(), then finish() computes the features of the signal.
+ */
+class analysis {
+public:
+    virtual ~analysis() {}
+
+    /** Passes the next chunk of the signal.
+     *
+     * \param pcm PCM samples (mono, 22050 Hz, floats in [-1, 1]).
+     * \param length The number of samples in \p pcm.
+     * \returns 0 on success, -1 on an error.
+     */
+    virtual int
+    push(
+            const float* pcm,
+            int length) = 0;
+
+    /** Computes the features of the signal passed so far.
+     *
+     * \param track The musly_track to write the features to.
+     * \returns 0 on success, or an error code like method::analyze_track().
+     */
+    virtual int
+    finish(
+            musly_track* track) = 0;
+};
+
 class method :
         public plugin
 {
@@ -40,7 +72,31 @@ private:
      */
     std::string trackstr;
 
+    /** Serializes all modifications of the jukebox state, see
+     * get_updatelock().
+     */
+    rwlock update_lock;
+
+    /** The jukebox image the state was restored from, see set_image().
+     */
+    image_file* image;
+
 protected:
+    /** Copies of tracks stored in the jukebox, see store_tracks().
+     */
+    trackstore store;
+
+    /** Protects the jukebox state (registered tracks, the stored tracks and
+     * all indices) against concurrent access, see get_statelock().
+     */
+    rwlock state_lock;
+
+    /** The largest fraction of tombstones left by removed tracks in the
+     * track store and the indices before they are compacted, see
+     * set_compaction().
+     */
+    float max_tombstone_ratio;
+
     /** Add features to the Musly method track model. Each musly::method music
      * similarity method needs to store the features for each music track in a
      * musly_track structure. The structure is a simple array of floats,
@@ -68,6 +124,24 @@ protected:
             const std::string& name,
             int num_floats);
 
+    /** Copy tracks into a tile of interleaved tracks, as used by kernels that
+     * process several tracks in lockstep: element \c e of the \c l-th track
+     * is written to <tt>tile[e*lanes + l]</tt>. If \p count is smaller than
+     * \p lanes, the remaining lanes are filled with copies of the first
+     * track, so they hold valid (but meaningless) features.
+     *
+     * \param[in] tracks The tracks to copy.
+     * \param[in] count The number of tracks to copy, at most \p lanes.
+     * \param[in] lanes The number of tracks in a tile.
+     * \param[out] tile A buffer of <tt>track_getsize() * lanes</tt> floats.
+     */
+    void
+    track_interleave(
+            musly_track** tracks,
+            int count,
+            int lanes,
+            float* tile);
+
 public:
     method();
     virtual ~method();
@@ -90,6 +164,23 @@ public:
     int
     track_getsize();
 
+    /** Returns the lock protecting the jukebox state. Queries such as
+     * similarity() hold it for reading, so any number of them can run
+     * concurrently. Modifications hold it for writing.
+     */
+    rwlock&
+    get_statelock();
+
+    /** Returns the lock serializing modifications of the jukebox state. It
+     * is held exclusively (i.e., for writing) by any modification before
+     * acquiring the state lock, and by operations that need a consistent
+     * view of the state over several calls, such as serialization. While
+     * holding it, the state lock may be acquired, but not the other way
+     * round.
+     */
+    rwlock&
+    get_updatelock();
+
     /** Allocate a musly_track.
      */
     musly_track*
@@ -111,6 +202,27 @@ public:
             int length,
             musly_track* track) = 0;
 
+    /**
+     * Returns the maximum number of PCM samples analyze_track() uses. Of a
+     * longer signal, it only analyzes the central samples, so decoders can
+     * skip the rest. The default implementation returns 0, meaning that the
+     * whole signal is used.
+     */
+    virtual int
+    get_max_pcmlength();
+
+    /**
+     * Starts an incremental analysis of a PCM signal. The default
+     * implementation collects the signal and calls analyze_track() when
+     * finished; methods can override it to analyze the signal as it comes
+     * in, in bounded memory.
+     *
+     * \returns a new analysis object, to be deleted by the caller before
+     * the method is destroyed.
+     */
+    virtual analysis*
+    analysis_begin();
+
     /**
      *
      */
@@ -123,6 +235,120 @@ public:
             int length,
             float* similarities) = 0;
 
+    /**
+     * Computes the similarities between several seed tracks and a list of
+     * other tracks in one go. The default implementation calls similarity()
+     * once per seed; methods can override it to share work across seeds.
+     *
+     * \param seed_tracks The seed tracks.
+     * \param seed_trackids The ids of the seed tracks.
+     * \param num_seeds The length of \p seed_tracks and \p seed_trackids.
+     * \param tracks The tracks to compute the similarities to.
+     * \param trackids The ids of \p tracks.
+     * \param length The length of \p tracks and \p trackids.
+     * \param similarities A preallocated array of <tt>num_seeds * length</tt>
+     * floats. Row \c i receives the similarities of seed \c i.
+     * \returns 0 on success, -1 on an error.
+     */
+    virtual int
+    similarity_batch(
+            musly_track** seed_tracks,
+            musly_trackid* seed_trackids,
+            int num_seeds,
+            musly_track** tracks,
+            musly_trackid* trackids,
+            int length,
+            float* similarities);
+
+    /**
+     * Copies tracks into the contiguous track store of the method, so they
+     * can be addressed by their ids in similarity_stored(). Tracks already
+     * stored under the given ids are overwritten.
+     *
+     * \param tracks The tracks to store.
+     * \param trackids The ids to store the tracks under.
+     * \param length The length of \p tracks and \p trackids.
+     * \returns 0 on success, -1 on an error.
+     */
+    int
+    store_tracks(
+            musly_track** tracks,
+            musly_trackid* trackids,
+            int length);
+
+    /**
+     * Removes tracks from the track store. Unknown ids are skipped. The
+     * tracks are only marked as removed; the store is compacted once the
+     * removed tracks exceed the fraction set by set_compaction().
+     */
+    void
+    unstore_tracks(
+            musly_trackid* trackids,
+            int length);
+
+    /**
+     * Sets the largest fraction of tombstones, i.e., positions of removed
+     * tracks, the track store and the indices of the method may hold before
+     * remove_tracks() and unstore_tracks() compact them. At 0, they are
+     * compacted on every removal; at 1 or above, only by compact().
+     */
+    void
+    set_compaction(
+            float max_tombstone_ratio);
+
+    /**
+     * Drops all tombstones of removed tracks from the track store. Methods
+     * that keep per-track indices override it to compact these as well.
+     */
+    virtual void
+    compact();
+
+    /**
+     * Computes the similarities between a seed track and a list of other
+     * tracks, all taken from the track store by their ids. The default
+     * implementation copies the tracks out of the store and calls
+     * similarity(); methods can override it to compute similarities on the
+     * store directly.
+     *
+     * \param seed_trackid The id of the seed track.
+     * \param trackids The ids of the tracks to compute the similarities to.
+     * \param length The length of \p trackids.
+     * \param similarities A preallocated array of \p length floats.
+     * \returns 0 on success, -1 on an error, e.g., if a track is not stored.
+     */
+    virtual int
+    similarity_stored(
+            musly_trackid seed_trackid,
+            musly_trackid* trackids,
+            int length,
+            float* similarities);
+
+    /**
+     * Finds the tracks in the track store most similar to a stored seed
+     * track. The default implementation computes the similarities with
+     * similarity_stored() block by block and keeps the best ones in a
+     * bounded heap; methods can override it to skip computations for tracks
+     * that cannot make it into the result.
+     *
+     * \param seed_trackid The id of the seed track, it is never returned.
+     * \param k The maximum number of tracks to return.
+     * \param filter If not <tt>NULL</tt>, only stored tracks it returns
+     * nonzero for are considered.
+     * \param user_data Passed on to \p filter.
+     * \param trackids Receives up to \p k track ids, the most similar first.
+     * \param similarities Receives the similarities of the returned tracks,
+     * if not <tt>NULL</tt>.
+     * \returns the number of tracks returned, or -1 on an error.
+     */
+    virtual int
+    similarity_topk(
+            musly_trackid seed_trackid,
+            int k,
+            musly_track_filter filter,
+            void* user_data,
+            musly_trackid* trackids,
+            float* similarities);
+
     /**
      *
      */
@@ -143,7 +369,12 @@ public:
             int length);
 
     /**
-     *
+     * Registers tracks with the jukebox. This is called with the update lock
+     * held, but not the state lock: Implementations should do expensive
+     * computations first, and then hold the state lock for writing while
+     * modifying the jukebox state, so concurrent queries are only blocked
+     * briefly. The expensive computations can be spread over all cores with
+     * run_workers(), which runs in parallel in every build.
      */
     virtual int
     add_tracks(
@@ -227,7 +458,7 @@ public:
      */
     virtual int
     deserialize_metadata(
-            unsigned char* buffer);
+            const unsigned char* buffer);
 
     /**
      * Restores the jukebox state for registered tracks from a binary buffer.
@@ -240,9 +471,43 @@ public:
      */
     virtual int
     deserialize_trackdata(
-            unsigned char* buffer,
+            const unsigned char* buffer,
             int num_tracks);
 
+    /**
+     * Writes the jukebox state as flat arrays to a jukebox image, the file
+     * format of musly_jukebox_tofile(). The default implementation does not
+     * support images.
+     *
+     * \param image The image to write to, or <tt>NULL</tt> to query whether
+     * images are supported.
+     * \returns 0 on success, or -1 in case of an error or if images are not
+     * supported.
+     */
+    virtual int
+    write_image(
+            image_writer* image);
+
+    /**
+     * Restores the jukebox state from a jukebox image written by
+     * write_image(). The arrays are read in place and only copied when the
+     * jukebox is modified, so the image has to stay mapped as long as the
+     * method exists, see set_image().
+     *
+     * \returns 0 on success, or -1 in case of an error.
+     */
+    virtual int
+    map_image(
+            image_reader& image);
+
+    /**
+     * Passes the mapped file of a jukebox image to the method, which keeps it
+     * mapped until the method is destroyed.
+     */
+    void
+    set_image(
+            image_file* image);
+
 };
 
 /** A macro to facilitating registering a method class with musly. This macro
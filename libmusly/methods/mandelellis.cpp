@@ -10,10 +10,13 @@
  * with this file, You can obtain one at http://mozilla.org/MPL/2.0/.
  */
 
+#include <algorithm>
+#include <vector>
 #include <Eigen/Core>
 
 #include "minilog.h"
 #include "windowfunction.h"
+#include "gaussiananalysis.h"
 #include "mandelellis.h"
 
 
@@ -85,23 +88,16 @@ mandelellis::analyze_track(
         length = max_pcmlength;
     }
 
-    // PCM --> powerspectrum
+    // stream the excerpt through PCM --> powerspectrum --> Mel --> MFCC
+    // --> Gaussian a few frames at a time, normalized to its peak like
+    // powerspectrum::from_pcm() does
     Eigen::Map<Eigen::VectorXf> pcm_vector(pcm+start, length);
-    Eigen::MatrixXf power_spectrum = ps.from_pcm(pcm_vector);
-
-    // powerspectrum -> Mel
-    Eigen::MatrixXf mel_spectrum = mel.from_powerspectrum(power_spectrum);
-
-    // Mel -> MFCC representation
-    Eigen::MatrixXf mfcc_representation =
-            mfccs.from_melspectrum(mel_spectrum);
-
-    // estimate the Gaussian from the MFCC representation
-    gaussian g = {0, 0, 0, 0};
-    g.mu = &track[track_mu];
-    g.covar = &track[track_covar];
-    g.covar_inverse = &track[track_covar_inverse];
-    if (gs.estimate_gaussian(mfcc_representation, g) == false) {
+    float peak = (length > 0) ? pcm_vector.cwiseAbs().maxCoeff() : 0;
+    gaussian_analysis a(ps, mel, mfccs, gs, powerspectrum::get_pcmscale(peak),
+            track_mu,
+            track_covar, track_covar_inverse, -1);
+    a.push(pcm+start, length);
+    if (a.finish(track) != 0) {
         MINILOG(logTRACE) << "ME Gaussian model estimation failed.";
         return 2;
     }
@@ -112,6 +108,92 @@ mandelellis::analyze_track(
 }
 
 
+int
+mandelellis::get_max_pcmlength()
+{
+    return max_pcmlength;
+}
+
+analysis*
+mandelellis::analysis_begin()
+{
+    // the peak of the signal is not known in advance, so unlike
+    // analyze_track(), the analysis assumes it to be at full scale
+    return new gaussian_analysis(windowfunction::hann(window_size), hop,
+            mel, mfccs, gs, powerspectrum::get_pcmscale(1.0f), track_mu,
+            track_covar, track_covar_inverse, -1);
+}
+
+
+void
+mandelellis::similarity_raw(
+        musly_track* track,
+        musly_track** tracks,
+        int length,
+        float* similarities)
+{
+    // map seed track to gaussian structure
+    gaussian g0;
+    g0.mu = &track[track_mu];
+    g0.covar = &track[track_covar];
+    g0.covar_inverse = &track[track_covar_inverse];
+
+    // create the temporary buffers required for the Kullback-Leibler
+    // divergence
+    const int lanes = gaussian_statistics::lanes;
+    std::vector<float> tile(track_getsize() * lanes);
+    std::vector<float> tmp(gs.get_lanes_tmpsize());
+    float skld[lanes];
+
+    // iterate over all musly_tracks to compute the Kullback-Leibler
+    // divergence, several tracks at a time
+    for (int i = 0; i < length; i += lanes) {
+        int count = std::min(lanes, length - i);
+        track_interleave(tracks + i, count, lanes, tile.data());
+        gs.symmetric_kullbackleibler_lanes(g0, &tile[track_mu*lanes],
+                &tile[track_covar*lanes], &tile[track_covar_inverse*lanes],
+                lanes, tmp.data(), skld);
+
+        for (int l = 0; l < count; l++) {
+            // return 0 if the models to compare are the same: the lanes
+            // cannot detect this, but symmetric_kullbackleibler(), which was
+            // used here before, returns 0 if given the seed itself
+            similarities[i+l] = (tracks[i+l] == track) ? 0 : skld[l];
+        }
+    }
+}
+
+void
+mandelellis::kullbackleibler_stored(
+        gaussian& g0,
+        const int* positions,
+        int count,
+        float* tile,
+        float* tmp,
+        float* skld)
+{
+    const int lanes = gaussian_statistics::lanes;
+    const int stride = store.get_stride();
+
+    // tracks at consecutive positions are read straight from the store,
+    // others are gathered into a tile first
+    int p = positions[0];
+    bool consecutive = (p + lanes <= stride);
+    for (int l = 1; consecutive && (l < count); l++) {
+        consecutive = (positions[l] == p + l);
+    }
+    if (consecutive) {
+        gs.symmetric_kullbackleibler_lanes(g0, store.field(track_mu) + p,
+                store.field(track_covar) + p,
+                store.field(track_covar_inverse) + p, stride, tmp, skld);
+    } else {
+        store.gather_interleaved(positions, count, lanes, tile);
+        gs.symmetric_kullbackleibler_lanes(g0, &tile[track_mu*lanes],
+                &tile[track_covar*lanes], &tile[track_covar_inverse*lanes],
+                lanes, tmp, skld);
+    }
+}
+
 int
 mandelellis::similarity(
         musly_track* track,
@@ -125,32 +207,58 @@ mandelellis::similarity(
         return -1;
     }
 
+    similarity_raw(track, tracks, length, similarities);
+
+    return 0;
+}
+
+int
+mandelellis::similarity_stored(
+        musly_trackid seed_trackid,
+        musly_trackid* trackids,
+        int length,
+        float* similarities)
+{
+    if ((length <= 0) || !trackids || !similarities) {
+        return -1;
+    }
+
+    // lookup the tracks in the store
+    int seed_position = store.position_of(seed_trackid);
+    if (seed_position < 0) {
+        return -1;
+    }
+    std::vector<int> positions(length);
+    if (store.positions_of(trackids, length, positions.data()) < length) {
+        return -1;
+    }
+
     // map seed track to gaussian structure
+    std::vector<musly_track> track(track_getsize());
+    store.gather(&seed_position, 1, track.data());
     gaussian g0;
     g0.mu = &track[track_mu];
     g0.covar = &track[track_covar];
     g0.covar_inverse = &track[track_covar_inverse];
 
-    // create the temporary buffer required for the Kullback-Leibler divergence
-    musly_track* tmp_t = track_alloc();
-    gaussian tmp;
-    tmp.mu = &tmp_t[track_mu];
-    tmp.covar = &tmp_t[track_covar];
-    tmp.covar_inverse = &tmp_t[track_covar_inverse];
-
-    // iterate over all musly_tracks to compute the Kullback-Leibler divergence
-    for (int i = 0; i < length; i++) {
-        gaussian gi;
-        musly_track* track1 = tracks[i];
-        gi.mu = &track1[track_mu];
-        gi.covar = &track1[track_covar];
-        gi.covar_inverse = &track1[track_covar_inverse];
-
-        similarities[i] = gs.symmetric_kullbackleibler(g0, gi, tmp);
+    // create the temporary buffers required for the Kullback-Leibler
+    // divergence
+    const int lanes = gaussian_statistics::lanes;
+    std::vector<float> tile(track_getsize() * lanes);
+    std::vector<float> tmp(gs.get_lanes_tmpsize());
+    float skld[lanes];
+
+    for (int i = 0; i < length; i += lanes) {
+        int count = std::min(lanes, length - i);
+        kullbackleibler_stored(g0, &positions[i], count, tile.data(),
+                tmp.data(), skld);
+
+        for (int l = 0; l < count; l++) {
+            // return 0 if the models to compare are the same
+            similarities[i+l] = (trackids[i+l] == seed_trackid) ? 0 : skld[l];
+        }
     }
 
-    delete[] tmp_t;
-
     return 0;
 }
 
@@ -160,6 +268,7 @@ mandelellis::add_tracks(
         musly_trackid* trackids,
         int length,
         bool generate_ids) {
+    write_guard guard(state_lock);
     if (generate_ids) {
         idpool.generate_ids(trackids, length);
     }
@@ -210,13 +319,13 @@ mandelellis::serialize_metadata(
 
 int
 mandelellis::deserialize_metadata(
-        unsigned char* buffer) {
+        const unsigned char* buffer) {
     // number of registered tracks
-    int expected_tracks = *(int*)(buffer);
+    int expected_tracks = *(const int*)(buffer);
     buffer += sizeof(int);
 
     // largest seen track id
-    musly_trackid max_seen = *(musly_trackid*)(buffer);
+    musly_trackid max_seen = *(const musly_trackid*)(buffer);
     buffer += sizeof(musly_trackid);
     idpool.add_ids(&max_seen, 1);
     idpool.remove_ids(&max_seen, 1);
@@ -244,13 +353,13 @@ mandelellis::serialize_trackdata(
 
 int
 mandelellis::deserialize_trackdata(
-        unsigned char* buffer,
+        const unsigned char* buffer,
         int num_tracks) {
     if (num_tracks < 0) {
         return -1;
     }
     if (num_tracks) {
-        idpool.add_ids((musly_trackid*)buffer, num_tracks);
+        idpool.add_ids((const musly_trackid*)buffer, num_tracks);
     }
     return num_tracks;
 }
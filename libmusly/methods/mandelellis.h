@@ -56,6 +56,20 @@ private:
                 int length,
                 float* similarities);
 
+    /** Computes the symmetric Kullback-Leibler divergences between the seed
+     * track and up to gaussian_statistics::lanes tracks of the track store,
+     * given by their positions. \p tile and \p tmp are temporary buffers of
+     * <tt>track_getsize() * lanes</tt> and gs.get_lanes_tmpsize() floats.
+     */
+    void
+    kullbackleibler_stored(
+            gaussian& g0,
+            const int* positions,
+            int count,
+            float* tile,
+            float* tmp,
+            float* skld);
+
 public:
     mandelellis();
 
@@ -71,6 +85,12 @@ public:
             int length,
             musly_track* track);
 
+    virtual int
+    get_max_pcmlength();
+
+    virtual analysis*
+    analysis_begin();
+
     virtual int
     similarity(
             musly_track* track,
@@ -80,6 +100,13 @@ public:
             int length,
             float* similarities);
 
+    virtual int
+    similarity_stored(
+            musly_trackid seed_trackid,
+            musly_trackid* trackids,
+            int length,
+            float* similarities);
+
     virtual int
     add_tracks(
             musly_track** tracks,
@@ -108,7 +135,7 @@ public:
 
     virtual int
     deserialize_metadata(
-            unsigned char* buffer);
+            const unsigned char* buffer);
 
     virtual int
     serialize_trackdata(
@@ -118,7 +145,7 @@ public:
 
     virtual int
     deserialize_trackdata(
-            unsigned char* buffer,
+            const unsigned char* buffer,
             int num_tracks);
 
 };
@@ -15,7 +15,10 @@
 
 #include "minilog.h"
 #include "windowfunction.h"
+#include "gaussiananalysis.h"
 #include "timbre.h"
+#include "topk.h"
+#include "workers.h"
 
 
 namespace musly {
@@ -27,6 +30,103 @@ MUSLY_METHOD_REGIMPL(timbre, 1);
 
 
 
+namespace {
+/** Tags the serialized metadata and the images of jukeboxes whose track
+ * data includes the pivot distances. It is negative, so it cannot be
+ * mistaken for the track count that the metadata of earlier versions starts
+ * with: those are still read, see timbre::deserialize_metadata().
+ */
+const int format_tag = -2;
+
+/** Computes the mp normalization factors and the pivot distances of the
+ * tracks added by timbre::add_tracks() on one of several worker threads.
+ * The facts of track \c i are written to row \c i of \p facts: its mean
+ * and standard deviation, followed by its distances to the pivots.
+ */
+class normfacts_task : public worker_task {
+public:
+    normfacts_task(
+            gaussian_statistics& gs,
+            mutualproximity& mp,
+            musly_track** tracks,
+            int length,
+            int track_mu,
+            int track_covar,
+            int track_logdet,
+            const float* norm_tiles,
+            int track_size,
+            int num_norm,
+            int pivots,
+            float* facts) :
+                    gs(gs),
+                    mp(mp),
+                    tracks(tracks),
+                    track_mu(track_mu),
+                    track_covar(track_covar),
+                    track_logdet(track_logdet),
+                    norm_tiles(norm_tiles),
+                    track_size(track_size),
+                    num_norm(num_norm),
+                    pivots(pivots),
+                    facts(facts),
+                    queue(length)
+    {
+    }
+
+    virtual void
+    run(
+            int worker)
+    {
+        // temporary buffers of this worker, reused for all of its tracks
+        const int lanes = gaussian_statistics::lanes;
+        Eigen::VectorXf sim(num_norm);
+        std::vector<float> tmp(gs.get_lanes_tmpsize());
+        float jsd[lanes];
+
+        int i;
+        while (queue.next(i)) {
+            gaussian g0;
+            g0.mu = &tracks[i][track_mu];
+            g0.covar = &tracks[i][track_covar];
+            g0.covar_logdet = &tracks[i][track_logdet];
+
+            for (int t = 0; t < num_norm; t += lanes) {
+                const float* tile = &norm_tiles[(size_t)t * track_size];
+                gs.jensenshannon_lanes(g0, &tile[track_mu*lanes],
+                        &tile[track_covar*lanes], &tile[track_logdet*lanes],
+                        lanes, tmp.data(), jsd);
+                std::copy(jsd, jsd + std::min(lanes, num_norm - t), &sim[t]);
+            }
+
+            float* f = &facts[(size_t)i * (2 + pivots)];
+            mp.compute_normfacts(sim, &f[0], &f[1]);
+
+            // the pivots are the first mp normalization tracks
+            std::copy(sim.data(), sim.data() + pivots, &f[2]);
+        }
+    }
+
+private:
+    gaussian_statistics& gs;
+    mutualproximity& mp;
+    musly_track** tracks;
+    int track_mu;
+    int track_covar;
+    int track_logdet;
+
+    /** The mp normalization tracks, interleaved in tiles of
+     * gaussian_statistics::lanes tracks of \c track_size floats each.
+     */
+    const float* norm_tiles;
+    int track_size;
+    int num_norm;
+    int pivots;
+    float* facts;
+    work_queue queue;
+};
+
+}
+
 timbre::timbre() :
 
         // initialize method configuration parameters
@@ -43,7 +143,12 @@ timbre::timbre() :
         mel(ps_bins, mel_bins, sample_rate),
         mfccs(mel_bins, mfcc_bins),
         gs(mfcc_bins),
-        mp(this)
+        mp(this),
+
+        // index tracks by their distances to (up to) 16 of the mutual
+        // proximity tracks, and keep them sorted along the first 4
+        index(16, 4),
+        restore_size(0)
 {
     // Configure the musly_track features and save the musly_track offsets
 
@@ -56,16 +161,8 @@ timbre::timbre() :
 
     // React on changes to the trackid mapping in the ordered_idpool
     idpool.set_observer(this);
-}
-
-timbre::~timbre()
-{
-}
 
-const char*
-timbre::about()
-{
-    return
+    aboutstr =
         "A timbre only music similarity measure based 'mandelellis'. It\n"
         "improves the basic measure in multiple ways to achieve superior\n"
         "results:\n"
@@ -76,7 +173,19 @@ timbre::about()
         "D. Schnitzer et al.: Using mutual proximity to improve\n"
         "content-based audio similarity. In the proceedings of the 12th\n"
         "International Society for Music Information Retrieval\n"
-        "Conference, ISMIR, 2011.";
+        "Conference, ISMIR, 2011.\n"
+        "Jensen-Shannon kernel: ";
+    aboutstr += gaussian_statistics::get_kernel();
+}
+
+timbre::~timbre()
+{
+}
+
+const char*
+timbre::about()
+{
+    return aboutstr.c_str();
 }
 
 int
@@ -94,23 +203,16 @@ timbre::analyze_track(
         length = max_pcmlength;
     }
 
-    // PCM --> powerspectrum
+    // stream the excerpt through PCM --> powerspectrum --> Mel --> MFCC
+    // --> Gaussian a few frames at a time, normalized to its peak like
+    // powerspectrum::from_pcm() does
     Eigen::Map<Eigen::VectorXf> pcm_vector(pcm+start, length);
-    Eigen::MatrixXf power_spectrum = ps.from_pcm(pcm_vector);
-
-    // powerspectrum -> Mel
-    Eigen::MatrixXf mel_spectrum = mel.from_powerspectrum(power_spectrum);
-
-    // Mel -> MFCC representation
-    Eigen::MatrixXf mfcc_representation =
-            mfccs.from_melspectrum(mel_spectrum);
-
-    // estimate the Gaussian from the MFCC representation
-    gaussian g = {0, 0, 0, 0};
-    g.mu = &track[track_mu];
-    g.covar = &track[track_covar];
-    g.covar_logdet = &track[track_logdet];
-    if (gs.estimate_gaussian(mfcc_representation, g) == false) {
+    float peak = (length > 0) ? pcm_vector.cwiseAbs().maxCoeff() : 0;
+    gaussian_analysis a(ps, mel, mfccs, gs, powerspectrum::get_pcmscale(peak),
+            track_mu,
+            track_covar, -1, track_logdet);
+    a.push(pcm+start, length);
+    if (a.finish(track) != 0) {
         MINILOG(logTRACE) << "T Gaussian model estimation failed.";
         return 2;
     }
@@ -121,6 +223,23 @@ timbre::analyze_track(
 }
 
 
+int
+timbre::get_max_pcmlength()
+{
+    return max_pcmlength;
+}
+
+analysis*
+timbre::analysis_begin()
+{
+    // the peak of the signal is not known in advance, so unlike
+    // analyze_track(), the analysis assumes it to be at full scale
+    return new gaussian_analysis(windowfunction::hann(window_size), hop,
+            mel, mfccs, gs, powerspectrum::get_pcmscale(1.0f), track_mu,
+            track_covar, -1, track_logdet);
+}
+
+
 void
 timbre::similarity_raw(
         musly_track* track,
@@ -134,25 +253,26 @@ timbre::similarity_raw(
     g0.covar = &track[track_covar];
     g0.covar_logdet = &track[track_logdet];
 
-    // create the temporary buffer required for the Jensen-Shannon divergence
-    musly_track* tmp_t = track_alloc();
-    gaussian tmp;
-    tmp.mu = &tmp_t[track_mu];
-    tmp.covar = &tmp_t[track_covar];
-    tmp.covar_logdet = &tmp_t[track_logdet];
-
-    // iterate over all musly_tracks to compute the Jensen-Shannon divergence
-    for (int i = 0; i < length; i++) {
-        gaussian gi;
-        musly_track* track1 = tracks[i];
-        gi.mu = &track1[track_mu];
-        gi.covar = &track1[track_covar];
-        gi.covar_logdet = &track1[track_logdet];
-
-        similarities[i] = gs.jensenshannon(g0, gi, tmp);
+    // create the temporary buffers required for the Jensen-Shannon divergence
+    const int lanes = gaussian_statistics::lanes;
+    std::vector<float> tile(track_getsize() * lanes);
+    std::vector<float> tmp(gs.get_lanes_tmpsize());
+    float jsd[lanes];
+
+    // iterate over all musly_tracks to compute the Jensen-Shannon divergence,
+    // several tracks at a time
+    for (int i = 0; i < length; i += lanes) {
+        int count = std::min(lanes, length - i);
+        track_interleave(tracks + i, count, lanes, tile.data());
+        gs.jensenshannon_lanes(g0, &tile[track_mu*lanes],
+                &tile[track_covar*lanes], &tile[track_logdet*lanes], lanes,
+                tmp.data(), jsd);
+
+        for (int l = 0; l < count; l++) {
+            // return 0 if the models to compare are the same
+            similarities[i+l] = (tracks[i+l] == track) ? 0 : jsd[l];
+        }
     }
-
-    delete[] tmp_t;
 }
 
 
@@ -174,17 +294,262 @@ timbre::similarity(
     similarity_raw(track, tracks, length, similarities);
 
     // normalize with mp
-    // - lookup positions of trackids in the ordered_idpool
+    return normalize(seed_trackid, trackids, length, similarities);
+}
+
+int
+timbre::normalize(
+        musly_trackid seed_trackid,
+        musly_trackid* trackids,
+        int length,
+        float* similarities)
+{
+    // lookup positions of trackids in the ordered_idpool
     int seed_position = idpool.position_of(seed_trackid);
-    int* other_positions = new int[length];
-    for (int i = 0; i < length; i++) {
-        other_positions[i] = idpool.position_of(trackids[i]);
+    std::vector<int> other_positions(length);
+    idpool.positions_of(trackids, length, other_positions.data());
+
+    // call mp.normalize with these positions
+    return mp.normalize(seed_position, other_positions.data(), length,
+            similarities);
+}
+
+void
+timbre::jensenshannon_stored(
+        gaussian& g0,
+        const int* positions,
+        int count,
+        float* tile,
+        float* tmp,
+        float* jsd)
+{
+    const int lanes = gaussian_statistics::lanes;
+    const int stride = store.get_stride();
+
+    // tracks at consecutive positions are read straight from the store,
+    // others are gathered into a tile first
+    int p = positions[0];
+    bool consecutive = (p + lanes <= stride);
+    for (int l = 1; consecutive && (l < count); l++) {
+        consecutive = (positions[l] == p + l);
+    }
+    if (consecutive) {
+        gs.jensenshannon_lanes(g0, store.field(track_mu) + p,
+                store.field(track_covar) + p,
+                store.field(track_logdet) + p, stride, tmp, jsd);
+    } else {
+        store.gather_interleaved(positions, count, lanes, tile);
+        gs.jensenshannon_lanes(g0, &tile[track_mu*lanes],
+                &tile[track_covar*lanes], &tile[track_logdet*lanes],
+                lanes, tmp, jsd);
     }
-    // - call mp.normalize with these positions
-    int res = mp.normalize(seed_position, other_positions, length, similarities);
-    delete[] other_positions;
+}
 
-    return res;
+int
+timbre::similarity_stored(
+        musly_trackid seed_trackid,
+        musly_trackid* trackids,
+        int length,
+        float* similarities)
+{
+    if ((length <= 0) || !trackids || !similarities) {
+        return -1;
+    }
+
+    // lookup the tracks in the store
+    int seed_position = store.position_of(seed_trackid);
+    if (seed_position < 0) {
+        return -1;
+    }
+    std::vector<int> positions(length);
+    if (store.positions_of(trackids, length, positions.data()) < length) {
+        return -1;
+    }
+
+    // map seed track to gaussian structure
+    std::vector<musly_track> track(track_getsize());
+    store.gather(&seed_position, 1, track.data());
+    gaussian g0;
+    g0.mu = &track[track_mu];
+    g0.covar = &track[track_covar];
+    g0.covar_logdet = &track[track_logdet];
+
+    // create the temporary buffers required for the Jensen-Shannon divergence
+    const int lanes = gaussian_statistics::lanes;
+    std::vector<float> tile(track_getsize() * lanes);
+    std::vector<float> tmp(gs.get_lanes_tmpsize());
+    float jsd[lanes];
+
+    for (int i = 0; i < length; i += lanes) {
+        int count = std::min(lanes, length - i);
+        jensenshannon_stored(g0, &positions[i], count, tile.data(),
+                tmp.data(), jsd);
+
+        for (int l = 0; l < count; l++) {
+            // return 0 if the models to compare are the same
+            similarities[i+l] = (trackids[i+l] == seed_trackid) ? 0 : jsd[l];
+        }
+    }
+
+    // normalize with mp
+    return normalize(seed_trackid, trackids, length, similarities);
+}
+
+int
+timbre::similarity_topk(
+        musly_trackid seed_trackid,
+        int k,
+        musly_track_filter filter,
+        void* user_data,
+        musly_trackid* trackids,
+        float* similarities)
+{
+    if ((k < 0) || !trackids) {
+        return -1;
+    }
+    int seed_stored = store.position_of(seed_trackid);
+    int seed_position = idpool.position_of(seed_trackid);
+    if ((seed_stored < 0) || (seed_position < 0)) {
+        return -1;
+    }
+    if (k == 0) {
+        return 0;
+    }
+
+    // map seed track to gaussian structure
+    std::vector<musly_track> track(track_getsize());
+    store.gather(&seed_stored, 1, track.data());
+    gaussian g0;
+    g0.mu = &track[track_mu];
+    g0.covar = &track[track_covar];
+    g0.covar_logdet = &track[track_logdet];
+
+    // create the temporary buffers required for the Jensen-Shannon divergence
+    const int lanes = gaussian_statistics::lanes;
+    std::vector<float> tile(track_getsize() * lanes);
+    std::vector<float> tmp(gs.get_lanes_tmpsize());
+    float jsd[lanes];
+    int positions[lanes];
+    musly_trackid ids[lanes];
+
+    // stream through the store, several tracks at a time
+    topk best(k);
+    const int size = store.get_slotcount();
+    for (int p = 0; p < size; ) {
+        int count = 0;
+        for (; (p < size) && (count < lanes); p++) {
+            if (store.is_tombstone(p)) {
+                continue;
+            }
+            musly_trackid id = store.trackid_at(p);
+            if ((id != seed_trackid) && (!filter || filter(id, user_data))) {
+                positions[count] = p;
+                ids[count] = id;
+                count++;
+            }
+        }
+        if (count == 0) {
+            break;
+        }
+        jensenshannon_stored(g0, positions, count, tile.data(), tmp.data(),
+                jsd);
+
+        for (int l = 0; l < count; l++) {
+            int position = idpool.position_of(ids[l]);
+            if (position < 0) {
+                return -1;
+            }
+            // the seed track alone bounds the normalized similarity; if
+            // that bound cannot beat or tie the k-th best similarity so far,
+            // the track does not need to be normalized
+            float sim = jsd[l];
+            if (best.full() &&
+                    !(mp.lower_bound(seed_position, sim) <= best.worst())) {
+                continue;
+            }
+            mp.normalize(seed_position, &position, 1, &sim);
+            best.offer(sim, ids[l]);
+        }
+    }
+    return best.finish(trackids, similarities);
+}
+
+int
+timbre::similarity_batch(
+        musly_track** seed_tracks,
+        musly_trackid* seed_trackids,
+        int num_seeds,
+        musly_track** tracks,
+        musly_trackid* trackids,
+        int length,
+        float* similarities)
+{
+    if ((num_seeds <= 0) || (length <= 0) || !seed_tracks || !seed_trackids
+            || !tracks || !trackids || !similarities) {
+        return -1;
+    }
+
+    // lookup the positions of all trackids in the ordered_idpool once
+    std::vector<int> seed_positions(num_seeds);
+    idpool.positions_of(seed_trackids, num_seeds, seed_positions.data());
+    std::vector<int> other_positions(length);
+    idpool.positions_of(trackids, length, other_positions.data());
+
+    // create the temporary buffers required for the Jensen-Shannon divergence,
+    // they are shared by all pairs
+    const int lanes = gaussian_statistics::lanes;
+    const int track_block = 64;
+    std::vector<float> tiles(track_getsize() * track_block);
+    std::vector<float> tmp(gs.get_lanes_tmpsize());
+    float jsd[lanes];
+
+    // compute raw similarities tile by tile, so a block of seeds and a block
+    // of other tracks stay in the cache while all pairs are computed
+    const int seed_block = 16;
+    for (int s0 = 0; s0 < num_seeds; s0 += seed_block) {
+        const int s1 = std::min(s0 + seed_block, num_seeds);
+        for (int t0 = 0; t0 < length; t0 += track_block) {
+            const int t1 = std::min(t0 + track_block, length);
+
+            // interleave the block of other tracks once for all seeds
+            for (int t = t0; t < t1; t += lanes) {
+                track_interleave(tracks + t, std::min(lanes, t1 - t), lanes,
+                        &tiles[(t - t0) * track_getsize()]);
+            }
+
+            for (int s = s0; s < s1; s++) {
+                gaussian g0;
+                musly_track* track0 = seed_tracks[s];
+                g0.mu = &track0[track_mu];
+                g0.covar = &track0[track_covar];
+                g0.covar_logdet = &track0[track_logdet];
+
+                float* row = similarities + (size_t)s*length;
+                for (int t = t0; t < t1; t += lanes) {
+                    float* tile = &tiles[(t - t0) * track_getsize()];
+                    gs.jensenshannon_lanes(g0, &tile[track_mu*lanes],
+                            &tile[track_covar*lanes],
+                            &tile[track_logdet*lanes], lanes,
+                            tmp.data(), jsd);
+
+                    for (int l = 0; l < std::min(lanes, t1 - t); l++) {
+                        // return 0 if the models to compare are the same
+                        row[t+l] = (tracks[t+l] == track0) ? 0 : jsd[l];
+                    }
+                }
+            }
+        }
+    }
+
+    // normalize each row with mp
+    for (int s = 0; s < num_seeds; s++) {
+        int res = mp.normalize(seed_positions[s], other_positions.data(),
+                length, similarities + (size_t)s*length);
+        if (res != 0) {
+            return res;
+        }
+    }
+    return 0;
 }
 
 int
@@ -195,7 +560,28 @@ timbre::set_musicstyle(
     MINILOG(logTRACE) << "T initializing mutual proximity!";
 
     // save the mp normalization tracks
-    return mp.set_normtracks(tracks, length);
+    int res = mp.set_normtracks(tracks, length);
+
+    // the first of them are the pivots of the neighbor index
+    index.set_pivotcount(length);
+    index.append(idpool.get_slotcount());
+
+    return res;
+}
+
+int
+timbre::guess_neighbors(
+        musly_trackid seed,
+        musly_trackid* neighbors,
+        int length,
+        musly_trackid* limit_to,
+        int num_limit_to)
+{
+    if (!neighbors) {
+        return -1;
+    }
+    return index.neighbors(idpool.position_of(seed), seed, idpool,
+            neighbors, length, limit_to, num_limit_to);
 }
 
 int
@@ -207,6 +593,33 @@ timbre::add_tracks(
     if (mp.get_normtracks()->size() == 0) {
         return -1;  // not initialized, cannot add tracks
     }
+
+    // compute the mp normalization factors and the pivot distances of the
+    // tracks first, without blocking concurrent queries. The mp
+    // normalization tracks are interleaved once for all tracks.
+    std::vector<musly_track*>& norm_tracks = *mp.get_normtracks();
+    const int num_norm = norm_tracks.size();
+    const int lanes = gaussian_statistics::lanes;
+    const int ts = track_getsize();
+    std::vector<float> norm_tiles((size_t)(num_norm + lanes - 1) / lanes *
+            lanes * ts);
+    for (int t = 0; t < num_norm; t += lanes) {
+        track_interleave(&norm_tracks[t], std::min(lanes, num_norm - t),
+                lanes, &norm_tiles[(size_t)t * ts]);
+    }
+
+    // the tracks are distributed over all cores, each writing to its own
+    // rows of facts
+    const int pivots = index.get_pivotcount();
+    const int stride = 2 + pivots;
+    std::vector<float> facts((size_t)length * stride);
+    normfacts_task task(gs, mp, tracks, length, track_mu, track_covar,
+            track_logdet, norm_tiles.data(), ts, num_norm, pivots,
+            facts.data());
+    run_workers(task, std::min(hardware_threads(), length));
+
+    // then register the tracks
+    write_guard guard(state_lock);
     int num_new;
     if (generate_ids) {
         idpool.generate_ids(trackids, length);
@@ -216,15 +629,20 @@ timbre::add_tracks(
         num_new = idpool.add_ids(trackids, length);
     }
 
-    Eigen::VectorXf sim(mp.get_normtracks()->size());
+    if (num_new < length) {
+        // known tracks are re-indexed below
+        index.remove_ids(trackids, length);
+    }
+
     mp.append_normfacts(num_new);
-    int pos = idpool.get_size() - length;
+    index.append(num_new);
+    int pos = idpool.get_slotcount() - length;
     for (int i = 0; i < length; i++) {
-        similarity_raw(tracks[i], mp.get_normtracks()->data(),
-                mp.get_normtracks()->size(), sim.data());
-
-        mp.set_normfacts(pos + i, sim);
+        const float* f = &facts[(size_t)i * stride];
+        mp.set_normfacts(pos + i, f[0], f[1]);
+        index.set_distances(pos + i, trackids[i], &f[2]);
     }
+    index.commit();
     return 0;
 }
 
@@ -232,9 +650,20 @@ void
 timbre::remove_tracks(
         musly_trackid* trackids,
         int length) {
-    length = idpool.move_to_end(trackids, length);
-    mp.trim_normfacts(length);
-    idpool.remove_last(length);
+    // leave tombstones instead of moving the remaining tracks; they are
+    // dropped from the idpool, mp and neighbor index in a single pass once
+    // there are too many of them
+    idpool.tombstone_ids(trackids, length);
+    if (idpool.get_tombstonecount() >
+            max_tombstone_ratio * idpool.get_slotcount()) {
+        idpool.compact();
+    }
+}
+
+void
+timbre::compact() {
+    idpool.compact();
+    method::compact();
 }
 
 int
@@ -250,22 +679,48 @@ timbre::get_maxtrackid() {
 int
 timbre::get_trackids(
         musly_trackid* trackids) {
-    std::copy(idpool.idlist().begin(), idpool.idlist().end(), trackids);
-    return idpool.get_size();
+    int count = 0;
+    for (int pos = 0; pos < idpool.get_slotcount(); pos++) {
+        if (!idpool.is_tombstone(pos)) {
+            trackids[count++] = idpool[pos];
+        }
+    }
+    return count;
 }
 
 void
 timbre::swapped_positions(
         int pos_a,
         int pos_b) {
-    // positions in idpool have changed; update mp index accordingly
+    // positions in idpool have changed; update mp and neighbor index
+    // accordingly
     mp.swap_normfacts(pos_a, pos_b);
+    index.swap(pos_a, pos_b);
+}
+
+void
+timbre::compacted_positions(
+        const int* old_positions,
+        int count) {
+    // tombstones have been dropped from idpool; compact mp and neighbor
+    // index accordingly
+    mp.compact_normfacts(old_positions, count);
+    index.compact(old_positions, count, idpool);
 }
 
 int
 timbre::serialize_metadata(
         unsigned char* buffer) {
+    // jukeboxes without pivot distances (restored from earlier versions)
+    // are written in the untagged format of earlier versions
+    const bool tagged = (index.get_pivotcount() > 0);
     if (buffer) {
+        // format of the track data
+        if (tagged) {
+            *(int*)(buffer) = format_tag;
+            buffer += sizeof(int);
+        }
+
         // number of registered tracks
         *(int*)(buffer) = idpool.get_size();
         buffer += sizeof(int);
@@ -283,34 +738,56 @@ timbre::serialize_metadata(
             buffer += track_getsize() * sizeof(musly_track);
         }
     }
-    return sizeof(int) + sizeof(musly_trackid) + sizeof(int)
+    return (tagged ? sizeof(int) : 0) + sizeof(int) + sizeof(musly_trackid)
+            + sizeof(int)
             + mp.get_normtracks()->size() * track_getsize() * sizeof(musly_track);
 }
 
 int
 timbre::deserialize_metadata(
-        unsigned char* buffer) {
+        const unsigned char* buffer) {
+    // format of the track data: earlier versions start with the
+    // (nonnegative) track count and store no pivot distances, so the
+    // neighbor index stays empty for them
+    bool tagged = (*(const int*)(buffer) < 0);
+    if (tagged && (*(const int*)(buffer) != format_tag)) {
+        MINILOG(logERROR) << "T jukebox state has an unsupported format, "
+                << "please rebuild it from the tracks";
+        return -1;
+    }
+    if (tagged) {
+        buffer += sizeof(int);
+    }
+
     // number of registered tracks
-    int expected_tracks = *(int*)(buffer);
+    int expected_tracks = *(const int*)(buffer);
     buffer += sizeof(int);
 
     // largest seen track id
-    musly_trackid max_seen = *(musly_trackid*)(buffer);
+    musly_trackid max_seen = *(const musly_trackid*)(buffer);
     buffer += sizeof(musly_trackid);
     idpool.add_ids(&max_seen, 1);
     idpool.remove_ids(&max_seen, 1);
 
     // mutual proximity tracks
-    int num_mptracks = *(int*)(buffer);
+    int num_mptracks = *(const int*)(buffer);
     buffer += sizeof(int);
-    musly_track** mptracks = new musly_track*[num_mptracks];
+    const musly_track** mptracks = new const musly_track*[num_mptracks];
     for (int i = 0; i < num_mptracks; i++) {
-        mptracks[i] = (musly_track*)buffer;
+        mptracks[i] = (const musly_track*)buffer;
         buffer += track_getsize() * sizeof(musly_track);
     }
     mp.set_normtracks(mptracks, num_mptracks);
     delete[] mptracks;
     mp.append_normfacts(expected_tracks);
+    if (!tagged && (num_mptracks > 0)) {
+        MINILOG(logWARNING) << "T jukebox state of an earlier version has no "
+                << "neighbor index; to guess neighbors, set the music style "
+                << "and add the tracks again";
+    }
+    index.set_pivotcount(tagged ? num_mptracks : 0);
+    index.append(expected_tracks);
+    restore_size = idpool.get_size() + expected_tracks;
 
     return expected_tracks;
 }
@@ -327,36 +804,88 @@ timbre::serialize_trackdata(
         if (num_tracks + skip_tracks > idpool.get_size()) {
             return -1;
         }
-        for (int i = skip_tracks; i < skip_tracks + num_tracks; i++) {
-            *(musly_trackid*)(buffer) = idpool[i];
+        int pos = idpool.nth_position(skip_tracks);
+        for (int i = 0; i < num_tracks; i++, pos++) {
+            // skip the positions of removed tracks
+            while (idpool.is_tombstone(pos)) {
+                pos++;
+            }
+            *(musly_trackid*)(buffer) = idpool[pos];
             buffer += sizeof(musly_trackid);
-            mp.get_normfacts(i,
+            mp.get_normfacts(pos,
                     (float*)(buffer),
                     (float*)(buffer + sizeof(float)));
             buffer += 2 * sizeof(float);
+            index.get_distances(pos, (float*)(buffer));
+            buffer += index.get_pivotcount() * sizeof(float);
         }
     }
-    return num_tracks * (sizeof(musly_trackid) + 2 * sizeof(float));
+    return num_tracks * (sizeof(musly_trackid) +
+            (2 + index.get_pivotcount()) * sizeof(float));
 }
 
 int
 timbre::deserialize_trackdata(
-        unsigned char* buffer,
+        const unsigned char* buffer,
         int num_tracks) {
     if (num_tracks < 0) {
         return -1;
     }
-    int had_tracks = idpool.get_size();
+    // register all track ids at once
+    const int track_bytes = sizeof(musly_trackid) +
+            (2 + index.get_pivotcount()) * sizeof(float);
+    std::vector<musly_trackid> trackids(num_tracks);
+    for (int i = 0; i < num_tracks; i++) {
+        trackids[i] = *(const musly_trackid*)(buffer + (size_t)i * track_bytes);
+    }
+    int had_tracks = idpool.get_slotcount();
+    idpool.add_ids(trackids.data(), num_tracks);
+
     for (int i = 0; i < num_tracks; i++) {
-        idpool.add_ids((musly_trackid*)buffer, 1);
         buffer += sizeof(musly_trackid);
         mp.set_normfacts(had_tracks + i,
-                *(float*)(buffer),
-                *(float*)(buffer + sizeof(float)));
+                *(const float*)(buffer),
+                *(const float*)(buffer + sizeof(float)));
         buffer += 2 * sizeof(float);
+        index.set_distances(had_tracks + i, trackids[i], (const float*)(buffer));
+        buffer += index.get_pivotcount() * sizeof(float);
+    }
+
+    // the state is usually restored in chunks; only sort the neighbor index
+    // once all tracks are back, instead of merging it for every chunk
+    if (idpool.get_size() >= restore_size) {
+        index.commit();
     }
     return num_tracks;
 }
 
+int
+timbre::write_image(
+        image_writer* image) {
+    if (image && (!image->write_value(format_tag) ||
+            !idpool.write_image(*image) || !mp.write_image(*image) ||
+            !index.write_image(*image) || !store.write_image(*image))) {
+        return -1;
+    }
+    return 0;
+}
+
+int
+timbre::map_image(
+        image_reader& image) {
+    int tag;
+    if (!image.read_value(tag) || (tag != format_tag)) {
+        MINILOG(logERROR) << "T jukebox image has an unsupported format, "
+                << "please rebuild it from the tracks";
+        return -1;
+    }
+    if (!idpool.map_image(image) || !mp.map_image(image) ||
+            !index.map_image(image) || !store.map_image(image)) {
+        return -1;
+    }
+    restore_size = idpool.get_size();
+    return 0;
+}
+
 } /* namespace methods */
 } /* namespace musly */
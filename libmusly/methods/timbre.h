@@ -19,6 +19,7 @@
 #include "mfcc.h"
 #include "gaussianstatistics.h"
 #include "mutualproximity.h"
+#include "pivotindex.h"
 #include "idpool.h"
 
 namespace musly {
@@ -49,8 +50,18 @@ private:
     mfcc mfccs;
     gaussian_statistics gs;
     mutualproximity mp;
+    pivotindex index;
+
+    /** The number of tracks registered once the restore started by
+     * deserialize_metadata() is complete.
+     */
+    int restore_size;
     ordered_idpool<musly_trackid> idpool;
 
+    /** The method description, including the Jensen-Shannon kernel in use.
+     */
+    std::string aboutstr;
+
     void
     similarity_raw(
                 musly_track* track,
@@ -58,6 +69,27 @@ private:
                 int length,
                 float* similarities);
 
+    /** Computes the Jensen-Shannon divergences between the seed track and
+     * up to gaussian_statistics::lanes tracks of the track store, given by
+     * their positions. \p tile and \p tmp are temporary buffers of
+     * <tt>track_getsize() * lanes</tt> and gs.get_lanes_tmpsize() floats.
+     */
+    void
+    jensenshannon_stored(
+            gaussian& g0,
+            const int* positions,
+            int count,
+            float* tile,
+            float* tmp,
+            float* jsd);
+
+    int
+    normalize(
+            musly_trackid seed_trackid,
+            musly_trackid* trackids,
+            int length,
+            float* similarities);
+
 public:
     timbre();
 
@@ -73,6 +105,12 @@ public:
             int length,
             musly_track* track);
 
+    virtual int
+    get_max_pcmlength();
+
+    virtual analysis*
+    analysis_begin();
+
     virtual int
     similarity(
             musly_track* track,
@@ -82,6 +120,40 @@ public:
             int length,
             float* similarities);
 
+    virtual int
+    similarity_batch(
+            musly_track** seed_tracks,
+            musly_trackid* seed_trackids,
+            int num_seeds,
+            musly_track** tracks,
+            musly_trackid* trackids,
+            int length,
+            float* similarities);
+
+    virtual int
+    similarity_stored(
+            musly_trackid seed_trackid,
+            musly_trackid* trackids,
+            int length,
+            float* similarities);
+
+    virtual int
+    similarity_topk(
+            musly_trackid seed_trackid,
+            int k,
+            musly_track_filter filter,
+            void* user_data,
+            musly_trackid* trackids,
+            float* similarities);
+
+    virtual int
+    guess_neighbors(
+            musly_trackid seed,
+            musly_trackid* neighbors,
+            int length,
+            musly_trackid* limit_to,
+            int num_limit_to);
+
     virtual int
     set_musicstyle(
             musly_track** tracks,
@@ -99,6 +171,9 @@ public:
             musly_trackid* trackids,
             int length);
 
+    virtual void
+    compact();
+
     virtual int
     get_trackcount();
 
@@ -114,13 +189,18 @@ public:
             int pos_a,
             int pos_b);
 
+    virtual void
+    compacted_positions(
+            const int* old_positions,
+            int count);
+
     virtual int
     serialize_metadata(
             unsigned char* buffer);
 
     virtual int
     deserialize_metadata(
-            unsigned char* buffer);
+            const unsigned char* buffer);
 
     virtual int
     serialize_trackdata(
@@ -130,9 +210,17 @@ public:
 
     virtual int
     deserialize_trackdata(
-            unsigned char* buffer,
+            const unsigned char* buffer,
             int num_tracks);
 
+    virtual int
+    write_image(
+            image_writer* image);
+
+    virtual int
+    map_image(
+            image_reader& image);
+
 };
 
 } /* namespace methods */
@@ -10,11 +10,15 @@
  * with this file, You can obtain one at http://mozilla.org/MPL/2.0/.
  */
 
+#include <stdint.h>
+#include <cmath>
+#include <cstring>
 #include <Eigen/Core>
 #include <algorithm>
 
 #include "musly/musly_types.h"
 #include "mutualproximity.h"
+#include "targetclones.h"
 
 namespace musly {
 
@@ -44,7 +48,7 @@ mutualproximity::new_cache(int size)
 
 int
 mutualproximity::set_normtracks(
-        musly_track** tracks,
+        const musly_track* const* tracks,
         int length)
 {
     new_cache(length);
@@ -66,7 +70,21 @@ mutualproximity::get_normtracks()
 void
 mutualproximity::append_normfacts(
         int count) {
-    norm_facts.resize(norm_facts.size() + count);
+    norm_facts.owned().resize(norm_facts.size() + count);
+}
+
+void
+mutualproximity::compute_normfacts(
+        Eigen::VectorXf& sim,
+        float* mu,
+        float* std)
+{
+    double m = sim.mean();
+    Eigen::VectorXd sim_mu = sim.cast<double>().array() - m;
+    double s = (sim_mu.transpose() * sim_mu);
+    s /= (static_cast<double>(sim.size()) - 1.0);
+    *mu = m;
+    *std = sqrt(s);
 }
 
 void
@@ -74,11 +92,9 @@ mutualproximity::set_normfacts(
         int position,
         Eigen::VectorXf& sim)
 {
-    double mu = sim.mean();
-    Eigen::VectorXd sim_mu = sim.cast<double>().array() - mu;
-    double std = (sim_mu.transpose() * sim_mu);
-    std /= (static_cast<double>(sim.size()) - 1.0);
-    set_normfacts(position, mu, sqrt(std));
+    float mu, std;
+    compute_normfacts(sim, &mu, &std);
+    set_normfacts(position, mu, std);
 }
 
 void
@@ -88,11 +104,13 @@ mutualproximity::set_normfacts(
         float std) {
     // allocate space if needed
     // (ideally, this has already been taken care of by append_normfacts)
-    if (position >= (int)norm_facts.size()) {
-        norm_facts.resize(position+1);
+    std::vector<normfact>& facts = norm_facts.owned();
+    if (position >= (int)facts.size()) {
+        facts.resize(position+1);
     }
-    norm_facts[position].mu = mu;
-    norm_facts[position].std = std;
+    facts[position].mu = mu;
+    facts[position].std = std;
+    facts[position].inv_std = 1.0f / std;
 }
 
 void
@@ -108,40 +126,107 @@ void
 mutualproximity::swap_normfacts(
         int position1,
         int position2) {
-    std::swap(norm_facts[position1], norm_facts[position2]);
+    std::vector<normfact>& facts = norm_facts.owned();
+    std::swap(facts[position1], facts[position2]);
 }
 
 void
 mutualproximity::trim_normfacts(
         int count) {
-    norm_facts.resize(norm_facts.size() - count);
+    norm_facts.owned().resize(norm_facts.size() - count);
 }
 
-double
-mutualproximity::normcdf(double x)
+void
+mutualproximity::compact_normfacts(
+        const int* old_positions,
+        int count) {
+    std::vector<normfact>& facts = norm_facts.owned();
+    for (int i = 0; i < count; i++) {
+        facts[i] = facts[old_positions[i]];
+    }
+    facts.resize(count);
+}
+
+namespace {
+
+/** Computes exp(x) for -87 <= x <= 0 in single precision, with a relative
+ * error of a few ulp (the polynomial of Cephes' expf). Unlike std::exp(),
+ * it is plain arithmetic, so loops calling it are vectorized.
+ */
+inline float
+exp_nonpositive(
+        float x)
+{
+    // x = n*ln(2) + r, with |r| <= ln(2)/2; n is rounded by adding and
+    // subtracting 1.5*2^23, as std::floor() keeps loops from vectorizing
+    float n = (x * 1.44269504088896341f + 12582912.0f) - 12582912.0f;
+    float r = x - n * 0.693359375f;
+    r = r + n * 2.12194440e-4f;
+
+    float p = 1.9875691500e-4f;
+    p = p*r + 1.3981999507e-3f;
+    p = p*r + 8.3334519073e-3f;
+    p = p*r + 4.1665795894e-2f;
+    p = p*r + 1.6666665459e-1f;
+    p = p*r + 5.0000001201e-1f;
+    p = p*r*r + r + 1.0f;
+
+    // multiply by 2^n, which is a normal float for n >= -126
+    int32_t bits = ((int32_t)n + 127) << 23;
+    float scale;
+    std::memcpy(&scale, &bits, sizeof(scale));
+    return p * scale;
+}
+
+/** Returns the smaller of the non-negative floats \p x and \p limit, with
+ * infinity and NaN giving \p limit. Non-negative floats are ordered like
+ * their bit patterns, so this is an integer minimum; a floating-point
+ * comparison against a constant keeps GCC from vectorizing loops.
+ */
+inline float
+min_nonnegative(
+        float x,
+        float limit)
+{
+    int32_t xbits, limitbits;
+    std::memcpy(&xbits, &x, sizeof(xbits));
+    std::memcpy(&limitbits, &limit, sizeof(limitbits));
+    xbits = (xbits < limitbits) ? xbits : limitbits;
+    std::memcpy(&x, &xbits, sizeof(x));
+    return x;
+}
+
+/** Computes the survival function 1 - normcdf(z) of the standard normal
+ * distribution in single precision, using formula 7.1.26 of Abramowitz and
+ * Stegun for erfc. The absolute error is below 5e-7 for all z (the formula
+ * itself contributes 7.5e-8); |z| is clamped to 12.7, beyond which the
+ * result is within 1e-36 of 0 or 1. NaN gives an arbitrary value.
+ */
+inline float
+normsf(
+        float z)
 {
     // constants
-    const double a1 =  0.254829592;
-    const double a2 = -0.284496736;
-    const double a3 =  1.421413741;
-    const double a4 = -1.453152027;
-    const double a5 =  1.061405429;
-    const double p  =  0.3275911;
-
-    // Save the sign of x
-    int sign = 1;
-    if (x < 0) {
-        sign = -1;
-    }
-    x = fabs(x)/M_SQRT2;
+    const float a1 =  0.254829592f;
+    const float a2 = -0.284496736f;
+    const float a3 =  1.421413741f;
+    const float a4 = -1.453152027f;
+    const float a5 =  1.061405429f;
+    const float p  =  0.3275911f;
 
-    // A&S formula 7.1.26
-    double t = 1.0/(1.0 + p*x);
-    double y = 1.0 - (((((a5*t + a4)*t) + a3)*t + a2)*t + a1)*t*exp(-x*x);
+    float x = min_nonnegative(std::fabs(z) * (float)M_SQRT1_2, 9.0f);
+    float t = 1.0f / (1.0f + p*x);
+    float h = 0.5f * ((((a5*t + a4)*t + a3)*t + a2)*t + a1)*t *
+            exp_nonpositive(-x*x);
 
-    return 0.5*(1.0 + sign*y);
+    // for negative z, return 1 - h; computed arithmetically rather than by
+    // selecting, which would keep loops from vectorizing
+    return h + (z < 0) * (1.0f - 2.0f*h);
 }
 
+}  // namespace
+
+MUSLY_TARGET_CLONES
 int
 mutualproximity::normalize(
         int seed_position,
@@ -149,33 +234,108 @@ mutualproximity::normalize(
         int length,
         float* sim)
 {
-    if (seed_position < 0 || seed_position >= (int)norm_facts.size()) {
+    const int size = norm_facts.size();
+    if (seed_position < 0 || seed_position >= size) {
         return -1;
     }
-    float seed_mu = norm_facts[seed_position].mu;
-    float seed_std = norm_facts[seed_position].std;
+
+    // validate all positions upfront, so the loops below are branch-free
+    int invalid = 0;
     for (int i = 0; i < length; i++) {
-        int pos = other_positions[i];
-        if (pos < 0 || pos >= (int)norm_facts.size()) {
-            return -1;
-        }
-        if (pos == seed_position) {
-            sim[i] = 0;
-            continue;
-        }
+        invalid |= (other_positions[i] < 0) | (other_positions[i] >= size);
+    }
+    if (invalid) {
+        return -1;
+    }
+
+    const normfact* facts = norm_facts.data();
+    const float seed_mu = facts[seed_position].mu;
+    const float seed_inv_std = facts[seed_position].inv_std;
+    const int block = 256;
+    float mu[block];
+    float inv_std[block];
+    for (int i0 = 0; i0 < length; i0 += block) {
+        const int count = std::min(block, length - i0);
+        const int* pos = other_positions + i0;
+        float* s = sim + i0;
 
-        float d = sim[i];
-        if (std::isnan(d)) {
-           continue;
+        // gather the normalization factors of the block
+        for (int i = 0; i < count; i++) {
+            mu[i] = facts[pos[i]].mu;
+            inv_std[i] = facts[pos[i]].inv_std;
         }
 
-        double p1 = 1 - normcdf((d - seed_mu)/seed_std);
-        double p2 = 1 - normcdf((d - norm_facts[pos].mu)/norm_facts[pos].std);
-        sim[i] = 1 - p1*p2;
+        for (int i = 0; i < count; i++) {
+            float d = s[i];
+            float p1 = normsf((d - seed_mu) * seed_inv_std);
+            float p2 = normsf((d - mu[i]) * inv_std[i]);
+            float mp = 1 - p1*p2;
+
+            // keep NaN similarities, and set the seed's own similarity to 0
+            mp = std::isnan(d) ? d : mp;
+            s[i] = (pos[i] == seed_position) ? 0 : mp;
+        }
     }
     return 0;
 }
 
+float
+mutualproximity::lower_bound(
+        int seed_position,
+        float sim)
+{
+    if (std::isnan(sim)) {
+        return sim;
+    }
+
+    // normalize() computes 1 - p1*p2 with p2 <= 1, from the same p1
+    float p1 = normsf((sim - norm_facts[seed_position].mu) *
+            norm_facts[seed_position].inv_std);
+    return 1 - p1;
+}
 
+bool
+mutualproximity::write_image(
+        image_writer& image)
+{
+    const int track_size = m->track_getsize();
+    if (!image.begin_array(norm_tracks.size() * track_size,
+            sizeof(musly_track))) {
+        return false;
+    }
+    for (int i = 0; i < (int)norm_tracks.size(); i++) {
+        if (!image.write_raw(norm_tracks[i],
+                track_size * sizeof(musly_track))) {
+            return false;
+        }
+    }
+    return image.end_array() &&
+            image.write_array(norm_facts.data(), norm_facts.size());
+}
+
+bool
+mutualproximity::map_image(
+        image_reader& image)
+{
+    const int track_size = m->track_getsize();
+    const musly_track* tracks;
+    size_t num_floats;
+    const normfact* facts;
+    size_t num_facts;
+    if (!image.read_array(tracks, num_floats) ||
+            (num_floats % track_size != 0) ||
+            !image.read_array(facts, num_facts)) {
+        return false;
+    }
+
+    // the few normalization tracks are copied
+    std::vector<const musly_track*> ptrs(num_floats / track_size);
+    for (int i = 0; i < (int)ptrs.size(); i++) {
+        ptrs[i] = tracks + (size_t)i * track_size;
+    }
+    set_normtracks(ptrs.data(), ptrs.size());
+    norm_facts.map(facts, num_facts);
+    return true;
+}
 
 } /* namespace musly */
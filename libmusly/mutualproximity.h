@@ -16,6 +16,8 @@
 #include <vector>
 #include "musly/musly_types.h"
 #include "method.h"
+#include "mappedarray.h"
+#include "jukeboximage.h"
 
 namespace musly {
 
@@ -26,7 +28,7 @@ public:
 
     virtual int
     set_normtracks(
-            musly_track** tracks,
+            const musly_track* const* tracks,
             int length);
 
     std::vector<musly_track*>*
@@ -36,6 +38,15 @@ public:
     append_normfacts(
             int count);
 
+    /** Computes the normalization factors of a track from its similarities
+     * to the normalization tracks, without storing them.
+     */
+    void
+    compute_normfacts(
+            Eigen::VectorXf& sim,
+            float* mu,
+            float* std);
+
     void
     set_normfacts(
             int position,
@@ -62,6 +73,24 @@ public:
     trim_normfacts(
             int count);
 
+    /** Moves the normalization factors at \p old_positions to the first
+     * \p count positions and drops all others, see
+     * ordered_idpool_observer::compacted_positions().
+     */
+    void
+    compact_normfacts(
+            const int* old_positions,
+            int count);
+
+    /** Normalizes the raw similarities \p sim between the track at
+     * \p seed_position and the tracks at \p other_positions with Mutual
+     * Proximity, assuming Gaussian similarity distributions. The Gaussian
+     * CDF is evaluated in single precision with an absolute error below
+     * 5e-7, see normsf() in mutualproximity.cpp.
+     *
+     * \returns 0 on success, or -1 if any position is invalid, in which
+     * case \p sim is left unchanged.
+     */
     int
     normalize(
             int seed_position,
@@ -69,24 +98,45 @@ public:
             int length,
             float* sim);
 
+    /** Returns a lower bound of the similarity normalize() computes from the
+     * raw similarity \p sim between the seed track at \p seed_position and
+     * any other track. It only depends on the seed track, so it can be used
+     * to skip normalizing tracks that would be discarded anyway.
+     */
+    float
+    lower_bound(
+            int seed_position,
+            float sim);
+
+    /** Writes the normalization tracks and factors to a jukebox image.
+     */
+    bool
+    write_image(
+            image_writer& image);
+
+    /** Restores the normalization tracks and factors from a jukebox image
+     * written by write_image(). The normalization factors are read in
+     * place, so the image has to stay mapped until they are modified.
+     */
+    bool
+    map_image(
+            image_reader& image);
+
 private:
     method* m;
     std::vector<musly_track*> norm_tracks;
     struct normfact {
         float mu;
         float std;
+        float inv_std;
     };
-    std::vector<normfact> norm_facts;
+    mapped_array<normfact> norm_facts;
 
 
     void
     new_cache(
             int size);
 
-    double
-    normcdf(
-            double x);
-
 };
 
 } /* namespace musly */
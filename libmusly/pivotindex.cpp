@@ -0,0 +1,390 @@
+/**
+ * Copyright 2013-2014, Dominik Schnitzer <dominik@schnitzer.at>
+ *                2014, Jan Schlueter <jan.schlueter@ofai.at>
+ *
+ * This file is part of Musly, a program for high performance music
+ * similarity computation: http://www.musly.org/.
+ *
+ * This Source Code Form is subject to the terms of the Mozilla
+ * Public License v. 2.0. If a copy of the MPL was not distributed
+ * with this file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+#include "pivotindex.h"
+
+namespace musly {
+
+pivotindex::pivotindex(
+        int max_pivots,
+        int max_axes) :
+                max_pivots(max_pivots),
+                max_axes(max_axes),
+                pivots(0),
+                axes(0)
+{
+}
+
+pivotindex::~pivotindex()
+{
+}
+
+void
+pivotindex::set_pivotcount(
+        int count)
+{
+    pivots = std::min(count, max_pivots);
+    axes = std::min(pivots, max_axes);
+    dists.owned().clear();
+    runs.assign(axes, std::vector<run>());
+    pending.assign(axes, std::vector<entry>());
+}
+
+int
+pivotindex::get_pivotcount()
+{
+    return pivots;
+}
+
+void
+pivotindex::append(
+        int count)
+{
+    dists.owned().resize(dists.size() + (size_t)count*pivots);
+}
+
+void
+pivotindex::set_distances(
+        int position,
+        musly_trackid trackid,
+        const float* dists)
+{
+    // allocate space if needed
+    // (ideally, this has already been taken care of by append)
+    std::vector<float>& stored = this->dists.owned();
+    if ((size_t)(position+1)*pivots > stored.size()) {
+        stored.resize((size_t)(position+1)*pivots);
+    }
+    std::copy(dists, dists + pivots, stored.begin() + (size_t)position*pivots);
+    for (int a = 0; a < axes; a++) {
+        pending[a].push_back(entry(dists[a], trackid));
+    }
+}
+
+void
+pivotindex::get_distances(
+        int position,
+        float* dists)
+{
+    std::copy(this->dists.data() + (size_t)position*pivots,
+            this->dists.data() + (size_t)(position+1)*pivots, dists);
+}
+
+void
+pivotindex::commit()
+{
+    // add the sorted pending entries as a new run to each axis, then merge
+    // the last two runs until each run is more than twice as long as the
+    // next one, so there are O(log n) runs and each entry is merged
+    // O(log n) times
+    for (int a = 0; a < axes; a++) {
+        if (pending[a].empty()) {
+            continue;
+        }
+        std::vector<run>& axis = runs[a];
+        axis.push_back(run());
+        std::vector<entry>& added = axis.back().owned();
+        added.swap(pending[a]);
+        std::sort(added.begin(), added.end());
+        while ((axis.size() >= 2) &&
+                (axis[axis.size()-2].size() <= 2*axis.back().size())) {
+            merge_last(axis);
+        }
+    }
+}
+
+void
+pivotindex::merge_last(
+        std::vector<run>& axis)
+{
+    const run& first = axis[axis.size()-2];
+    const run& second = axis.back();
+    run merged;
+    merged.owned().resize(first.size() + second.size());
+    std::merge(first.data(), first.data() + first.size(), second.data(),
+            second.data() + second.size(), merged.owned().begin());
+    axis.pop_back();
+    axis.back().swap(merged);
+}
+
+namespace {
+struct in_sorted_ids {
+    const std::vector<musly_trackid>& ids;
+    in_sorted_ids(const std::vector<musly_trackid>& ids) : ids(ids) {}
+    bool operator()(const std::pair<float, musly_trackid>& e) const {
+        return std::binary_search(ids.begin(), ids.end(), e.second);
+    }
+};
+}
+
+void
+pivotindex::remove_ids(
+        const musly_trackid* trackids,
+        int length)
+{
+    if (length <= 0) {
+        return;
+    }
+    std::vector<musly_trackid> ids(trackids, trackids + length);
+    std::sort(ids.begin(), ids.end());
+    for (int a = 0; a < axes; a++) {
+        for (size_t r = 0; r < runs[a].size(); r++) {
+            const run& list = runs[a][r];
+            if (std::find_if(list.data(), list.data() + list.size(),
+                    in_sorted_ids(ids)) == list.data() + list.size()) {
+                continue;
+            }
+            std::vector<entry>& entries = runs[a][r].owned();
+            entries.erase(std::remove_if(entries.begin(), entries.end(),
+                    in_sorted_ids(ids)), entries.end());
+        }
+        pending[a].erase(std::remove_if(pending[a].begin(), pending[a].end(),
+                in_sorted_ids(ids)), pending[a].end());
+    }
+}
+
+void
+pivotindex::swap(
+        int position1,
+        int position2)
+{
+    std::vector<float>& stored = dists.owned();
+    std::swap_ranges(stored.begin() + (size_t)position1*pivots,
+            stored.begin() + (size_t)(position1+1)*pivots,
+            stored.begin() + (size_t)position2*pivots);
+}
+
+void
+pivotindex::trim(
+        int count)
+{
+    dists.owned().resize(dists.size() - (size_t)count*pivots);
+}
+
+void
+pivotindex::compact(
+        const int* old_positions,
+        int count,
+        ordered_idpool<musly_trackid>& idpool)
+{
+    std::vector<float>& stored = dists.owned();
+    for (int i = 0; i < count; i++) {
+        std::copy(stored.begin() + (size_t)old_positions[i]*pivots,
+                stored.begin() + (size_t)(old_positions[i]+1)*pivots,
+                stored.begin() + (size_t)i*pivots);
+    }
+    stored.resize((size_t)count*pivots);
+
+    // merge each axis into a single run, and keep the entries of registered
+    // tracks that match their current pivot distances, once each
+    for (int a = 0; a < axes; a++) {
+        while (runs[a].size() >= 2) {
+            merge_last(runs[a]);
+        }
+        if (runs[a].empty()) {
+            runs[a].push_back(run());
+        }
+        std::vector<entry>* lists[] = {&runs[a][0].owned(), &pending[a]};
+        for (int k = 0; k < 2; k++) {
+            std::vector<entry>& list = *lists[k];
+            size_t kept = 0;
+            for (size_t i = 0; i < list.size(); i++) {
+                int position = idpool.position_of(list[i].second);
+                if ((position >= 0) && (list[i].first ==
+                        stored[(size_t)position*pivots + a])) {
+                    list[kept++] = list[i];
+                }
+            }
+            list.resize(kept);
+        }
+        std::vector<entry>& sorted = runs[a][0].owned();
+        sorted.erase(std::unique(sorted.begin(), sorted.end()), sorted.end());
+        if (sorted.empty()) {
+            runs[a].clear();
+        }
+    }
+}
+
+bool
+pivotindex::write_image(
+        image_writer& image)
+{
+    if (!image.write_value(pivots) ||
+            !image.write_array(dists.data(), dists.size())) {
+        return false;
+    }
+    for (int a = 0; a < axes; a++) {
+        if (!image.write_value((int)runs[a].size())) {
+            return false;
+        }
+        for (size_t r = 0; r < runs[a].size(); r++) {
+            if (!image.write_array(runs[a][r].data(), runs[a][r].size())) {
+                return false;
+            }
+        }
+        if (!image.write_array(pending[a].data(), pending[a].size())) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool
+pivotindex::map_image(
+        image_reader& image)
+{
+    int count;
+    const float* stored;
+    size_t num_stored;
+    if (!image.read_value(count) || (count < 0) || (count > max_pivots) ||
+            !image.read_array(stored, num_stored) ||
+            ((count == 0) && (num_stored != 0)) ||
+            ((count > 0) && (num_stored % count != 0))) {
+        return false;
+    }
+    set_pivotcount(count);
+    dists.map(stored, num_stored);
+    for (int a = 0; a < axes; a++) {
+        int num_runs;
+        if (!image.read_value(num_runs) || (num_runs < 0)) {
+            return false;
+        }
+        runs[a].resize(num_runs);
+        for (int r = 0; r < num_runs; r++) {
+            const entry* entries;
+            size_t num_entries;
+            if (!image.read_array(entries, num_entries)) {
+                return false;
+            }
+            runs[a][r].map(entries, num_entries);
+        }
+        const entry* entries;
+        size_t num_entries;
+        if (!image.read_array(entries, num_entries)) {
+            return false;
+        }
+        pending[a].assign(entries, entries + num_entries);
+    }
+    return true;
+}
+
+float
+pivotindex::pivot_gap(
+        const float* dists_a,
+        const float* dists_b)
+{
+    float bound = 0;
+    for (int p = 0; p < pivots; p++) {
+        bound = std::max(bound, std::fabs(dists_a[p] - dists_b[p]));
+    }
+    return bound;
+}
+
+int
+pivotindex::neighbors(
+        int seed_position,
+        musly_trackid seed,
+        ordered_idpool<musly_trackid>& idpool,
+        musly_trackid* neighbors,
+        int length,
+        musly_trackid* limit_to,
+        int num_limit_to)
+{
+    if ((pivots == 0) || (seed_position < 0) || (length < 0)) {
+        return -1;
+    }
+    const float* seed_dists = &dists[(size_t)seed_position*pivots];
+
+    // collect the candidates
+    std::vector<musly_trackid> candidates;
+    if (limit_to) {
+        candidates.assign(limit_to, limit_to + num_limit_to);
+    } else {
+        // take the tracks closest to the seed on each axis, walking outwards
+        // from the seed in both directions on all runs of the axis at once
+        const int window = 2*length;
+        candidates.reserve(window*axes);
+        for (int a = 0; a < axes; a++) {
+            const std::vector<run>& axis = runs[a];
+            const float c = seed_dists[a];
+            std::vector<int> up(axis.size());
+            std::vector<int> down(axis.size());
+            for (size_t r = 0; r < axis.size(); r++) {
+                const entry* first = axis[r].data();
+                up[r] = std::lower_bound(first, first + axis[r].size(),
+                        entry(c, std::numeric_limits<musly_trackid>::min()))
+                        - first;
+                down[r] = up[r] - 1;
+            }
+            for (int taken = 0; taken < window; ) {
+                // find the closest entry not taken yet, preferring the
+                // upper one on ties
+                int next_run = -1;
+                bool next_up = false;
+                float gap = std::numeric_limits<float>::infinity();
+                for (int r = 0; r < (int)axis.size(); r++) {
+                    if ((up[r] < (int)axis[r].size()) &&
+                            ((next_run < 0) || (axis[r][up[r]].first - c < gap))) {
+                        next_run = r;
+                        next_up = true;
+                        gap = axis[r][up[r]].first - c;
+                    }
+                    if ((down[r] >= 0) &&
+                            ((next_run < 0) || (c - axis[r][down[r]].first < gap))) {
+                        next_run = r;
+                        next_up = false;
+                        gap = c - axis[r][down[r]].first;
+                    }
+                }
+                if (next_run < 0) {
+                    break;
+                }
+                const entry& next = axis[next_run][next_up ?
+                        up[next_run]++ : down[next_run]--];
+                // skip tracks removed since the last compact()
+                if ((next.second != seed) &&
+                        (idpool.position_of(next.second) >= 0)) {
+                    candidates.push_back(next.second);
+                    taken++;
+                }
+            }
+        }
+        std::sort(candidates.begin(), candidates.end());
+        candidates.erase(std::unique(candidates.begin(), candidates.end()),
+                candidates.end());
+    }
+
+    // rank them by their pivot gap to the seed, which approximates a lower
+    // bound of their distance
+    std::vector<entry> ranked;
+    ranked.reserve(candidates.size());
+    for (int i = 0; i < (int)candidates.size(); i++) {
+        int position = idpool.position_of(candidates[i]);
+        if ((position < 0) || (candidates[i] == seed)) {
+            continue;
+        }
+        ranked.push_back(entry(pivot_gap(seed_dists,
+                &dists[(size_t)position*pivots]), candidates[i]));
+    }
+    int count = std::min(length, (int)ranked.size());
+    std::partial_sort(ranked.begin(), ranked.begin() + count, ranked.end());
+    for (int i = 0; i < count; i++) {
+        neighbors[i] = ranked[i].second;
+    }
+    return count;
+}
+
+} /* namespace musly */
@@ -0,0 +1,194 @@
+/**
+ * Copyright 2013-2014, Dominik Schnitzer <dominik@schnitzer.at>
+ *                2014, Jan Schlueter <jan.schlueter@ofai.at>
+ *
+ * This file is part of Musly, a program for high performance music
+ * similarity computation: http://www.musly.org/.
+ *
+ * This Source Code Form is subject to the terms of the Mozilla
+ * Public License v. 2.0. If a copy of the MPL was not distributed
+ * with this file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+#ifndef MUSLY_PIVOTINDEX_H_
+#define MUSLY_PIVOTINDEX_H_
+
+#include <vector>
+#include <utility>
+#include "musly/musly_types.h"
+#include "idpool.h"
+#include "mappedarray.h"
+#include "jukeboximage.h"
+
+namespace musly {
+
+/** An approximate nearest neighbor index, a heuristic candidate filter with
+ * no exactness guarantee. Each track is represented by its distances to a
+ * fixed set of pivot tracks, and candidates are ranked by the largest
+ * difference between their pivot distances and those of the query. For a
+ * metric, this would be a lower bound of their distance (by the triangle
+ * inequality). The timbre method indexes the square root of its closed-form
+ * Jensen-Shannon approximation for Gaussians, which is not guaranteed to be
+ * a metric, so close tracks can be ranked low or missed; callers rank the
+ * candidates by their actual similarity. To avoid scanning all tracks for a
+ * query, the tracks
+ * are also kept sorted by their distance to the first few pivots (the axes);
+ * candidates are collected from the tracks closest to the query on each axis.
+ * Each axis consists of a few sorted runs, each more than twice as long as
+ * the next, which are merged like the digits of a binary counter, so adding
+ * tracks costs O(log n) per track (amortized) instead of O(n) per commit().
+ *
+ * Like the mutualproximity normalization factors, the pivot distances are
+ * stored per position of an ordered_idpool and need to be kept in sync with
+ * it using append(), swap(), trim() and compact(). Tracks removed from the
+ * idpool with ordered_idpool::tombstone_ids() may stay on the axes until the
+ * next compact(); they are skipped by neighbors().
+ */
+class pivotindex {
+public:
+    pivotindex(
+            int max_pivots,
+            int max_axes);
+    virtual ~pivotindex();
+
+    /** Sets the number of pivots (at most \p max_pivots) and clears the
+     * index.
+     */
+    void
+    set_pivotcount(
+            int count);
+
+    int
+    get_pivotcount();
+
+    void
+    append(
+            int count);
+
+    /** Sets the pivot distances of the track at \p position. The track is
+     * added to the axes by the next call to commit().
+     *
+     * \param dists get_pivotcount() distances to the pivots.
+     */
+    void
+    set_distances(
+            int position,
+            musly_trackid trackid,
+            const float* dists);
+
+    void
+    get_distances(
+            int position,
+            float* dists);
+
+    /** Adds all tracks given to set_distances() since the last call to the
+     * axes.
+     */
+    void
+    commit();
+
+    /** Removes tracks from the axes. Their pivot distances have to be
+     * removed separately with trim().
+     */
+    void
+    remove_ids(
+            const musly_trackid* trackids,
+            int length);
+
+    void
+    swap(
+            int position1,
+            int position2);
+
+    void
+    trim(
+            int count);
+
+    /** Moves the pivot distances at \p old_positions to the first \p count
+     * positions and drops all others, see
+     * ordered_idpool_observer::compacted_positions(). Also removes all
+     * tracks from the axes that are no longer registered with \p idpool,
+     * or were registered again with other pivot distances.
+     */
+    void
+    compact(
+            const int* old_positions,
+            int count,
+            ordered_idpool<musly_trackid>& idpool);
+
+    /** Guesses the nearest neighbors of a registered track.
+     *
+     * \param seed_position The position of the seed track.
+     * \param seed The id of the seed track, it is never returned.
+     * \param idpool The idpool the positions refer to.
+     * \param neighbors Receives up to \p length track ids, closest first.
+     * \param limit_to If not <tt>NULL</tt>, only these track ids are
+     * considered.
+     * \returns the number of track ids written, or -1 on an error.
+     */
+    int
+    neighbors(
+            int seed_position,
+            musly_trackid seed,
+            ordered_idpool<musly_trackid>& idpool,
+            musly_trackid* neighbors,
+            int length,
+            musly_trackid* limit_to,
+            int num_limit_to);
+
+    /** Writes the pivot distances and the axes to a jukebox image.
+     */
+    bool
+    write_image(
+            image_writer& image);
+
+    /** Restores the pivot distances and the axes from a jukebox image
+     * written by write_image(), reading them in place. The image has to
+     * stay mapped until they are modified; runs of an axis stay mapped until
+     * they are merged.
+     */
+    bool
+    map_image(
+            image_reader& image);
+
+private:
+    typedef std::pair<float, musly_trackid> entry;
+
+    const int max_pivots;
+    const int max_axes;
+    int pivots;
+    int axes;
+
+    /** The pivot distances, get_pivotcount() floats per position.
+     */
+    mapped_array<float> dists;
+
+    typedef mapped_array<entry> run;
+
+    /** Per axis, runs of tracks sorted by their distance to the axis pivot,
+     * longest first.
+     */
+    std::vector< std::vector<run> > runs;
+
+    /** Per axis, the tracks to be added by commit().
+     */
+    std::vector< std::vector<entry> > pending;
+
+    /** Merges the last two runs of \p axis into one.
+     */
+    void
+    merge_last(
+            std::vector<run>& axis);
+
+    /** Returns the largest difference between the pivot distances of two
+     * tracks, the rank of a candidate (a lower bound of the distance of the
+     * tracks only for metric distances).
+     */
+    float
+    pivot_gap(
+            const float* dists_a,
+            const float* dists_b);
+};
+
+} /* namespace musly */
+#endif /* MUSLY_PIVOTINDEX_H_ */
@@ -20,14 +20,9 @@ powerspectrum::powerspectrum(
         const Eigen::VectorXf& win_funct,
         float hop)
 {
-    this->win_funct = win_funct;
     this->win_size = win_funct.size();
     this->hop_size = hop*win_size;
-
-    // initialize kiss fft
-    kiss_pcm = (kiss_fft_scalar*)malloc(sizeof(kiss_fft_scalar) * win_size);
-    kiss_freq = (kiss_fft_cpx*)malloc(sizeof(kiss_fft_cpx) * (win_size/2 + 1));
-    kiss_status = kiss_fftr_alloc(win_size, 0, NULL, NULL);
+    this->backend = fft::create(win_funct);
 }
 
 Eigen::MatrixXf
@@ -46,41 +41,39 @@ powerspectrum::from_pcm(const Eigen::VectorXf& pcm_samples)
     Eigen::MatrixXf ps(freq_bins, frames);
 
     // peak normalization value
-    float pcm_scale = std::max(fabs(pcm_samples.minCoeff()),
-            fabs(pcm_samples.maxCoeff()));
-
-    // scale signal to 96db (16bit)
-    pcm_scale =  std::pow(10.0f, 96.0f/20.0f) / pcm_scale;
+    float pcm_scale = get_pcmscale(std::max(fabs(pcm_samples.minCoeff()),
+            fabs(pcm_samples.maxCoeff())));
 
     // compute the power spectrum
-    for (size_t i = 0; i < frames; i++) {
-
-        // fill pcm
-        for (int j = 0; j < win_size; j++) {
-            kiss_pcm[j] = pcm_samples(i*hop_size+j) * pcm_scale * win_funct(j);
-        }
-
-        // fft
-        kiss_fftr(kiss_status, kiss_pcm, kiss_freq);
-
-        // save powerspectrum frame
-        Eigen::MatrixXf::ColXpr psc(ps.col(i));
-        for (int j = 0; j < win_size/2+1; j++) {
-            psc(j) =
-                    std::pow(kiss_freq[j].r, 2) + std::pow(kiss_freq[j].i, 2);
-        }
-    }
+    from_pcm_frames(pcm_samples.data(), frames, pcm_scale, ps);
 
     MINILOG(logTRACE) << "Powerspectrum finished. size=" << ps.rows() << "x"
             << ps.cols();
     return ps;
 }
 
+void
+powerspectrum::from_pcm_frames(
+        const float* pcm_samples,
+        int frames,
+        float pcm_scale,
+        Eigen::MatrixXf& ps)
+{
+    ps.resize(win_size/2 + 1, frames);
+    backend->power_frames(pcm_samples, hop_size, frames, pcm_scale, ps.data());
+}
+
+float
+powerspectrum::get_pcmscale(
+        float peak)
+{
+    // scale signal to 96db (16bit)
+    return std::pow(10.0f, 96.0f/20.0f) / peak;
+}
+
 powerspectrum::~powerspectrum()
 {
-    free(kiss_status);
-    free(kiss_pcm);
-    free(kiss_freq);
+    delete backend;
 }
 
 
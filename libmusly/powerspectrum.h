@@ -13,9 +13,7 @@
 #define MUSLY_POWERSPECTRUM_H_
 
 #include <Eigen/Core>
-extern "C" {
-    #include "kissfft/kiss_fftr.h"
-}
+#include "fft.h"
 
 
 namespace musly {
@@ -30,22 +28,9 @@ private:
      */
     int win_size;
 
-    /** The window function, as a vector of scalars. The window function is
-     * multiplied with the signal before applying the FFT.
+    /** The FFT backend, which also applies the window function.
      */
-    Eigen::VectorXf win_funct;
-
-    /** KissFFT internal representation of the PCM data.
-     */
-    kiss_fft_scalar* kiss_pcm;
-
-    /** KissFFT internal of the frequency spectrum.
-     */
-    kiss_fft_cpx* kiss_freq;
-
-    /** KissFFT internal of the FFT status.
-     */
-    kiss_fftr_cfg kiss_status;
+    fft* backend;
 
 public:
     /** Initialize the powerspectrum with the window function and hop size.
@@ -69,7 +54,40 @@ public:
     Eigen::MatrixXf from_pcm(
             const Eigen::VectorXf& pcm_samples);
 
-    /** Cleanup. Frees the internal KissFFT variables.
+    /** Get the powerspectrum of consecutive frames of PCM samples, scaled by
+     * a given factor instead of the peak normalization of from_pcm(). Frame
+     * \c i starts at sample <tt>i * get_hopsize()</tt>.
+     * \param pcm_samples At least
+     * <tt>(frames-1) * get_hopsize() + get_windowsize()</tt> PCM samples.
+     * \param frames The number of frames to compute.
+     * \param pcm_scale The factor to multiply the samples with.
+     * \param ps Receives the powerspectrum, it is resized to (Frequency,
+     * frames).
+     */
+    void from_pcm_frames(
+            const float* pcm_samples,
+            int frames,
+            float pcm_scale,
+            Eigen::MatrixXf& ps);
+
+    /** The factor from_pcm() scales PCM samples of the given peak value
+     * with. It maps the peak to 96dB (16 bit).
+     */
+    static float
+    get_pcmscale(
+            float peak);
+
+    int
+    get_windowsize() const {
+        return win_size;
+    }
+
+    int
+    get_hopsize() const {
+        return hop_size;
+    }
+
+    /** Cleanup. Frees the FFT backend.
      */
     virtual ~powerspectrum();
 };
@@ -9,34 +9,169 @@
  * with this file, You can obtain one at http://mozilla.org/MPL/2.0/.
  */
 
+#define _USE_MATH_DEFINES
+#include <cmath>
+#include <algorithm>
+#include <Eigen/Core>
 #include "resampler.h"
 
 #include "minilog.h"
 
 namespace musly {
 
+namespace {
+
+int
+gcd(int a, int b)
+{
+    while (b) {
+        int t = a % b;
+        a = b;
+        b = t;
+    }
+    return a;
+}
+
+/** The zeroth order modified Bessel function of the first kind, for the
+ * Kaiser window.
+ */
+double
+bessel_i0(double x)
+{
+    double sum = 1;
+    double term = 1;
+    for (int k = 1; k < 50; k++) {
+        term *= (x / (2*k)) * (x / (2*k));
+        sum += term;
+        if (term < sum * 1e-12) {
+            break;
+        }
+    }
+    return sum;
+}
+
+}  // namespace
+
 resampler::resampler(int input_rate, int output_rate):
         input_rate(input_rate),
         output_rate(output_rate),
-        resample_factor((double)output_rate/(double)input_rate)
+        resample_factor((double)output_rate/(double)input_rate),
+        up(0),
+        down(0),
+        taps(0)
 {
-    libresample = resample_open(1, resample_factor, resample_factor);
+    if ((input_rate <= 0) || (output_rate <= 0) ||
+            (input_rate == output_rate)) {
+        return;
+    }
+    int g = gcd(input_rate, output_rate);
+    if (output_rate / g > max_up) {
+        return;
+    }
+    up = output_rate / g;
+    down = input_rate / g;
+
+    // Design a windowed-sinc lowpass filter at the upsampled rate, with
+    // the parameters libresample uses in high quality mode: a cutoff of
+    // 90% of the lower Nyquist frequency, 17 zero crossings on either side
+    // and a Kaiser window with beta = 6.
+    const double cutoff = 0.9 * 0.5 / std::max(up, down);
+    const int zero_crossings = 17;
+    const double beta = 6;
+    taps = 2 * (int)std::ceil(zero_crossings / (2 * cutoff) / up);
+    const int length = taps * up;
+    const double center = length / 2;
+    const double i0_beta = bessel_i0(beta);
+
+    // split it into one filter per phase, with coefficients in reverse
+    // order and scaled by the interpolation factor
+    phases.resize(length);
+    for (int i = 0; i < length; i++) {
+        double t = i - center;
+        double sinc = (t == 0) ? 1 :
+                std::sin(2 * M_PI * cutoff * t) / (2 * M_PI * cutoff * t);
+        double r = t / center;
+        double window = (std::abs(r) >= 1) ? 0 :
+                bessel_i0(beta * std::sqrt(1 - r*r)) / i0_beta;
+        int phase = i % up;
+        int tap = i / up;
+        phases[phase*taps + (taps - 1 - tap)] = 2 * cutoff * up * sinc * window;
+    }
+
+    MINILOG(logTRACE) << "Polyphase resampler: up=" << up << ", down="
+            << down << ", taps=" << taps;
 }
 
 resampler::~resampler()
 {
-    resample_close(libresample);
 }
 
 std::vector<float> resampler::resample(
         float* pcm_input,
         int pcm_len)
 {
-    std::vector<float> pcm_out(pcm_len*resample_factor);
+    std::vector<float> pcm_out;
+    resample(pcm_input, pcm_len, pcm_out);
+    return pcm_out;
+}
+
+void
+resampler::resample(
+        const float* pcm_input,
+        int pcm_len,
+        std::vector<float>& pcm_out)
+{
+    if (input_rate == output_rate) {
+        pcm_out.assign(pcm_input, pcm_input + pcm_len);
+    } else if (up > 0) {
+        resample_polyphase(pcm_input, pcm_len, pcm_out);
+    } else {
+        resample_libresample(pcm_input, pcm_len, pcm_out);
+    }
+}
+
+void
+resampler::resample_polyphase(
+        const float* pcm_input,
+        int pcm_len,
+        std::vector<float>& pcm_out)
+{
+    // pad the input with zeros, so every output sample sees a full window
+    padded.assign(pcm_len + 2*taps, 0.0f);
+    std::copy(pcm_input, pcm_input + pcm_len, padded.begin() + taps);
+
+    // Output sample n is centered on the upsampled position n*down, and
+    // the filter is centered on position length/2 = taps/2*up of its
+    // window, so its window ends at upsampled position n*down + taps/2*up.
+    pcm_out.resize((long long)pcm_len * up / down);
+    const int n_out = pcm_out.size();
+    long long pos = (long long)(taps/2) * up;
+    for (int n = 0; n < n_out; n++, pos += down) {
+        const int phase = pos % up;
+        const long long last = pos / up;
+        Eigen::Map<const Eigen::VectorXf> coeffs(&phases[phase*taps], taps);
+        Eigen::Map<const Eigen::VectorXf> window(
+                &padded[last + taps - (taps - 1)], taps);
+        pcm_out[n] = coeffs.dot(window);
+    }
+
+    // clip to the valid range
+    Eigen::Map<Eigen::ArrayXf> out(pcm_out.data(), n_out);
+    out = out.max(-1.0f).min(1.0f);
+}
+
+void
+resampler::resample_libresample(
+        const float* pcm_input,
+        int pcm_len,
+        std::vector<float>& pcm_out)
+{
+    void* libresample = resample_open(1, resample_factor, resample_factor);
+    pcm_out.resize(pcm_len*resample_factor);
 
     int srclen = 4096;
     int dstlen = (srclen*resample_factor + 1000);
-    float* dst = new float[dstlen];
+    dst.resize(dstlen);
 
     int in_pos = 0;
     int out_pos = 0;
@@ -48,8 +183,8 @@ std::vector<float> resampler::resample(
 
         int input_read = 0;
         int out_written = resample_process(libresample, resample_factor,
-                pcm_input+in_pos, block_len, is_last_iteration,
-                &input_read, dst, dstlen);
+                const_cast<float*>(pcm_input)+in_pos, block_len,
+                is_last_iteration, &input_read, dst.data(), dstlen);
 
         if (pcm_out.size() < (size_t)(out_pos+out_written)) {
             pcm_out.resize(out_pos+out_written);
@@ -72,9 +207,7 @@ std::vector<float> resampler::resample(
         pcm_out.resize(out_pos);
     }
 
-    delete[] dst;
-
-    return pcm_out;
+    resample_close(libresample);
 }
 
 
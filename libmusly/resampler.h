@@ -19,19 +19,72 @@ extern "C" {
 
 namespace musly {
 
+/** Converts the sample rate of a PCM signal. Sample rates in a ratio L/M
+ * with a small L, such as 44100 or 48000 Hz to 22050 Hz, are converted by a
+ * polyphase FIR filter precomputed in the constructor. Other ratios are
+ * converted by libresample, and equal rates are passed through.
+ */
 class resampler {
 private:
     int input_rate;
     int output_rate;
     double resample_factor;
 
-    void* libresample;
+    /** The interpolation and decimation factors of the polyphase filter,
+     * or 0 if libresample is used instead.
+     */
+    int up;
+    int down;
+
+    /** The number of taps of each phase of the polyphase filter.
+     */
+    int taps;
+
+    /** The coefficients of the polyphase filter, \c taps per phase, in
+     * reverse order, so each output sample is the dot product of the
+     * coefficients of its phase and contiguous input samples.
+     */
+    std::vector<float> phases;
+
+    /** The input signal, padded with zeros on both sides.
+     */
+    std::vector<float> padded;
+
+    /** The output buffer of libresample.
+     */
+    std::vector<float> dst;
+
+    /** The largest interpolation factor handled by the polyphase filter.
+     */
+    static const int max_up = 1024;
+
+    void
+    resample_polyphase(
+            const float* pcm_input,
+            int pcm_len,
+            std::vector<float>& pcm_out);
+
+    void
+    resample_libresample(
+            const float* pcm_input,
+            int pcm_len,
+            std::vector<float>& pcm_out);
 
 public:
     resampler(int input_rate, int output_rate);
     virtual ~resampler();
 
     std::vector<float> resample(float* pcm_input, int pcm_len);
+
+    /** Resamples \p pcm_len samples into \p pcm_out, which is resized as
+     * needed. Reusing the resampler and the output vector for several
+     * signals avoids reallocating buffers.
+     */
+    void
+    resample(
+            const float* pcm_input,
+            int pcm_len,
+            std::vector<float>& pcm_out);
 };
 
 } /* namespace musly */
@@ -0,0 +1,101 @@
+/**
+ * Copyright 2013-2014, Dominik Schnitzer <dominik@schnitzer.at>
+ *                2014, Jan Schlueter <jan.schlueter@ofai.at>
+ *
+ * This file is part of Musly, a program for high performance music
+ * similarity computation: http://www.musly.org/.
+ *
+ * This Source Code Form is subject to the terms of the Mozilla
+ * Public License v. 2.0. If a copy of the MPL was not distributed
+ * with this file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+#include "rwlock.h"
+
+namespace musly {
+
+#if defined(WIN32) || defined(_WIN32) || defined(__WIN32__)
+
+rwlock::rwlock()
+{
+    InitializeSRWLock(&lock);
+}
+
+rwlock::~rwlock()
+{
+}
+
+void
+rwlock::lock_read()
+{
+    AcquireSRWLockShared(&lock);
+}
+
+void
+rwlock::unlock_read()
+{
+    ReleaseSRWLockShared(&lock);
+}
+
+void
+rwlock::lock_write()
+{
+    AcquireSRWLockExclusive(&lock);
+}
+
+void
+rwlock::unlock_write()
+{
+    ReleaseSRWLockExclusive(&lock);
+}
+
+#else
+
+rwlock::rwlock()
+{
+#ifdef __GLIBC__
+    // glibc prefers readers by default, so a steady stream of readers could
+    // keep a writer waiting forever
+    pthread_rwlockattr_t attr;
+    pthread_rwlockattr_init(&attr);
+    pthread_rwlockattr_setkind_np(&attr,
+            PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+    pthread_rwlock_init(&lock, &attr);
+    pthread_rwlockattr_destroy(&attr);
+#else
+    pthread_rwlock_init(&lock, NULL);
+#endif
+}
+
+rwlock::~rwlock()
+{
+    pthread_rwlock_destroy(&lock);
+}
+
+void
+rwlock::lock_read()
+{
+    pthread_rwlock_rdlock(&lock);
+}
+
+void
+rwlock::unlock_read()
+{
+    pthread_rwlock_unlock(&lock);
+}
+
+void
+rwlock::lock_write()
+{
+    pthread_rwlock_wrlock(&lock);
+}
+
+void
+rwlock::unlock_write()
+{
+    pthread_rwlock_unlock(&lock);
+}
+
+#endif
+
+} /* namespace musly */
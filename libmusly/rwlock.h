@@ -0,0 +1,98 @@
+/**
+ * Copyright 2013-2014, Dominik Schnitzer <dominik@schnitzer.at>
+ *                2014, Jan Schlueter <jan.schlueter@ofai.at>
+ *
+ * This file is part of Musly, a program for high performance music
+ * similarity computation: http://www.musly.org/.
+ *
+ * This Source Code Form is subject to the terms of the Mozilla
+ * Public License v. 2.0. If a copy of the MPL was not distributed
+ * with this file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+#ifndef MUSLY_RWLOCK_H_
+#define MUSLY_RWLOCK_H_
+
+#if defined(WIN32) || defined(_WIN32) || defined(__WIN32__)
+// keep windows.h from defining min() and max() macros
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#include <windows.h>
+#else
+#include <pthread.h>
+#endif
+
+namespace musly {
+
+/** A reader/writer lock: any number of threads can hold it for reading at
+ * the same time, or a single thread can hold it for writing. A thread
+ * waiting to write is served before threads that start reading after it, so
+ * writers are not starved by a steady stream of readers. The lock is not
+ * recursive; a thread must not acquire it again while holding it. Use the
+ * read_guard and write_guard classes to hold it for a scope.
+ */
+class rwlock {
+public:
+    rwlock();
+    ~rwlock();
+
+    void
+    lock_read();
+
+    void
+    unlock_read();
+
+    void
+    lock_write();
+
+    void
+    unlock_write();
+
+private:
+#if defined(WIN32) || defined(_WIN32) || defined(__WIN32__)
+    SRWLOCK lock;
+#else
+    pthread_rwlock_t lock;
+#endif
+
+    // not copyable
+    rwlock(const rwlock&);
+    rwlock& operator=(const rwlock&);
+};
+
+/** Holds an rwlock for reading until the end of the scope.
+ */
+class read_guard {
+public:
+    read_guard(rwlock& lock) : lock(lock) {
+        lock.lock_read();
+    }
+    ~read_guard() {
+        lock.unlock_read();
+    }
+
+private:
+    rwlock& lock;
+};
+
+/** Holds an rwlock for writing until the end of the scope.
+ */
+class write_guard {
+public:
+    write_guard(rwlock& lock) : lock(lock) {
+        lock.lock_write();
+    }
+    ~write_guard() {
+        lock.unlock_write();
+    }
+
+private:
+    rwlock& lock;
+};
+
+} /* namespace musly */
+#endif /* MUSLY_RWLOCK_H_ */
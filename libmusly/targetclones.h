@@ -0,0 +1,31 @@
+/**
+ * Copyright 2013-2014, Dominik Schnitzer <dominik@schnitzer.at>
+ *                2014, Jan Schlueter <jan.schlueter@ofai.at>
+ *
+ * This file is part of Musly, a program for high performance music
+ * similarity computation: http://www.musly.org/.
+ *
+ * This Source Code Form is subject to the terms of the Mozilla
+ * Public License v. 2.0. If a copy of the MPL was not distributed
+ * with this file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+#ifndef MUSLY_TARGETCLONES_H_
+#define MUSLY_TARGETCLONES_H_
+
+// With GCC on x86-64 ELF platforms, we let the dynamic loader pick the best
+// variant of the numeric kernels marked MUSLY_TARGET_CLONES for the CPU we
+// are running on. Contracting to FMA instructions is disabled, so all
+// variants compute exactly the same results as the scalar code. All kernels
+// share this list of instruction sets, see gaussian_statistics::get_kernel().
+#if defined(__GNUC__) && !defined(__clang__) && defined(__x86_64__) \
+        && defined(__ELF__)
+#define MUSLY_HAVE_TARGET_CLONES
+#define MUSLY_TARGET_CLONES \
+        __attribute__((target_clones("avx512f", "avx2", "default"), \
+                optimize("fp-contract=off")))
+#else
+#define MUSLY_TARGET_CLONES
+#endif
+
+#endif /* MUSLY_TARGETCLONES_H_ */
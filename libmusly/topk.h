@@ -0,0 +1,118 @@
+/**
+ * Copyright 2013-2014, Dominik Schnitzer <dominik@schnitzer.at>
+ *                2014, Jan Schlueter <jan.schlueter@ofai.at>
+ *
+ * This file is part of Musly, a program for high performance music
+ * similarity computation: http://www.musly.org/.
+ *
+ * This Source Code Form is subject to the terms of the Mozilla
+ * Public License v. 2.0. If a copy of the MPL was not distributed
+ * with this file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+#ifndef MUSLY_TOPK_H_
+#define MUSLY_TOPK_H_
+
+#include <vector>
+#include <utility>
+#include <algorithm>
+#include "musly/musly_types.h"
+
+namespace musly {
+
+/** Collects the \c k smallest similarities (i.e., the most similar tracks)
+ * offered to it, in a bounded max-heap. Tracks are ordered by similarity
+ * and equal similarities by track id, like musly_findmin() does, so the
+ * result does not depend on the order the tracks are offered in. NaN
+ * similarities are never kept.
+ */
+class topk {
+public:
+    typedef std::pair<float, musly_trackid> entry;
+
+    topk(int k) : k(k < 0 ? 0 : k) {
+        heap.reserve(this->k);
+    }
+
+    /** Returns true if \c k similarities are collected, so new ones need to
+     * beat worst() to be kept.
+     */
+    inline bool
+    full() const {
+        return (int)heap.size() >= k;
+    }
+
+    /** Returns the largest similarity collected. Only valid if full().
+     */
+    inline float
+    worst() const {
+        return heap.front().first;
+    }
+
+    /** Returns true if \p sim and \p trackid would be kept by offer().
+     */
+    inline bool
+    accepts(
+            float sim,
+            musly_trackid trackid) const {
+        return (k > 0) && (sim == sim) &&
+                (!full() || less_entry(entry(sim, trackid), heap.front()));
+    }
+
+    /** Offers a similarity of the track \p trackid.
+     *
+     * \returns true if it was kept.
+     */
+    inline bool
+    offer(
+            float sim,
+            musly_trackid trackid) {
+        if (!accepts(sim, trackid)) {
+            return false;
+        }
+        if (full()) {
+            std::pop_heap(heap.begin(), heap.end(), less_entry);
+            heap.back() = entry(sim, trackid);
+        } else {
+            heap.push_back(entry(sim, trackid));
+        }
+        std::push_heap(heap.begin(), heap.end(), less_entry);
+        return true;
+    }
+
+    /** Writes the collected similarities and track ids, the most similar
+     * first. Either output may be <tt>NULL</tt>.
+     *
+     * \returns the number of entries written, at most \c k.
+     */
+    int
+    finish(
+            musly_trackid* trackids,
+            float* similarities) {
+        std::sort_heap(heap.begin(), heap.end(), less_entry);
+        for (int i = 0; i < (int)heap.size(); i++) {
+            if (trackids) {
+                trackids[i] = heap[i].second;
+            }
+            if (similarities) {
+                similarities[i] = heap[i].first;
+            }
+        }
+        return (int)heap.size();
+    }
+
+private:
+    int k;
+    std::vector<entry> heap;
+
+    static bool
+    less_entry(
+            const entry& lhs,
+            const entry& rhs) {
+        return (lhs.first < rhs.first) ||
+                ((lhs.first == rhs.first) && (lhs.second < rhs.second));
+    }
+};
+
+} /* namespace musly */
+#endif /* MUSLY_TOPK_H_ */
@@ -0,0 +1,239 @@
+/**
+ * Copyright 2013-2014, Dominik Schnitzer <dominik@schnitzer.at>
+ *                2014, Jan Schlueter <jan.schlueter@ofai.at>
+ *
+ * This file is part of Musly, a program for high performance music
+ * similarity computation: http://www.musly.org/.
+ *
+ * This Source Code Form is subject to the terms of the Mozilla
+ * Public License v. 2.0. If a copy of the MPL was not distributed
+ * with this file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+#include <algorithm>
+#include <cstddef>
+#include "trackstore.h"
+
+namespace musly {
+
+trackstore::trackstore() :
+        track_size(0),
+        capacity(0),
+        raw(NULL),
+        data(NULL),
+        rows(NULL)
+{
+    ids.set_observer(this);
+}
+
+trackstore::~trackstore()
+{
+    delete[] raw;
+}
+
+void
+trackstore::set_tracksize(
+        int track_size)
+{
+    if (track_size == this->track_size) {
+        return;
+    }
+    ids.remove_last(ids.get_slotcount());
+    delete[] raw;
+    raw = NULL;
+    data = NULL;
+    rows = NULL;
+    capacity = 0;
+    this->track_size = track_size;
+}
+
+void
+trackstore::reserve(
+        int size)
+{
+    if ((size <= capacity) && (rows == data)) {
+        return;
+    }
+
+    // grow geometrically, and keep the capacity a multiple of the alignment
+    // so every field row starts aligned; mapped rows are copied as they are
+    const int align_floats = alignment / sizeof(float);
+    int new_capacity = std::max(size, (rows == data) ? 2*capacity : capacity);
+    new_capacity = (new_capacity + align_floats - 1) / align_floats
+            * align_floats;
+
+    float* new_raw = new float[(size_t)track_size * new_capacity
+            + align_floats];
+    float* new_data = (float*)(((size_t)new_raw + alignment - 1)
+            & ~(size_t)(alignment - 1));
+    std::fill(new_data, new_data + (size_t)track_size * new_capacity, 0.0f);
+
+    // copy the stored tracks row by row
+    int size_old = ids.get_slotcount();
+    for (int e = 0; e < track_size; e++) {
+        std::copy(rows + (size_t)e*capacity,
+                rows + (size_t)e*capacity + size_old,
+                new_data + (size_t)e*new_capacity);
+    }
+
+    delete[] raw;
+    raw = new_raw;
+    data = new_data;
+    rows = new_data;
+    capacity = new_capacity;
+}
+
+int
+trackstore::add_tracks(
+        musly_track** tracks,
+        musly_trackid* trackids,
+        int length)
+{
+    if (length <= 0) {
+        return 0;
+    }
+    reserve(ids.get_slotcount() + length);
+
+    // known tracks are moved to the end, new ones are appended
+    int num_new = ids.add_ids(trackids, length);
+    int start = ids.get_slotcount() - length;
+    for (int e = 0; e < track_size; e++) {
+        float* row = data + (size_t)e*capacity + start;
+        for (int i = 0; i < length; i++) {
+            row[i] = tracks[i][e];
+        }
+    }
+    return num_new;
+}
+
+int
+trackstore::remove_tracks(
+        musly_trackid* trackids,
+        int length)
+{
+    return ids.tombstone_ids(trackids, length);
+}
+
+void
+trackstore::compact()
+{
+    // compaction moves the stored tracks, so mapped ones are copied first
+    reserve(capacity);
+    ids.compact();
+}
+
+int
+trackstore::get_size()
+{
+    return ids.get_size();
+}
+
+void
+trackstore::gather(
+        const int* positions,
+        int count,
+        musly_track* tracks)
+{
+    for (int e = 0; e < track_size; e++) {
+        const float* row = rows + (size_t)e*capacity;
+        for (int i = 0; i < count; i++) {
+            tracks[(size_t)i*track_size + e] = row[positions[i]];
+        }
+    }
+}
+
+void
+trackstore::gather_interleaved(
+        const int* positions,
+        int count,
+        int lanes,
+        float* tile)
+{
+    for (int e = 0; e < track_size; e++) {
+        const float* row = rows + (size_t)e*capacity;
+        for (int l = 0; l < lanes; l++) {
+            tile[e*lanes + l] = row[positions[(l < count) ? l : 0]];
+        }
+    }
+}
+
+bool
+trackstore::write_image(
+        image_writer& image)
+{
+    // the rows are written without unused capacity, still aligned
+    const int align_floats = alignment / sizeof(float);
+    const int size = ids.get_slotcount();
+    const int image_capacity = (size + align_floats - 1) / align_floats
+            * align_floats;
+    const std::vector<float> padding(image_capacity - size, 0.0f);
+    if (!image.write_value(track_size) || !image.write_value(image_capacity) ||
+            !ids.write_image(image) ||
+            !image.begin_array((size_t)track_size * image_capacity,
+                    sizeof(float))) {
+        return false;
+    }
+    for (int e = 0; e < track_size; e++) {
+        if (!image.write_raw(rows + (size_t)e*capacity, size * sizeof(float)) ||
+                !image.write_raw(padding.data(),
+                        padding.size() * sizeof(float))) {
+            return false;
+        }
+    }
+    return image.end_array();
+}
+
+bool
+trackstore::map_image(
+        image_reader& image)
+{
+    const int align_floats = alignment / sizeof(float);
+    int image_track_size, image_capacity;
+    if (!image.read_value(image_track_size) || (image_track_size < 0) ||
+            !image.read_value(image_capacity) || (image_capacity < 0) ||
+            (image_capacity % align_floats != 0)) {
+        return false;
+    }
+    set_tracksize(image_track_size);
+    const float* image_rows;
+    size_t num_floats;
+    if (!ids.map_image(image) || !image.read_array(image_rows, num_floats) ||
+            (num_floats != (size_t)track_size * image_capacity) ||
+            (ids.get_slotcount() > image_capacity)) {
+        return false;
+    }
+    delete[] raw;
+    raw = NULL;
+    data = NULL;
+    rows = num_floats ? image_rows : NULL;
+    capacity = image_capacity;
+    return true;
+}
+
+void
+trackstore::swapped_positions(
+        int pos_a,
+        int pos_b)
+{
+    // keep the columns in line with the positions in the idpool
+    for (int e = 0; e < track_size; e++) {
+        float* row = data + (size_t)e*capacity;
+        std::swap(row[pos_a], row[pos_b]);
+    }
+}
+
+void
+trackstore::compacted_positions(
+        const int* old_positions,
+        int count)
+{
+    // move the columns of the remaining tracks to the front, row by row
+    for (int e = 0; e < track_size; e++) {
+        float* row = data + (size_t)e*capacity;
+        for (int i = 0; i < count; i++) {
+            row[i] = row[old_positions[i]];
+        }
+    }
+}
+
+} /* namespace musly */
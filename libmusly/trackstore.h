@@ -0,0 +1,221 @@
+/**
+ * Copyright 2013-2014, Dominik Schnitzer <dominik@schnitzer.at>
+ *                2014, Jan Schlueter <jan.schlueter@ofai.at>
+ *
+ * This file is part of Musly, a program for high performance music
+ * similarity computation: http://www.musly.org/.
+ *
+ * This Source Code Form is subject to the terms of the Mozilla
+ * Public License v. 2.0. If a copy of the MPL was not distributed
+ * with this file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+#ifndef MUSLY_TRACKSTORE_H_
+#define MUSLY_TRACKSTORE_H_
+
+#include "musly/musly_types.h"
+#include "idpool.h"
+#include "jukeboximage.h"
+
+namespace musly {
+
+/** A contiguous arena holding copies of musly_track objects, addressed by
+ * their track ids. Tracks are laid out field-major (structure of arrays):
+ * element \c e of the track at position \c p is stored at
+ * <tt>field(e)[p]</tt>, and the positions of all stored tracks are
+ * consecutive from <tt>0</tt> to <tt>get_slotcount() - 1</tt>, except for
+ * tombstones left by remove_tracks() until the next compact(). Every field
+ * row is aligned to #alignment bytes, so similarity kernels can stream
+ * through a feature of many tracks linearly, using get_stride() as the
+ * distance between the elements of a track. A store restored from a jukebox
+ * image reads the tracks in place until it is modified, see map_image().
+ */
+class trackstore :
+        public ordered_idpool_observer
+{
+public:
+    /** The alignment of the field rows in bytes.
+     */
+    static const int alignment = 64;
+
+    trackstore();
+    virtual ~trackstore();
+
+    /** Sets the number of floats of a musly_track. Removes all stored tracks
+     * if the number changes.
+     */
+    void
+    set_tracksize(
+            int track_size);
+
+    /** Copies tracks into the store. Tracks already stored under the given
+     * ids are overwritten; all given tracks end up at the last \p length
+     * positions, in their given order.
+     *
+     * \returns the number of tracks that were not stored before.
+     */
+    int
+    add_tracks(
+            musly_track** tracks,
+            musly_trackid* trackids,
+            int length);
+
+    /** Removes tracks from the store, leaving a tombstone at their
+     * positions. Unknown ids are skipped.
+     *
+     * \returns the number of tracks removed.
+     */
+    int
+    remove_tracks(
+            musly_trackid* trackids,
+            int length);
+
+    /** Drops all tombstones, moving the stored tracks to consecutive
+     * positions in a single pass over the fields.
+     */
+    void
+    compact();
+
+    /** Returns the number of stored tracks.
+     */
+    int
+    get_size();
+
+    /** Returns the number of positions, including tombstones.
+     */
+    inline int
+    get_slotcount() const {
+        return ids.get_slotcount();
+    }
+
+    inline int
+    get_tombstonecount() const {
+        return ids.get_tombstonecount();
+    }
+
+    /** Returns whether the track at \p position has been removed.
+     */
+    inline bool
+    is_tombstone(
+            int position) const {
+        return ids.is_tombstone(position);
+    }
+
+    /** Returns the distance in floats between two elements of a stored
+     * track, which is the same for all tracks.
+     */
+    inline int
+    get_stride() const {
+        return capacity;
+    }
+
+    /** Returns the position of a stored track, or -1 if it is unknown.
+     */
+    inline int
+    position_of(
+            musly_trackid trackid) {
+        return ids.position_of(trackid);
+    }
+
+    /** Writes the positions of \p length tracks to \p positions, -1 for
+     * unknown ones, and returns how many of them are stored.
+     */
+    inline int
+    positions_of(
+            const musly_trackid* trackids,
+            int length,
+            int* positions) {
+        return ids.positions_of(trackids, length, positions);
+    }
+
+    /** Returns the id of the track stored at \p position, see
+     * is_tombstone().
+     */
+    inline musly_trackid
+    trackid_at(
+            int position) const {
+        return ids[position];
+    }
+
+    /** Returns the row of element \p e of all stored tracks.
+     */
+    inline const float*
+    field(
+            int e) const {
+        return rows + (size_t)e * capacity;
+    }
+
+    /** Copies stored tracks to separate musly_track objects.
+     *
+     * \param positions The positions of \p count stored tracks.
+     * \param tracks A buffer of <tt>count * track_size</tt> floats, receiving
+     * the tracks one after another.
+     */
+    void
+    gather(
+            const int* positions,
+            int count,
+            musly_track* tracks);
+
+    /** Copies stored tracks to a tile of interleaved tracks: element \c e
+     * of the \c l-th track is written to <tt>tile[e*lanes + l]</tt>. If
+     * \p count is smaller than \p lanes, the remaining lanes are filled with
+     * copies of the first track.
+     */
+    void
+    gather_interleaved(
+            const int* positions,
+            int count,
+            int lanes,
+            float* tile);
+
+    /** Writes the stored tracks to a jukebox image.
+     */
+    bool
+    write_image(
+            image_writer& image);
+
+    /** Restores the stored tracks from a jukebox image written by
+     * write_image(), reading them in place. The image has to stay mapped
+     * until the store is modified, which copies all tracks.
+     */
+    bool
+    map_image(
+            image_reader& image);
+
+    virtual void
+    swapped_positions(
+            int pos_a,
+            int pos_b);
+
+    virtual void
+    compacted_positions(
+            const int* old_positions,
+            int count);
+
+private:
+    int track_size;
+    int capacity;
+    float* raw;
+    float* data;
+
+    /** The field rows, either \c data or mapped from a jukebox image.
+     */
+    const float* rows;
+    ordered_idpool<musly_trackid> ids;
+
+    void
+    reserve(
+            int size);
+
+    // the store owns its buffer, so it cannot be copied (not implemented)
+    trackstore(
+            const trackstore&);
+
+    trackstore&
+    operator=(
+            const trackstore&);
+};
+
+} /* namespace musly */
+#endif /* MUSLY_TRACKSTORE_H_ */
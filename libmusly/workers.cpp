@@ -0,0 +1,155 @@
+/**
+ * Copyright 2013-2014, Dominik Schnitzer <dominik@schnitzer.at>
+ *                2014, Jan Schlueter <jan.schlueter@ofai.at>
+ *
+ * This file is part of Musly, a program for high performance music
+ * similarity computation: http://www.musly.org/.
+ *
+ * This Source Code Form is subject to the terms of the Mozilla
+ * Public License v. 2.0. If a copy of the MPL was not distributed
+ * with this file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+#include <vector>
+#if !defined(WIN32) && !defined(_WIN32) && !defined(__WIN32__)
+#include <unistd.h>
+#endif
+
+#include "workers.h"
+
+namespace musly {
+
+namespace {
+
+/** The arguments of a worker thread.
+ */
+struct worker_start {
+    worker_task* task;
+    int worker;
+};
+
+#if defined(WIN32) || defined(_WIN32) || defined(__WIN32__)
+typedef HANDLE worker_thread;
+
+DWORD WINAPI
+worker_main(
+        LPVOID arg)
+{
+    worker_start* start = reinterpret_cast<worker_start*>(arg);
+    start->task->run(start->worker);
+    return 0;
+}
+
+bool
+start_thread(
+        worker_thread& thread,
+        worker_start* start)
+{
+    thread = CreateThread(NULL, 0, worker_main, start, 0, NULL);
+    return thread != NULL;
+}
+
+void
+join_thread(
+        worker_thread& thread)
+{
+    WaitForSingleObject(thread, INFINITE);
+    CloseHandle(thread);
+}
+#else
+typedef pthread_t worker_thread;
+
+void*
+worker_main(
+        void* arg)
+{
+    worker_start* start = reinterpret_cast<worker_start*>(arg);
+    start->task->run(start->worker);
+    return NULL;
+}
+
+bool
+start_thread(
+        worker_thread& thread,
+        worker_start* start)
+{
+    return pthread_create(&thread, NULL, worker_main, start) == 0;
+}
+
+void
+join_thread(
+        worker_thread& thread)
+{
+    pthread_join(thread, NULL);
+}
+#endif
+
+}  // namespace
+
+int
+hardware_threads()
+{
+#if defined(WIN32) || defined(_WIN32) || defined(__WIN32__)
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    int count = info.dwNumberOfProcessors;
+#else
+    int count = sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+    return (count > 0) ? count : 1;
+}
+
+void
+run_workers(
+        worker_task& task,
+        int num_workers)
+{
+    if (num_workers <= 1) {
+        task.run(0);
+        return;
+    }
+
+    // start workers 1 to num_workers-1 on their own threads
+    std::vector<worker_start> starts(num_workers);
+    std::vector<worker_thread> threads(num_workers);
+    std::vector<bool> started(num_workers, false);
+    for (int w = 1; w < num_workers; w++) {
+        starts[w].task = &task;
+        starts[w].worker = w;
+        started[w] = start_thread(threads[w], &starts[w]);
+    }
+
+    // the calling thread is worker 0, and takes over workers without thread
+    task.run(0);
+    for (int w = 1; w < num_workers; w++) {
+        if (!started[w]) {
+            task.run(w);
+        }
+    }
+    for (int w = 1; w < num_workers; w++) {
+        if (started[w]) {
+            join_thread(threads[w]);
+        }
+    }
+}
+
+work_queue::work_queue(
+        int count) :
+                count(count),
+                pos(0)
+{
+}
+
+bool
+work_queue::next(
+        int& index)
+{
+    write_guard guard(lock);
+    if (pos >= count) {
+        return false;
+    }
+    index = pos++;
+    return true;
+}
+
+} /* namespace musly */
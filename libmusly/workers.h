@@ -0,0 +1,76 @@
+/**
+ * Copyright 2013-2014, Dominik Schnitzer <dominik@schnitzer.at>
+ *                2014, Jan Schlueter <jan.schlueter@ofai.at>
+ *
+ * This file is part of Musly, a program for high performance music
+ * similarity computation: http://www.musly.org/.
+ *
+ * This Source Code Form is subject to the terms of the Mozilla
+ * Public License v. 2.0. If a copy of the MPL was not distributed
+ * with this file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+#ifndef MUSLY_WORKERS_H_
+#define MUSLY_WORKERS_H_
+
+#include "rwlock.h"
+
+namespace musly {
+
+/** The work of one thread started by run_workers(). Derive from this class
+ * and implement run().
+ */
+class worker_task {
+public:
+    virtual ~worker_task() {}
+
+    /** Does the work of a single worker thread.
+     *
+     * \param worker The number of the worker, in [0, num_workers).
+     */
+    virtual void
+    run(
+            int worker) = 0;
+};
+
+/** Returns the number of threads the processor runs at the same time, or 1
+ * if it cannot be determined.
+ */
+int
+hardware_threads();
+
+/** Runs \p task on \p num_workers threads at the same time and returns when
+ * all of them have finished. The calling thread is one of the workers, so
+ * a single worker runs without starting a thread. Workers whose thread
+ * cannot be started are run by the calling thread afterwards, so every
+ * worker runs exactly once. This does not depend on OpenMP, so it runs in
+ * parallel in every build.
+ */
+void
+run_workers(
+        worker_task& task,
+        int num_workers);
+
+/** Hands out the indices [0, count) one at a time to any number of worker
+ * threads, so workers that finish early fetch more work.
+ */
+class work_queue {
+public:
+    work_queue(
+            int count);
+
+    /** Fetches the next index into \p index, or returns false if all
+     * indices have been handed out.
+     */
+    bool
+    next(
+            int& index);
+
+private:
+    rwlock lock;
+    int count;
+    int pos;
+};
+
+} /* namespace musly */
+#endif /* MUSLY_WORKERS_H_ */
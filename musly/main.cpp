@@ -139,6 +139,38 @@ bool write_jukebox(std::string &filename, musly_jukebox* jukebox, int last_reini
     return false;
 }
 
+/** State shared with tracks_add_finished() while analyzing a batch of files.
+ */
+struct tracks_add_batch {
+    collection_file* cf;
+    std::vector<std::string> files;
+    std::vector<int> numbers;
+    std::vector<musly_track*> tracks;
+    unsigned char* buffer;
+    int buffersize;
+};
+
+void
+tracks_add_finished(int index, int result, void* user_data) {
+    tracks_add_batch* batch = reinterpret_cast<tracks_add_batch*>(user_data);
+    std::cout << "Analyzing [" << batch->numbers[index] << "]: "
+            << limit_string(batch->files[index], 60);
+    if (result == 0) {
+        int serialized_buffersize =
+                musly_track_tobin(mj, batch->tracks[index], batch->buffer);
+        if (serialized_buffersize == batch->buffersize) {
+            batch->cf->append_track(batch->files[index], batch->buffer,
+                    batch->buffersize);
+            std::cout << " - [OK]" << std::endl;
+        } else {
+            std::cout << " - [FAILED]." << std::endl;
+        }
+
+    } else {
+        std::cout << " - [FAILED]." << std::endl;
+    }
+}
+
 void
 tracks_add(collection_file& cf, std::string directory_or_file, std::string extension) {
     fileiterator fi(directory_or_file, extension);
@@ -148,77 +180,49 @@ tracks_add(collection_file& cf, std::string directory_or_file, std::string exten
                 directory_or_file << std::endl;
     }
     else {
-        int buffersize = musly_track_binsize(mj);
-#ifdef _OPENMP
-        // collect all file names in a vector first
-        std::vector<std::string> files;
-        do {
-            files.push_back(afile);
-        } while (fi.get_nextfilename(afile));
-        #pragma omp parallel if (files.size() > 1)
-#endif
-        {
-        unsigned char* buffer =
-                new unsigned char[buffersize];
-        musly_track* mt = musly_track_alloc(mj);
-#ifdef _OPENMP
-        // do a parallel for loop over the collected file names
-        // use a dynamic schedule because computation may differ per file
-        #pragma omp for schedule(dynamic)
-        for (int i = 0; i < (int)files.size(); i++) {
-            // set file to files[i] for the loop body
-            std::string& file = files[i];
-#else
-        // do a while loop over the fileiterator
+        // analyze the files in batches, so we do not need to keep the
+        // tracks of all files in memory
+        const int batchsize = 256;
+        tracks_add_batch batch;
+        batch.cf = &cf;
+        batch.buffersize = musly_track_binsize(mj);
+        batch.buffer = new unsigned char[batch.buffersize];
+        batch.tracks.resize(batchsize);
+        for (int i = 0; i < batchsize; i++) {
+            batch.tracks[i] = musly_track_alloc(mj);
+        }
+        std::vector<const char*> filenames;
+
         int i = 0;
-        do {
-            // set file to our existing afile for the loop body
-            std::string& file = afile;
-#endif
-            if (cf.contains_track(file)) {
-#ifdef _OPENMP
-                #pragma omp critical
-#endif
-                {
-                std::cout << "Skipping already analyzed [" << i+1 << "]: "
-                        << limit_string(file, 60) << std::endl;
-                }  // pragma omp critical
-                continue;
-            }
-#ifndef _OPENMP
-            std::cout << "Analyzing [" << i+1 << "]: "
-                    << limit_string(file, 60) << std::flush;
-#endif
-            int ret = musly_track_analyze_audiofile(mj, file.c_str(), 30, -48, mt);
-#ifdef _OPENMP
-            #pragma omp critical
-            {
-            std::cout << "Analyzing [" << i+1 << "]: "
-                    << limit_string(file, 60);
-#endif
-            if (ret == 0) {
-                int serialized_buffersize =
-                        musly_track_tobin(mj, mt, buffer);
-                if (serialized_buffersize == buffersize) {
-                    cf.append_track(file, buffer, buffersize);
-                    std::cout << " - [OK]" << std::endl;
+        bool more = true;
+        while (more) {
+            batch.files.clear();
+            batch.numbers.clear();
+            while (more && ((int)batch.files.size() < batchsize)) {
+                i++;
+                if (cf.contains_track(afile)) {
+                    std::cout << "Skipping already analyzed [" << i << "]: "
+                            << limit_string(afile, 60) << std::endl;
                 } else {
-                    std::cout << " - [FAILED]." << std::endl;
+                    batch.files.push_back(afile);
+                    batch.numbers.push_back(i);
                 }
+                more = fi.get_nextfilename(afile);
+            }
 
-            } else {
-                std::cout << " - [FAILED]." << std::endl;
+            filenames.resize(batch.files.size());
+            for (int j = 0; j < (int)batch.files.size(); j++) {
+                filenames[j] = batch.files[j].c_str();
             }
-#ifdef _OPENMP
-            }  // pragma omp critical
-        }  // for loop
-#else
-            i++;
-        } while (fi.get_nextfilename(afile));
-#endif
-        delete[] buffer;
-        musly_track_free(mt);
-        }  // pragma omp parallel
+            musly_track_analyze_audiofiles(mj, filenames.data(),
+                    filenames.size(), 30, -48, batch.tracks.data(), 0,
+                    tracks_add_finished, &batch);
+        }
+
+        delete[] batch.buffer;
+        for (int j = 0; j < batchsize; j++) {
+            musly_track_free(batch.tracks[j]);
+        }
     }
 }
 
@@ -308,18 +312,24 @@ write_mirex_full(
         alltrackids[i] = i;
     }
 
+    // compute the matrix in batches of rows
+    const int batchsize = 32;
+    const int num_tracks = tracks.size();
+
 #ifdef _OPENMP
     #pragma omp parallel
     {
 #endif
-    std::vector<float> similarities(tracks.size());
+    std::vector<float> similarities((size_t)batchsize * num_tracks);
 #ifdef _OPENMP
     #pragma omp for schedule(static) ordered
 #endif
-    for (int i = 0; i < (int)tracks.size(); i++) {
-        int ret = musly_jukebox_similarity(mj, tracks[i], i,
+    for (int b = 0; b < num_tracks; b += batchsize) {
+        int num_seeds = std::min(batchsize, num_tracks - b);
+        int ret = musly_jukebox_similarity_batch(mj, &tracks[b],
+                &alltrackids[b], num_seeds,
                 tracks.data(), alltrackids.data(),
-                tracks.size(), similarities.data());
+                num_tracks, similarities.data());
         if (ret != 0) {
             fill(similarities.begin(), similarities.end(),
                     std::numeric_limits<float>::max());
@@ -330,11 +340,13 @@ write_mirex_full(
         {
 #endif
         // write to file
-        f << i+1;
-        for (int j = 0; j < (int)similarities.size(); j++) {
-            f << '\t' << similarities[j];
+        for (int i = 0; i < num_seeds; i++) {
+            f << b+i+1;
+            for (int j = 0; j < num_tracks; j++) {
+                f << '\t' << similarities[(size_t)i*num_tracks + j];
+            }
+            f << std::endl;
         }
-        f << std::endl;
 #ifdef _OPENMP
         }  // pragma omp ordered
 #endif
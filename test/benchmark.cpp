@@ -0,0 +1,197 @@
+/*
+ * Copyright 2014, Jan Schlueter <jan.schlueter@ofai.at>
+ *
+ * This file is part of Musly, a program for high performance music
+ * similarity computation: http://www.musly.org/.
+ *
+ * This Source Code Form is subject to the terms of the Mozilla
+ * Public License v. 2.0. If a copy of the MPL was not distributed
+ * with this file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+#include <iostream>
+#include <iomanip>
+#include <cstdlib>
+#include <ctime>
+#include <vector>
+#include <algorithm>
+#include <Eigen/Core>
+#include <Eigen/SparseCore>
+
+#include "musly/musly.h"
+#include "melspectrum.h"
+
+/** poor man's benchmark framework: runs a function until it took at least
+ * a tenth of a second, and returns the CPU time per call in milliseconds
+ */
+template <typename F>
+double time_ms(F& f) {
+    int runs = 0;
+    std::clock_t start = std::clock();
+    std::clock_t elapsed;
+    do {
+        f();
+        runs++;
+        elapsed = std::clock() - start;
+    } while (elapsed < CLOCKS_PER_SEC / 10);
+    return 1000.0 * elapsed / CLOCKS_PER_SEC / runs;
+}
+
+
+/** The bounded max-heap musly_findmin() used for all inputs before it chose
+ * between a heap and std::nth_element() by input size.
+ */
+struct heap_findmin {
+    const std::vector<float>& values;
+    int min_count;
+    bool ordered;
+    std::vector<std::pair<float, musly_trackid> > heap;
+
+    heap_findmin(const std::vector<float>& values, int min_count, bool ordered) :
+            values(values), min_count(min_count), ordered(ordered) {
+    }
+
+    void operator()() {
+        heap.clear();
+        for (int i = 0; i < min_count; i++) {
+            heap.push_back(std::make_pair(values[i], (musly_trackid)i));
+            std::push_heap(heap.begin(), heap.end());
+        }
+        for (int i = min_count; i < (int)values.size(); i++) {
+            if (values[i] < heap.front().first) {
+                std::pop_heap(heap.begin(), heap.end());
+                heap.back() = std::make_pair(values[i], (musly_trackid)i);
+                std::push_heap(heap.begin(), heap.end());
+            }
+        }
+        if (ordered) {
+            std::sort_heap(heap.begin(), heap.end());
+        }
+    }
+};
+
+struct musly_findmin_call {
+    const std::vector<float>& values;
+    int min_count;
+    bool ordered;
+    std::vector<float> min_values;
+    std::vector<musly_trackid> min_ids;
+
+    musly_findmin_call(const std::vector<float>& values, int min_count, bool ordered) :
+            values(values), min_count(min_count), ordered(ordered),
+            min_values(min_count), min_ids(min_count) {
+    }
+
+    void operator()() {
+        musly_findmin(&values[0], NULL, values.size(), &min_values[0],
+                &min_ids[0], min_count, ordered);
+    }
+};
+
+void benchmark_findmin() {
+    std::cout << "Benchmarking musly_findmin() on uniform random floats, "
+            << "time per call in ms" << std::endl;
+    std::cout << std::setw(8) << "count" << std::setw(10) << "min_count"
+            << std::setw(9) << "ordered" << std::setw(12) << "heap"
+            << std::setw(12) << "findmin" << std::endl;
+    srand(42);
+    for (int count = 1000; count <= 1000000; count *= 10) {
+        std::vector<float> values(count);
+        for (int i = 0; i < count; i++) {
+            values[i] = rand() / (float)RAND_MAX;
+        }
+        // min_count/count from 1/count to 1/4, in steps of 4, to show where
+        // the selection strategy changes
+        for (int min_count = 1; min_count <= count / 4; min_count *= 4) {
+            for (int ordered = 0; ordered < 2; ordered++) {
+                heap_findmin heap(values, min_count, ordered != 0);
+                musly_findmin_call findmin(values, min_count, ordered != 0);
+                std::cout << std::setw(8) << count << std::setw(10) << min_count
+                        << std::setw(9) << ordered << std::fixed
+                        << std::setprecision(4) << std::setw(12) << time_ms(heap)
+                        << std::setw(12) << time_ms(findmin) << std::endl;
+            }
+        }
+    }
+}
+
+
+/** Applies the mel filterbank as a sparse matrix to one frame at a time, as
+ * melspectrum did before it applied dense bands to all frames at once.
+ */
+struct sparse_melspectrum {
+    const Eigen::SparseMatrix<float>& filterbank;
+    const Eigen::MatrixXf& ps;
+    Eigen::MatrixXf mels;
+
+    sparse_melspectrum(const Eigen::SparseMatrix<float>& filterbank, const Eigen::MatrixXf& ps) :
+            filterbank(filterbank), ps(ps), mels(filterbank.rows(), ps.cols()) {
+    }
+
+    void operator()() {
+        for (int i = 0; i < ps.cols(); i++) {
+            mels.col(i) = filterbank * ps.col(i);
+        }
+    }
+};
+
+struct banded_melspectrum {
+    musly::melspectrum& mel;
+    const Eigen::MatrixXf& ps;
+    Eigen::MatrixXf mels;
+
+    banded_melspectrum(musly::melspectrum& mel, const Eigen::MatrixXf& ps) :
+            mel(mel), ps(ps) {
+    }
+
+    void operator()() {
+        mels = mel.from_powerspectrum(ps);
+    }
+};
+
+void benchmark_melspectrum() {
+    // the configuration of the timbre method: 513 powerspectrum bins to 36
+    // mel bins at 22050 Hz, 2583 frames for a 60 s excerpt
+    const int ps_bins = 513;
+    const int mel_bins = 36;
+    const int frames = 2583;
+    musly::melspectrum mel(ps_bins, mel_bins, 22050);
+
+    // the sparse filterbank has the same weights as the dense bands
+    Eigen::MatrixXf identity = Eigen::MatrixXf::Identity(ps_bins, ps_bins);
+    Eigen::SparseMatrix<float> filterbank =
+            mel.from_powerspectrum(identity).sparseView();
+
+    std::cout << "Benchmarking melspectrum on random spectra, time per "
+            << frames << " frames in ms" << std::endl;
+    std::cout << std::setw(16) << "frames per call" << std::setw(12) << "sparse"
+            << std::setw(12) << "banded" << std::endl;
+    srand(42);
+    Eigen::MatrixXf ps = Eigen::MatrixXf::Random(ps_bins, frames).cwiseAbs();
+    // all frames at once, and in blocks as gaussian_analysis passes them
+    const int block_sizes[2] = {frames, 16};
+    for (int b = 0; b < 2; b++) {
+        Eigen::MatrixXf block = ps.leftCols(block_sizes[b]);
+        sparse_melspectrum sparse(filterbank, block);
+        banded_melspectrum banded(mel, block);
+        double scale = frames / (double)block_sizes[b];
+        std::cout << std::setw(16) << block_sizes[b] << std::fixed
+                << std::setprecision(3) << std::setw(12)
+                << time_ms(sparse) * scale << std::setw(12)
+                << time_ms(banded) * scale << std::endl;
+        sparse();
+        banded();
+        std::cout << "  max difference: " << std::scientific
+                << (sparse.mels - banded.mels).cwiseAbs().maxCoeff()
+                << ", output peak: " << banded.mels.cwiseAbs().maxCoeff()
+                << std::endl;
+    }
+}
+
+
+int main() {
+    // Benchmarks of components, single threaded; run a Release build
+    benchmark_findmin();
+    benchmark_melspectrum();
+    return 0;
+}
@@ -13,6 +13,7 @@
 #include <iostream>
 #include <cstdlib>
 #include <cstdio>
+#include <cstring>
 #include <ctime>
 #include <cmath>
 #include <vector>
@@ -21,12 +22,21 @@
 #if defined(WIN32) || defined(_WIN32) || defined(__WIN32)
 #define WIN32_LEAN_AND_MEAN
 #include <windows.h>
+#else
+#include <unistd.h>
+#include <sched.h>
 #endif
 
 #define MUSLY_SUPPORT_STDIO
 #include "musly/musly.h"
 #include "tools.h"
 #include "idpool.h"
+#include "gaussianstatistics.h"
+#include "resampler.h"
+#include "pivotindex.h"
+#include "rwlock.h"
+#include "workers.h"
+#include "decoders/sampleconversion.h"
 
 /** poor man's test framework */
 int FAILED = 0;
@@ -87,7 +97,7 @@ void test_unordered_idpool() {
 
 
 void check_ordered_idpool_mapping(musly::ordered_idpool<int>& pool) {
-    REQUIRE( "size consistency", pool.get_size() == (int) pool.posmap().size() );
+    REQUIRE( "size consistency", pool.get_size() == pool.get_mapped_count() );
     REQUIRE( "size consistency", pool.get_size() == (int) pool.idlist().size() );
     for (int i = 0; i < pool.get_size(); i++) {
         REQUIRE( "mapping consistency", pool.position_of(pool.idlist()[i]) == i );
@@ -170,6 +180,85 @@ void test_ordered_idpool() {
     REQUIRE( "generated 13", generate_more[0] == 13 );
     REQUIRE( "position 13", pool.position_of(13) == 8 );
     check_ordered_idpool_mapping(pool);
+
+    int add_sparse[] = {-5, 1000000, 2000, 14};
+    count = pool.add_ids(add_sparse, 4);
+    REQUIRE( "added sparse", pool.get_size() == 13 );
+    REQUIRE( "added 4", count == 4 );
+    REQUIRE( "position -5", pool.position_of(-5) == 9 );
+    REQUIRE( "position 1000000", pool.position_of(1000000) == 10 );
+    REQUIRE( "position 2000", pool.position_of(2000) == 11 );
+    REQUIRE( "position 14", pool.position_of(14) == 12 );
+    REQUIRE( "position of unknown", pool.position_of(1999) == -1 );
+    check_ordered_idpool_mapping(pool);
+
+    int lookup[] = {13, -5, 1000000, 4, 2000};
+    int positions[5];
+    count = pool.positions_of(lookup, 5, positions);
+    REQUIRE( "looked up 4", count == 4 );
+    REQUIRE( "looked up 13", positions[0] == 8 );
+    REQUIRE( "looked up -5", positions[1] == 9 );
+    REQUIRE( "looked up 1000000", positions[2] == 10 );
+    REQUIRE( "looked up unknown", positions[3] == -1 );
+    REQUIRE( "looked up 2000", positions[4] == 11 );
+
+    // adding many ids extends the direct lookup over the sparse id 2000
+    std::vector<int> add_dense;
+    for (int id = 15; id < 1500; id++) {
+        add_dense.push_back(id);
+    }
+    count = pool.add_ids(&add_dense[0], add_dense.size());
+    REQUIRE( "added dense", count == (int) add_dense.size() );
+    REQUIRE( "position 2000", pool.position_of(2000) == 11 );
+    REQUIRE( "position 1499", pool.position_of(1499) == pool.get_size() - 1 );
+    check_ordered_idpool_mapping(pool);
+
+    int remove_sparse[] = {2000, -5, 1000000};
+    count = pool.remove_ids(remove_sparse, 3);
+    REQUIRE( "removed sparse", count == 3 );
+    REQUIRE( "position of removed", pool.position_of(2000) == -1 );
+    check_ordered_idpool_mapping(pool);
+
+    // removing ids lazily leaves tombstones at their positions
+    int size = pool.get_size();
+    int position_of_20 = pool.position_of(20);
+    int last = pool.get_slotcount() - 1;
+    int tombstone_some[] = {0, pool[last], 5000, 0};
+    count = pool.tombstone_ids(tombstone_some, 4);
+    REQUIRE( "tombstoned 2", count == 2 );
+    REQUIRE( "tombstoned some", pool.get_size() == size - 2 );
+    REQUIRE( "tombstone count 2", pool.get_tombstonecount() == 2 );
+    REQUIRE( "slot count", pool.get_slotcount() == size );
+    REQUIRE( "position of tombstoned", pool.position_of(0) == -1 );
+    REQUIRE( "tombstone at end", pool.is_tombstone(last) );
+    REQUIRE( "position 20 unchanged", pool.position_of(20) == position_of_20 );
+    REQUIRE( "nth position", pool.nth_position(0) == 1 );
+    REQUIRE( "mapped count", pool.get_mapped_count() == pool.get_size() );
+
+    // ids are added and moved around tombstones
+    int add_around[] = {20, 0};
+    count = pool.add_ids(add_around, 2);
+    REQUIRE( "added around tombstones", count == 1 );
+    REQUIRE( "position 20", pool.position_of(20) == pool.get_slotcount() - 2 );
+    REQUIRE( "position 0", pool.position_of(0) == pool.get_slotcount() - 1 );
+    REQUIRE( "tombstone count 2", pool.get_tombstonecount() == 2 );
+    REQUIRE( "tombstone moved", pool.is_tombstone(position_of_20) );
+
+    // compacting keeps the order of the remaining ids
+    std::vector<int> remaining;
+    bool nth_consistent = true;
+    for (int i = 0; i < pool.get_slotcount(); i++) {
+        if (!pool.is_tombstone(i)) {
+            nth_consistent &= (pool.nth_position(remaining.size()) == i);
+            remaining.push_back(pool[i]);
+        }
+    }
+    REQUIRE( "nth position consistency", nth_consistent );
+    REQUIRE( "nth position beyond size", pool.nth_position(pool.get_size()) == -1 );
+    pool.compact();
+    REQUIRE( "compacted", pool.get_tombstonecount() == 0 );
+    REQUIRE( "compacted order", (pool.idlist().size() == remaining.size()) && std::equal(remaining.begin(), remaining.end(), pool.idlist().data()) );
+    check_ordered_idpool_mapping(pool);
 }
 
 
@@ -210,8 +299,425 @@ void test_findmin() {
         REQUIRE( "findmin correct", min_values[i] == true_min_values[i] );
         REQUIRE( "findmin correct", min_ids[i] == true_min_idxs[i] );
     }
+
+    // We check larger lists with ties and NaN values for all selection
+    // strategies: NaN values come last, and ties are ordered by position
+    // (which are the ids if none are given)
+    const int count = 1000;
+    std::vector<float> many_values(count);
+    srand(42);
+    for (int i = 0; i < count; i++) {
+        many_values[i] = (i % 97 == 0) ? NAN : (float)(rand() % 200);
+    }
+    std::vector<std::pair<float, int> > sorted_values;
+    for (int i = 0; i < count; i++) {
+        if (!std::isnan(many_values[i])) {
+            sorted_values.push_back(std::make_pair(many_values[i], i));
+        }
+    }
+    std::sort(sorted_values.begin(), sorted_values.end());
+    for (int i = 0; i < count; i++) {
+        if (std::isnan(many_values[i])) {
+            sorted_values.push_back(std::make_pair(many_values[i], i));
+        }
+    }
+    const int min_counts[6] = {1, 10, 31, 32, 990, 1000};
+    std::vector<float> many_min_values(count);
+    std::vector<musly_trackid> many_min_ids(count);
+    for (int c = 0; c < 6; c++) {
+        int min_count = min_counts[c];
+        REQUIRE( "findmin(many_values, NULL, min_values, min_ids, true)", musly_findmin(&many_values[0], NULL, count, &many_min_values[0], &many_min_ids[0], min_count, true) == min_count );
+        for (int i = 0; i < min_count; i++) {
+            REQUIRE( "findmin correct", many_min_ids[i] == sorted_values[i].second );
+        }
+        REQUIRE( "findmin(many_values, NULL, NULL, min_ids, false)", musly_findmin(&many_values[0], NULL, count, NULL, &many_min_ids[0], min_count, false) == min_count );
+        std::sort(many_min_ids.begin(), many_min_ids.begin() + min_count);
+        std::vector<musly_trackid> true_ids(min_count);
+        for (int i = 0; i < min_count; i++) {
+            true_ids[i] = sorted_values[i].second;
+        }
+        std::sort(true_ids.begin(), true_ids.end());
+        for (int i = 0; i < min_count; i++) {
+            REQUIRE( "findmin correct", many_min_ids[i] == true_ids[i] );
+        }
+    }
+
+    // with ids given, ties are ordered by id like in musly_jukebox_topk()
+    std::vector<musly_trackid> many_ids(count);
+    std::vector<std::pair<float, musly_trackid> > sorted_by_id;
+    for (int i = 0; i < count; i++) {
+        many_ids[i] = count - 1 - i;
+        if (!std::isnan(many_values[i])) {
+            sorted_by_id.push_back(std::make_pair(many_values[i], many_ids[i]));
+        }
+    }
+    std::sort(sorted_by_id.begin(), sorted_by_id.end());
+    for (int c = 0; c < 4; c++) {
+        int min_count = min_counts[c];
+        REQUIRE( "findmin(many_values, many_ids, min_values, min_ids, true)", musly_findmin(&many_values[0], &many_ids[0], count, &many_min_values[0], &many_min_ids[0], min_count, true) == min_count );
+        for (int i = 0; i < min_count; i++) {
+            REQUIRE( "findmin orders ties by id", many_min_ids[i] == sorted_by_id[i].second );
+        }
+    }
+}
+
+void test_gaussian_statistics() {
+    std::cout << "Testing component \"gaussian_statistics\"..." << std::endl;
+
+    // We estimate random Gaussians, laid out as a track store does: each
+    // field row holds the values of all Gaussians, at a stride larger than
+    // their number. The count is not a multiple of the lanes, so the last
+    // tile is only partially filled.
+    const int d = 20;
+    musly::gaussian_statistics gs(d);
+    const int covar_elems = gs.get_covarelems();
+    const int offs_mu = 0;
+    const int offs_covar = offs_mu + d;
+    const int offs_covar_inverse = offs_covar + covar_elems;
+    const int offs_covar_logdet = offs_covar_inverse + covar_elems;
+    const int size = offs_covar_logdet + 1;
+    const int count = 37;
+    const int stride = 40;
+    const int lanes = musly::gaussian_statistics::lanes;
+    std::vector<float> models((count + 1) * size);
+    std::vector<float> rows(size * stride);
+    std::vector<gaussian> g(count + 1);
+    Eigen::MatrixXf samples(d, 200);
+    srand(7);
+    for (int t = 0; t <= count; t++) {
+        float* model = &models[t * size];
+        g[t].mu = model + offs_mu;
+        g[t].covar = model + offs_covar;
+        g[t].covar_inverse = model + offs_covar_inverse;
+        g[t].covar_logdet = model + offs_covar_logdet;
+        for (int j = 0; j < samples.cols(); j++) {
+            for (int i = 0; i < d; i++) {
+                samples(i, j) = (rand() / (float)RAND_MAX - 0.5f) *
+                        (1 + (i + t) % 5) + (i * t) % 3;
+            }
+        }
+        REQUIRE( "estimated gaussian", gs.estimate_gaussian(samples, g[t]) );
+    }
+    for (int t = 0; t < count; t++) {
+        for (int e = 0; e < size; e++) {
+            rows[e * stride + t] = models[t * size + e];
+        }
+    }
+    // the seed is a copy of the fourth Gaussian, kept apart, so the scalar
+    // functions do not detect it to be identical
+    std::copy(&models[3 * size], &models[4 * size], &models[count * size]);
+    const gaussian& g0 = g[count];
+    // the scalar functions use either the covariance or its inverse as
+    // temporary, never both
+    std::vector<float> tmp_buffer(d + covar_elems);
+    gaussian tmp;
+    tmp.mu = &tmp_buffer[0];
+    tmp.covar = &tmp_buffer[d];
+    tmp.covar_inverse = &tmp_buffer[d];
+    tmp.covar_logdet = NULL;
+    std::vector<float> tmp_lanes(gs.get_lanes_tmpsize());
+    std::vector<float> tile(size * lanes);
+    std::vector<int> positions(lanes);
+    float result[lanes];
+
+    // We check whether jensenshannon_lanes() matches jensenshannon(), both
+    // reading the rows directly and reading a gathered tile
+    std::vector<float> jsd(count);
+    for (int t = 0; t < count; t++) {
+        jsd[t] = gs.jensenshannon(g0, g[t], tmp);
+    }
+    REQUIRE( "jensenshannon of identical copies", jsd[3] < 1e-3f );
+    float max_error = 0;
+    for (int i = 0; i < count; i += lanes) {
+        int n = std::min(lanes, count - i);
+        gs.jensenshannon_lanes(g0, &rows[offs_mu * stride + i],
+                &rows[offs_covar * stride + i],
+                &rows[offs_covar_logdet * stride + i], stride,
+                &tmp_lanes[0], result);
+        for (int l = 0; l < n; l++) {
+            max_error = std::max(max_error, std::abs(result[l] - jsd[i + l]) / (1 + jsd[i + l]));
+        }
+        // gather in reverse order, with the unused lanes repeating the first
+        for (int l = 0; l < lanes; l++) {
+            positions[l] = count - 1 - i - ((l < n) ? l : 0);
+            for (int e = 0; e < size; e++) {
+                tile[e * lanes + l] = rows[e * stride + positions[l]];
+            }
+        }
+        gs.jensenshannon_lanes(g0, &tile[offs_mu * lanes],
+                &tile[offs_covar * lanes], &tile[offs_covar_logdet * lanes],
+                lanes, &tmp_lanes[0], result);
+        for (int l = 0; l < n; l++) {
+            max_error = std::max(max_error, std::abs(result[l] - jsd[positions[l]]) / (1 + jsd[positions[l]]));
+        }
+    }
+    REQUIRE( "jensenshannon_lanes matches jensenshannon", max_error < 1e-4f );
+
+    // We check symmetric_kullbackleibler_lanes() the same way
+    std::vector<float> skld(count);
+    for (int t = 0; t < count; t++) {
+        skld[t] = gs.symmetric_kullbackleibler(g0, g[t], tmp);
+    }
+    REQUIRE( "symmetric_kullbackleibler of identical copies", skld[3] < 1e-3f );
+    max_error = 0;
+    for (int i = 0; i < count; i += lanes) {
+        int n = std::min(lanes, count - i);
+        gs.symmetric_kullbackleibler_lanes(g0, &rows[offs_mu * stride + i],
+                &rows[offs_covar * stride + i],
+                &rows[offs_covar_inverse * stride + i], stride,
+                &tmp_lanes[0], result);
+        for (int l = 0; l < n; l++) {
+            max_error = std::max(max_error, std::abs(result[l] - skld[i + l]) / (1 + skld[i + l]));
+        }
+        for (int l = 0; l < lanes; l++) {
+            positions[l] = count - 1 - i - ((l < n) ? l : 0);
+            for (int e = 0; e < size; e++) {
+                tile[e * lanes + l] = rows[e * stride + positions[l]];
+            }
+        }
+        gs.symmetric_kullbackleibler_lanes(g0, &tile[offs_mu * lanes],
+                &tile[offs_covar * lanes], &tile[offs_covar_inverse * lanes],
+                lanes, &tmp_lanes[0], result);
+        for (int l = 0; l < n; l++) {
+            max_error = std::max(max_error, std::abs(result[l] - skld[positions[l]]) / (1 + skld[positions[l]]));
+        }
+    }
+    REQUIRE( "symmetric_kullbackleibler_lanes matches symmetric_kullbackleibler", max_error < 1e-4f );
+}
+
+/** Converts a sample to float like the libav decoder did before it
+ * converted and downmixed in a single pass.
+ */
+float old_tofloat(uint8_t s) { return (s - 0x80)*(1.0 / (1<<7)); }
+float old_tofloat(int16_t s) { return s*(1.0 / (1<<15)); }
+float old_tofloat(int32_t s) { return s*(1.0 / (1U<<31)); }
+float old_tofloat(float s) { return s; }
+float old_tofloat(double s) { return s; }
+
+/** Checks convert_tomono() against the former two passes for samples of
+ * type T: converting the packed or planar samples to interleaved floats,
+ * and downmixing these in place.
+ */
+template <typename T>
+void test_convert_tomono(const char* name) {
+    const int len = 1001;
+    std::vector<T> packed(2 * len);
+    std::vector<T> left(len);
+    std::vector<T> right(len);
+    for (int i = 0; i < 2 * len; i++) {
+        // random bit patterns for integers, values in [-1, 1] for floats
+        unsigned int r = ((unsigned int)rand() << 16) ^ (unsigned int)rand();
+        if ((T)0.5 != 0) {
+            packed[i] = (T)(rand() / (double)RAND_MAX * 2 - 1);
+        } else {
+            packed[i] = (T)r;
+        }
+        ((i % 2) ? right : left)[i / 2] = packed[i];
+    }
+
+    std::vector<float> buffer(2 * len);
+    for (int i = 0; i < 2 * len; i++) {
+        buffer[i] = old_tofloat(packed[i]);
+    }
+    std::vector<float> mono(buffer.begin(), buffer.begin() + len);
+    for (int i = 0; i < len; i++) {
+        buffer[i] = (buffer[i*2] + buffer[i*2+1]) / 2.0f;
+    }
+
+    std::vector<float> out(len);
+    const uint8_t* packed_data[1] = {reinterpret_cast<const uint8_t*>(&packed[0])};
+    const uint8_t* planar_data[2] = {reinterpret_cast<const uint8_t*>(&left[0]),
+            reinterpret_cast<const uint8_t*>(&right[0])};
+    std::string msg = std::string("converted ") + name;
+    musly::decoders::convert_tomono<T>(&out[0], packed_data, false, 1, len);
+    REQUIRE( (msg + " mono").c_str(), std::equal(out.begin(), out.end(), mono.begin()) );
+    musly::decoders::convert_tomono<T>(&out[0], packed_data, false, 2, len);
+    REQUIRE( (msg + " packed stereo").c_str(), std::equal(out.begin(), out.end(), buffer.begin()) );
+    musly::decoders::convert_tomono<T>(&out[0], planar_data, true, 2, len);
+    REQUIRE( (msg + " planar stereo").c_str(), std::equal(out.begin(), out.end(), buffer.begin()) );
+}
+
+void test_sampleconversion() {
+    std::cout << "Testing component \"sampleconversion\"..." << std::endl;
+    srand(11);
+    test_convert_tomono<uint8_t>("U8");
+    test_convert_tomono<int16_t>("S16");
+    test_convert_tomono<int32_t>("S32");
+    test_convert_tomono<float>("FLT");
+    test_convert_tomono<double>("DBL");
+}
+
+/** Resamples a signal with libresample alone, as musly did for all rates
+ * before it had a polyphase filter.
+ */
+std::vector<float> libresample_reference(const std::vector<float>& pcm, double factor) {
+    void* handle = resample_open(1, factor, factor);
+    std::vector<float> out(pcm.size() * factor + 1000);
+    int in_pos = 0;
+    int out_pos = 0;
+    while (in_pos < (int)pcm.size()) {
+        int used = 0;
+        int block_len = std::min(4096, (int)pcm.size() - in_pos);
+        out_pos += resample_process(handle, factor,
+                const_cast<float*>(&pcm[in_pos]), block_len,
+                in_pos + block_len == (int)pcm.size(), &used,
+                &out[out_pos], out.size() - out_pos);
+        in_pos += used;
+    }
+    resample_close(handle);
+    out.resize(out_pos);
+    return out;
 }
 
+void test_resampler() {
+    std::cout << "Testing component \"resampler\"..." << std::endl;
+
+    // We resample two seconds of a 1 kHz tone to 22050 Hz with the polyphase
+    // filter and compare it to libresample, away from the edges
+    const int rates[2] = {44100, 48000};
+    for (int r = 0; r < 2; r++) {
+        std::vector<float> tone(2 * rates[r]);
+        for (int i = 0; i < (int)tone.size(); i++) {
+            tone[i] = 0.5f * std::sin(2 * M_PI * 1000 * i / rates[r]);
+        }
+        musly::resampler rs(rates[r], 22050);
+        std::vector<float> out;
+        rs.resample(&tone[0], tone.size(), out);
+        REQUIRE( "resampled length", out.size() == 2 * 22050 );
+        std::vector<float> ref = libresample_reference(tone, 22050.0 / rates[r]);
+        REQUIRE( "libresample length", std::abs((int)ref.size() - (int)out.size()) <= 1 );
+        double error = 0;
+        int count = 0;
+        for (int i = 500; i < (int)std::min(out.size(), ref.size()) - 500; i++) {
+            error += (out[i] - ref[i]) * (out[i] - ref[i]);
+            count++;
+        }
+        // the tone has an RMS of 0.35, the difference must be 60 dB below
+        REQUIRE( "resampled like libresample", std::sqrt(error / count) < 2e-4 );
+    }
+}
+
+
+float euclidean(const std::vector<float>& points, int dim, int a, int b) {
+    float dist = 0;
+    for (int d = 0; d < dim; d++) {
+        float diff = points[a*dim + d] - points[b*dim + d];
+        dist += diff * diff;
+    }
+    return std::sqrt(dist);
+}
+
+void test_pivotindex() {
+    std::cout << "Testing component \"pivotindex\"..." << std::endl;
+
+    // We index 4000 points from 40 clusters in 8 dimensions by their
+    // euclidean distances to the first 16 points, as the timbre method does
+    // for its tracks and mutual proximity tracks
+    const int count = 4000;
+    const int dim = 8;
+    const int pivots = 16;
+    srand(42);
+    std::vector<float> centers(40 * dim);
+    for (int i = 0; i < (int)centers.size(); i++) {
+        centers[i] = rand() / (float)RAND_MAX;
+    }
+    std::vector<float> points(count * dim);
+    for (int i = 0; i < count; i++) {
+        int c = rand() % 40;
+        for (int d = 0; d < dim; d++) {
+            points[i*dim + d] = centers[c*dim + d] +
+                    0.1f * (rand() / (float)RAND_MAX - 0.5f);
+        }
+    }
+    musly::ordered_idpool<musly_trackid> pool;
+    std::vector<musly_trackid> ids(count);
+    pool.generate_ids(&ids[0], count);
+    // one index gets all points at once, the other one at a time
+    musly::pivotindex batch(pivots, 4);
+    musly::pivotindex single(pivots, 4);
+    batch.set_pivotcount(pivots);
+    single.set_pivotcount(pivots);
+    REQUIRE( "pivot count", batch.get_pivotcount() == pivots );
+    batch.append(count);
+    single.append(count);
+    std::vector<float> dists(pivots);
+    for (int i = 0; i < count; i++) {
+        for (int p = 0; p < pivots; p++) {
+            dists[p] = euclidean(points, dim, i, p);
+        }
+        int position = pool.position_of(ids[i]);
+        batch.set_distances(position, ids[i], &dists[0]);
+        single.set_distances(position, ids[i], &dists[0]);
+        single.commit();
+    }
+    batch.commit();
+
+    // We compare the guessed neighbors of 100 points with their exact 10
+    // nearest neighbors
+    const int k = 10;
+    const int guessed = 100;
+    int found = 0;
+    bool consistent = true;
+    for (int s = 0; s < 100; s++) {
+        int seed = pivots + s * 37;
+        std::vector<std::pair<float, musly_trackid> > exact;
+        for (int i = 0; i < count; i++) {
+            if (i != seed) {
+                exact.push_back(std::make_pair(euclidean(points, dim, seed, i), ids[i]));
+            }
+        }
+        std::partial_sort(exact.begin(), exact.begin() + k, exact.end());
+        musly_trackid neighbors[guessed];
+        musly_trackid neighbors2[guessed];
+        int num = batch.neighbors(pool.position_of(ids[seed]), ids[seed], pool,
+                neighbors, guessed, NULL, 0);
+        REQUIRE( "guessed neighbors", num == guessed );
+        consistent &= single.neighbors(pool.position_of(ids[seed]), ids[seed],
+                pool, neighbors2, guessed, NULL, 0) == num;
+        consistent &= std::equal(neighbors, neighbors + num, neighbors2);
+        for (int i = 0; i < k; i++) {
+            found += std::count(neighbors, neighbors + num, exact[i].second);
+        }
+    }
+    REQUIRE( "same neighbors when adding one at a time", consistent );
+    REQUIRE( "recall of the nearest neighbors", found >= 0.9 * 100 * k );
+}
+
+/** Counts the indices of a work_queue handed to each worker.
+ */
+class counting_task : public musly::worker_task {
+public:
+    counting_task(int num_workers, int count) :
+            runs(num_workers, 0), hits(count, 0), queue(count) {
+    }
+
+    virtual void run(int worker) {
+        runs[worker]++;
+        int i;
+        while (queue.next(i)) {
+            hits[i]++;
+        }
+    }
+
+    std::vector<int> runs;
+    std::vector<int> hits;
+    musly::work_queue queue;
+};
+
+void test_workers() {
+    std::cout << "Testing component \"workers\"..." << std::endl;
+
+    REQUIRE( "hardware threads", musly::hardware_threads() >= 1 );
+
+    // every worker runs once, and every index is handed out once
+    const int num_workers[3] = {1, 4, 16};
+    for (int n = 0; n < 3; n++) {
+        counting_task task(num_workers[n], 10000);
+        musly::run_workers(task, num_workers[n]);
+        REQUIRE( "ran each worker once", std::count(task.runs.begin(), task.runs.end(), 1) == num_workers[n] );
+        REQUIRE( "handed out each index once", std::count(task.hits.begin(), task.hits.end(), 1) == 10000 );
+    }
+}
 
 void generate_music(float* out, int length, unsigned int seed = 0) {
     if (!seed) {
@@ -247,6 +753,182 @@ void generate_music(float* out, int length, unsigned int seed = 0) {
     }
 }
 
+/** Writes \p frames frames of \p channels interleaved channels as a 16-bit
+ * PCM WAV file.
+ */
+bool write_wav(const char* filename, const float* pcm, int frames, int channels, int sample_rate) {
+    const unsigned int data_size = frames * channels * 2;
+    const unsigned int fields[11] = {0x46464952, 36 + data_size, 0x45564157,
+            0x20746d66, 16, 1 | ((unsigned int)channels << 16),
+            (unsigned int)sample_rate, (unsigned int)sample_rate * channels * 2,
+            ((unsigned int)channels * 2) | (16 << 16), 0x61746164, data_size};
+    std::vector<unsigned char> bytes;
+    for (int i = 0; i < 11; i++) {
+        for (int b = 0; b < 4; b++) {
+            bytes.push_back((fields[i] >> (8 * b)) & 0xff);
+        }
+    }
+    for (int i = 0; i < frames * channels; i++) {
+        int16_t sample = (int16_t)std::floor(pcm[i] * 32767 + 0.5f);
+        bytes.push_back(sample & 0xff);
+        bytes.push_back((sample >> 8) & 0xff);
+    }
+    FILE* f = fopen(filename, "wb");
+    if (!f) {
+        return false;
+    }
+    bool written = (fwrite(&bytes[0], 1, bytes.size(), f) == bytes.size());
+    return (fclose(f) == 0) && written;
+}
+
+/** An encoded file in memory, read through read_byte_stream() only.
+ */
+struct byte_stream {
+    const std::vector<unsigned char>* bytes;
+    size_t pos;
+};
+
+int read_byte_stream(void* opaque, unsigned char* buffer, int size) {
+    byte_stream* s = reinterpret_cast<byte_stream*>(opaque);
+    // hand out small chunks, like a network stream would
+    int count = std::min(std::min(size, 1000), (int)(s->bytes->size() - s->pos));
+    std::copy(s->bytes->begin() + s->pos, s->bytes->begin() + s->pos + count, buffer);
+    s->pos += count;
+    return count;
+}
+
+/** Returns whether two tracks of a jukebox are identical.
+ */
+bool same_track(musly_jukebox* box, const musly_track* a, const musly_track* b) {
+    return std::equal(a, a + musly_track_size(box) / sizeof(float), b);
+}
+
+void count_analyzed(int index, int result, void* user_data) {
+    std::vector<int>& results = *reinterpret_cast<std::vector<int>*>(user_data);
+    // failures are reported as -1, whatever code the analysis returned
+    results[index] += (result == 0) ? 1 : ((result == -1) ? 100 : 10000);
+}
+
+int keep_even(musly_trackid trackid, void* user_data) {
+    return (trackid % 2) == 0;
+}
+
+/** A counter shared by the threads of a test.
+ */
+class shared_counter {
+public:
+    shared_counter() : value(0) {
+    }
+
+    void add() {
+        musly::write_guard guard(lock);
+        value++;
+    }
+
+    int get() {
+        musly::read_guard guard(lock);
+        return value;
+    }
+
+private:
+    musly::rwlock lock;
+    int value;
+};
+
+/** Lets other threads run while waiting for them.
+ */
+void yield_thread() {
+#if defined(WIN32) || defined(_WIN32) || defined(__WIN32)
+    Sleep(0);
+#else
+    sched_yield();
+#endif
+}
+
+/** Analyzes songs on several threads, each song with an analyzer of its own.
+ */
+class analyze_songs_task : public musly::worker_task {
+public:
+    analyze_songs_task(musly_jukebox* box, const float* songs, int length, int count, musly_track** tracks, int* ret) :
+            box(box), songs(songs), length(length), tracks(tracks), ret(ret), queue(count) {
+    }
+
+    virtual void run(int worker) {
+        int i;
+        while (queue.next(i)) {
+            musly_analyzer* analyzer = musly_analyzer_new(box);
+            if (analyzer) {
+                ret[i] = musly_analyzer_analyze_pcm(analyzer, const_cast<float*>(&songs[(size_t)length * i]), length, tracks[i]);
+                musly_analyzer_free(analyzer);
+            }
+        }
+    }
+
+private:
+    musly_jukebox* box;
+    const float* songs;
+    int length;
+    musly_track** tracks;
+    int* ret;
+    musly::work_queue queue;
+};
+
+/** Adds 50 tracks to a jukebox of 50 tracks on worker 0, while the other
+ * workers compute similarities until the tracks are added. Worker 0 only
+ * starts adding tracks once every other worker is computing similarities,
+ * so adding always has to get past running queries. The handshakes count
+ * iterations instead of measuring time: waiting for the queries gives up
+ * after max_spins, and each query worker gives up after max_queries, so a
+ * missing thread or a starved writer fails the test instead of hanging it.
+ */
+class add_while_querying_task : public musly::worker_task {
+public:
+    static const int max_spins = 1000000;
+    static const int max_queries = 100000;
+
+    add_while_querying_task(musly_jukebox* box, musly_track** tracks, musly_trackid* trackids, int num_workers) :
+            box(box), tracks(tracks), trackids(trackids), num_workers(num_workers), added(-1), querying_before(0) {
+    }
+
+    virtual void run(int worker) {
+        if (worker == 0) {
+            for (int spins = 0; (querying.get() < num_workers - 1) && (spins < max_spins); spins++) {
+                yield_thread();
+            }
+            querying_before = querying.get();
+            added = musly_jukebox_addtracks(box, &tracks[50], &trackids[50], 50, true);
+            done.add();
+            return;
+        }
+        float similarities[50];
+        for (int q = 0; !done.get(); q++) {
+            if (q == max_queries) {
+                starved.add();
+                break;
+            }
+            if (musly_jukebox_similarity(box, tracks[0], trackids[0], tracks, trackids, 50, similarities) != 0) {
+                failed.add();
+            }
+            if (q == 0) {
+                querying.add();
+            }
+        }
+    }
+
+    musly_jukebox* box;
+    musly_track** tracks;
+    musly_trackid* trackids;
+    int num_workers;
+    int added;
+
+    /** The number of query workers running when tracks were added.
+     */
+    int querying_before;
+    shared_counter querying;
+    shared_counter done;
+    shared_counter failed;
+    shared_counter starved;
+};
 
 void test_method(std::string method) {
     std::cout << "Testing method \"" << method << "\"..." << std::endl;
@@ -281,8 +963,186 @@ void test_method(std::string method) {
         generate_music(song, 22050 * 30, 42*i + 1);
         REQUIRE( "analyzed song", musly_track_analyze_pcm(box, song, 22050*30, tracks[i]) == 0);
     }
+
+    // We check whether an incremental analysis of the last song in chunks of
+    // varying size gives the same result
+    musly_track_analyzer* analyzer = musly_track_analyzer_new(box);
+    REQUIRE( "started incremental analysis", analyzer != NULL );
+    if (analyzer) {
+        for (int pos = 0, chunk = 1; pos < 22050*30; pos += chunk, chunk = chunk * 3 % 20011) {
+            REQUIRE( "pushed chunk", musly_track_analyzer_push(analyzer, song + pos, std::min(chunk, 22050*30 - pos)) == 0 );
+        }
+        musly_track* streamed = musly_track_alloc(box);
+        REQUIRE( "finished incremental analysis", musly_track_analyzer_finish(analyzer, streamed) == 0 );
+        float max_error = 0;
+        for (int i = 0; i < musly_track_size(box) / (int)sizeof(float); i++) {
+            max_error = std::max(max_error, std::abs(streamed[i] - tracks[99][i]) / (1 + std::abs(tracks[99][i])));
+        }
+        REQUIRE( "consistent incremental analysis", max_error < 1e-3f );
+        musly_track_free(streamed);
+        musly_track_analyzer_free(analyzer);
+    }
+    // We check whether analyzers created from the jukebox give the same
+    // results, also when used from several threads at once
+    std::vector<float> songs(22050 * 30 * 4);
+    for (int i = 0; i < 4; i++) {
+        generate_music(&songs[22050 * 30 * i], 22050 * 30, 42*i + 1);
+    }
+    musly_track* analyzed[4];
+    int analyzed_ret[4];
+    for (int i = 0; i < 4; i++) {
+        analyzed[i] = musly_track_alloc(box);
+        analyzed_ret[i] = -1;
+    }
+    analyze_songs_task analyze(box, &songs[0], 22050 * 30, 4, analyzed, analyzed_ret);
+    musly::run_workers(analyze, 2);
+    for (int i = 0; i < 4; i++) {
+        REQUIRE( "analyzed song with analyzer", analyzed_ret[i] == 0 );
+        bool same = true;
+        for (int j = 0; j < musly_track_size(box) / (int)sizeof(float); j++) {
+            same = same && (analyzed[i][j] == tracks[i][j]);
+        }
+        REQUIRE( "consistent analyzer results", same );
+        musly_track_free(analyzed[i]);
+    }
+#if !defined(WIN32) && !defined(_WIN32) && !defined(__WIN32)
+    // We check whether the FFT backends give the same results (the backend
+    // is selected when creating a jukebox)
+    const char* fft_backends[2] = {"kissfft", "lanes"};
+    musly_track* fft_tracks[2];
+    for (int b = 0; b < 2; b++) {
+        setenv("MUSLY_FFT", fft_backends[b], 1);
+        musly_jukebox* fft_box = musly_jukebox_poweron(method.c_str(), NULL);
+        fft_tracks[b] = musly_track_alloc(fft_box);
+        REQUIRE( "analyzed song with FFT backend", musly_track_analyze_pcm(fft_box, song, 22050*30, fft_tracks[b]) == 0 );
+        musly_jukebox_poweroff(fft_box);
+    }
+    unsetenv("MUSLY_FFT");
+    float max_fft_error = 0;
+    for (int i = 0; i < musly_track_size(box) / (int)sizeof(float); i++) {
+        max_fft_error = std::max(max_fft_error, std::abs(fft_tracks[0][i] - fft_tracks[1][i]) / (1 + std::abs(fft_tracks[0][i])));
+    }
+    REQUIRE( "consistent FFT backends", max_fft_error < 1e-3f );
+    musly_track_free(fft_tracks[0]);
+    musly_track_free(fft_tracks[1]);
+#endif
+
+    analyzer = musly_track_analyzer_new(box);
+    if (analyzer) {
+        musly_track* streamed = musly_track_alloc(box);
+        REQUIRE( "pushed short chunk", musly_track_analyzer_push(analyzer, song, 5000) == 0 );
+        REQUIRE( "rejected too short signal", musly_track_analyzer_finish(analyzer, streamed) != 0 );
+        musly_track_free(streamed);
+        musly_track_analyzer_free(analyzer);
+    }
+
+    // We check decoding audio files: decoding two files with the same codec
+    // in a row, then a file with other codec parameters (stereo at 44100 Hz)
+    // and then the first file once more must give the same results as
+    // decoding each file with a decoder of its own
+    std::vector<float> stereo(44100 * 20 * 2);
+    for (int i = 0; i < (int)stereo.size(); i++) {
+        stereo[i] = songs[i / 2] * ((i % 2) ? 0.5f : 1.0f);
+    }
+    const char* wav_files[3] = {"selftest_a.wav", "selftest_b.wav", "selftest_c.wav"};
+    REQUIRE( "wrote audio file", write_wav(wav_files[0], song, 22050*30, 1, 22050) );
+    REQUIRE( "wrote audio file", write_wav(wav_files[1], &songs[22050*30], 22050*30, 1, 22050) );
+    REQUIRE( "wrote audio file", write_wav(wav_files[2], &stereo[0], 44100*20, 2, 44100) );
+    const int decode_order[4] = {0, 1, 2, 0};
+    musly_track* decoded[4];
+    for (int i = 0; i < 4; i++) {
+        decoded[i] = musly_track_alloc(box);
+        REQUIRE( "analyzed audio file", musly_track_analyze_audiofile(box, wav_files[decode_order[i]], 0, 0, decoded[i]) == 0 );
+    }
+    REQUIRE( "consistent results decoding a file again", same_track(box, decoded[0], decoded[3]) );
+    REQUIRE( "different results for different files", !same_track(box, decoded[0], decoded[1]) );
+    for (int i = 0; i < 3; i++) {
+        musly_jukebox* fresh_box = musly_jukebox_poweron(method.c_str(), NULL);
+        musly_track* fresh = musly_track_alloc(fresh_box);
+        REQUIRE( "analyzed audio file with a new jukebox", musly_track_analyze_audiofile(fresh_box, wav_files[i], 0, 0, fresh) == 0 );
+        REQUIRE( "consistent results decoding files in a row", same_track(box, fresh, decoded[i]) );
+        musly_track_free(fresh);
+        musly_jukebox_poweroff(fresh_box);
+    }
+
+    // We check analyzing the files on several threads at once gives the same
+    // results, with each file reported once
+    const char* batch_files[4];
+    musly_track* batch_tracks[4];
+    for (int i = 0; i < 4; i++) {
+        batch_files[i] = wav_files[decode_order[i]];
+        batch_tracks[i] = musly_track_alloc(box);
+    }
+    std::vector<int> batch_results(4, 0);
+    REQUIRE( "analyzed audio files in parallel", musly_track_analyze_audiofiles(box, batch_files, 4, 0, 0, batch_tracks, 4, count_analyzed, &batch_results) == 4 );
+    for (int i = 0; i < 4; i++) {
+        REQUIRE( "reported each file once", batch_results[i] == 1 );
+        REQUIRE( "consistent results analyzing files in parallel", same_track(box, batch_tracks[i], decoded[i]) );
+        musly_track_free(batch_tracks[i]);
+    }
+
+    // A file too short to estimate a model fails with a code other than -1,
+    // which the callback gets as -1
+    std::vector<float> too_short(100, 0.1f);
+    const char* short_file = "selftest_short.wav";
+    REQUIRE( "wrote audio file", write_wav(short_file, &too_short[0], 100, 1, 22050) );
+    musly_track* short_track = musly_track_alloc(box);
+    REQUIRE( "failed to analyze too short file", musly_track_analyze_audiofile(box, short_file, 0, 0, short_track) > 0 );
+    std::vector<int> short_results(1, 0);
+    REQUIRE( "analyzed no too short files", musly_track_analyze_audiofiles(box, &short_file, 1, 0, 0, &short_track, 0, count_analyzed, &short_results) == 0 );
+    REQUIRE( "reported too short file as failed", short_results[0] == 100 );
+    musly_track_free(short_track);
+    remove(short_file);
+
+    // We check decoding the same files from memory, both seekable and
+    // through a read callback only, gives the same results as well
+    for (int i = 0; i < 3; i++) {
+        std::vector<unsigned char> bytes;
+        FILE* f = fopen(wav_files[i], "rb");
+        if (f) {
+            unsigned char chunk[65536];
+            size_t read;
+            while ((read = fread(chunk, 1, sizeof(chunk), f)) > 0) {
+                bytes.insert(bytes.end(), chunk, chunk + read);
+            }
+            fclose(f);
+        }
+        REQUIRE( "read audio file", !bytes.empty() );
+        if (bytes.empty()) {
+            continue;
+        }
+        musly_track* buffered = musly_track_alloc(box);
+        REQUIRE( "analyzed audio buffer", musly_track_analyze_audiobuffer(box, &bytes[0], bytes.size(), 0, 0, buffered) == 0 );
+        REQUIRE( "consistent results decoding a buffer", same_track(box, buffered, decoded[i]) );
+        byte_stream stream = {&bytes, 0};
+        REQUIRE( "analyzed audio stream", musly_track_analyze_audiostream(box, read_byte_stream, NULL, &stream, 0, 0, buffered) == 0 );
+        REQUIRE( "consistent results decoding a stream", same_track(box, buffered, decoded[i]) );
+        musly_track_free(buffered);
+    }
+
+    for (int i = 0; i < 4; i++) {
+        musly_track_free(decoded[i]);
+    }
+    for (int i = 0; i < 3; i++) {
+        remove(wav_files[i]);
+    }
     delete[] song;
 
+    // We check the batch analysis of audio files fails properly for missing files
+    const char* missing_files[3] = {"missing1.mp3", "missing2.mp3", "missing3.mp3"};
+    std::vector<int> results(3, 0);
+    REQUIRE( "analyzed no missing files", musly_track_analyze_audiofiles(box, missing_files, 3, 30, -48, &tracks[97], 0, count_analyzed, &results) == 0 );
+    for (int i = 0; i < 3; i++) {
+        REQUIRE( "reported each missing file once", results[i] == 100 );
+    }
+    REQUIRE( "rejected batch analysis without tracks", musly_track_analyze_audiofiles(box, missing_files, 3, 30, -48, NULL, 0, NULL, NULL) == -1 );
+
+    // We check the analysis of in-memory audio fails properly for non-audio data
+    const char not_audio[] = "this is not an audio file";
+    REQUIRE( "rejected non-audio buffer", musly_track_analyze_audiobuffer(box, not_audio, sizeof(not_audio), 30, -48, tracks[97]) == -1 );
+    REQUIRE( "rejected empty buffer", musly_track_analyze_audiobuffer(box, NULL, 0, 30, -48, tracks[97]) == -1 );
+    REQUIRE( "rejected stream without read callback", musly_track_analyze_audiostream(box, NULL, NULL, NULL, 30, -48, tracks[97]) == -1 );
+
     // We initialize the jukebox
     REQUIRE( "set music style", musly_jukebox_setmusicstyle(box, tracks, 25) == 0 );
 
@@ -314,6 +1174,9 @@ void test_method(std::string method) {
     REQUIRE( "computed similarities", musly_jukebox_similarity(box, tracks[42], trackids[42], tracks, trackids, 90, similarities) == 0 );
     num_neighbors_guessed = musly_jukebox_guessneighbors(box, trackids[30], candidates, 20);
     REQUIRE( "guessed neighbors", (num_neighbors_guessed == -1) || (num_neighbors_guessed == 20) );
+    for (int i = 0; i < num_neighbors_guessed; i++) {
+        REQUIRE( "neighbors exclude seed", candidates[i] != trackids[30] );
+    }
     num_neighbors_guessed_flt = musly_jukebox_guessneighbors_filtered(box, trackids[30], candidates_flt, filter_ids.size() / 2, &filter_ids[0], filter_ids.size());
     REQUIRE( "guessed filtered neighbors", (num_neighbors_guessed_flt == -1) || (num_neighbors_guessed_flt == (int) filter_ids.size() / 2) );
     if (num_neighbors_guessed_flt > 0) {
@@ -322,6 +1185,90 @@ void test_method(std::string method) {
         }
     }
 
+    // We check whether batched similarities match the single-seed ones
+    float* batch_similarities = new float[5 * 90];
+    REQUIRE( "computed batched similarities", musly_jukebox_similarity_batch(box, &tracks[40], &trackids[40], 5, tracks, trackids, 90, batch_similarities) == 0 );
+    for (int i = 0; i < 90; i++) {
+        REQUIRE( "consistent batched similarities", batch_similarities[2*90 + i] == similarities[i] );
+    }
+    for (int s = 0; s < 5; s++) {
+        REQUIRE( "re-computed similarities", musly_jukebox_similarity(box, tracks[40 + s], trackids[40 + s], tracks, trackids, 90, similarities2) == 0 );
+        for (int i = 0; i < 90; i++) {
+            REQUIRE( "consistent batched similarities", batch_similarities[s*90 + i] == similarities2[i] );
+        }
+    }
+    delete[] batch_similarities;
+
+    // We check whether similarities of stored tracks match as well, both in
+    // storage order and in reverse order
+    musly_trackid reversed_ids[90];
+    for (int i = 0; i < 90; i++) {
+        reversed_ids[i] = trackids[89 - i];
+    }
+    REQUIRE( "stored tracks", musly_jukebox_storetracks(box, tracks, trackids, 90) == 0 );
+    REQUIRE( "computed similarities by id", musly_jukebox_similarity_byid(box, trackids[42], trackids, 90, similarities2) == 0 );
+    for (int i = 0; i < 90; i++) {
+        REQUIRE( "consistent similarities by id", similarities2[i] == similarities[i] );
+    }
+    REQUIRE( "computed similarities by reversed id", musly_jukebox_similarity_byid(box, trackids[42], reversed_ids, 90, similarities2) == 0 );
+    for (int i = 0; i < 90; i++) {
+        REQUIRE( "consistent similarities by reversed id", similarities2[i] == similarities[89 - i] );
+    }
+    if (method == "mandelellis") {
+        // mandelellis tracks are a 20-dimensional Gaussian: the mean, the
+        // packed covariance and its inverse. The stored tracks are read
+        // straight from the store in storage order and gathered in reverse
+        // order, both must match the scalar divergence.
+        musly::gaussian_statistics gs(20);
+        const int covar_elems = gs.get_covarelems();
+        std::vector<float> tmp_buffer(20 + covar_elems);
+        gaussian g0, gi, tmp;
+        g0.mu = tracks[42];
+        g0.covar = g0.mu + 20;
+        g0.covar_inverse = g0.covar + covar_elems;
+        tmp.mu = &tmp_buffer[0];
+        tmp.covar_inverse = &tmp_buffer[20];
+        float max_error = 0;
+        for (int i = 0; i < 90; i++) {
+            gi.mu = tracks[i];
+            gi.covar = gi.mu + 20;
+            gi.covar_inverse = gi.covar + covar_elems;
+            float skld = gs.symmetric_kullbackleibler(g0, gi, tmp);
+            max_error = std::max(max_error, std::abs(similarities[i] - skld) / (1 + skld));
+        }
+        REQUIRE( "similarities by id match symmetric_kullbackleibler", max_error < 1e-4f );
+    }
+    REQUIRE( "rejected unstored track", musly_jukebox_similarity_byid(box, 5000, trackids, 90, similarities2) == -1 );
+
+    // We check whether the most similar stored tracks match the similarities
+    // computed before, both for all tracks and for tracks with even ids
+    for (int filtered = 0; filtered < 2; filtered++) {
+        std::vector<float> other_sims;
+        std::vector<musly_trackid> other_ids;
+        for (int i = 0; i < 90; i++) {
+            if ((i != 42) && (!filtered || (trackids[i] % 2 == 0))) {
+                other_sims.push_back(similarities[i]);
+                other_ids.push_back(trackids[i]);
+            }
+        }
+        float min_sims[10];
+        REQUIRE( "found minimum similarities", musly_findmin(&other_sims[0], &other_ids[0], other_sims.size(), min_sims, NULL, 10, 1) == 10 );
+        musly_trackid topk_ids[10];
+        float topk_sims[10];
+        REQUIRE( "found most similar tracks", musly_jukebox_topk(box, trackids[42], 10, filtered ? keep_even : NULL, NULL, topk_ids, topk_sims) == 10 );
+        for (int i = 0; i < 10; i++) {
+            REQUIRE( "consistent top similarities", topk_sims[i] == min_sims[i] );
+            int pos = std::find(other_ids.begin(), other_ids.end(), topk_ids[i]) - other_ids.begin();
+            REQUIRE( "returned considered track", pos < (int)other_ids.size() );
+            if (pos < (int)other_ids.size()) {
+                REQUIRE( "consistent top track", other_sims[pos] == topk_sims[i] );
+            }
+        }
+    }
+    std::vector<musly_trackid> all_ids(100);
+    REQUIRE( "found all other tracks", musly_jukebox_topk(box, trackids[42], 100, NULL, NULL, &all_ids[0], NULL) == 89 );
+    REQUIRE( "rejected unstored seed", musly_jukebox_topk(box, 5000, 10, NULL, NULL, &all_ids[0], NULL) == -1 );
+
     // We check whether they even work deterministically (they should)
     REQUIRE( "re-computed similarities", musly_jukebox_similarity(box, tracks[42], trackids[42], tracks, trackids, 90, similarities2) == 0 );
     for (int i = 0; i < 90; i++) {
@@ -362,6 +1309,8 @@ void test_method(std::string method) {
     for (int i = 0; i < 30; i++) {
         REQUIRE( "generated track ids", trackids[i] == 1011 + i );
     }
+    REQUIRE( "compacted jukebox", musly_jukebox_compact(box) == 0 );
+    REQUIRE( "track count 90", musly_jukebox_trackcount(box) == 90 );
     // We modify filter_ids to account for the changed trackids
     for (int i = 0; i < (int) filter_ids.size(); i++) {
         if (filter_ids[i] < 30) {
@@ -374,6 +1323,12 @@ void test_method(std::string method) {
     for (int i = 0; i < 90; i++) {
         REQUIRE( "consistent similarities", similarities[i] == similarities2[i] );
     }
+    REQUIRE( "rejected removed track", musly_jukebox_similarity_byid(box, trackids[42], trackids, 90, similarities2) == -1 );
+    REQUIRE( "re-stored first 30 tracks", musly_jukebox_storetracks(box, tracks, trackids, 30) == 0 );
+    REQUIRE( "re-computed similarities by id", musly_jukebox_similarity_byid(box, trackids[42], trackids, 90, similarities2) == 0 );
+    for (int i = 0; i < 90; i++) {
+        REQUIRE( "consistent similarities by id", similarities[i] == similarities2[i] );
+    }
     REQUIRE( "re-guessed neighbors", musly_jukebox_guessneighbors(box, trackids[30], candidates2, 20) == num_neighbors_guessed );
     if (num_neighbors_guessed > 0) {
         // the ids of the first 30 tracks have changed; we need to adapt `candidates`
@@ -407,6 +1362,13 @@ void test_method(std::string method) {
         }
     }
 
+    // We remove and re-add a track without compacting, so the exported state
+    // has to skip its old position
+    REQUIRE( "disabled compaction", musly_jukebox_setcompaction(box, 1) == 0 );
+    REQUIRE( "removed track 5", musly_jukebox_removetracks(box, &trackids[5], 1) == 0 );
+    REQUIRE( "re-added track 5", musly_jukebox_addtracks(box, &tracks[5], &trackids[5], 1, false) == 0 );
+    REQUIRE( "track count 90", musly_jukebox_trackcount(box) == 90 );
+
     // We export and import the jukebox state to/from a file
 #if !defined(WIN32) && !defined(_WIN32) && !defined(__WIN32)
     FILE *tempfile = tmpfile();
@@ -451,6 +1413,126 @@ void test_method(std::string method) {
         }
     }
 
+    musly_jukebox* box_map = NULL;
+#if !defined(WIN32) && !defined(_WIN32) && !defined(__WIN32)
+    // We export and import the jukebox state to/from a named file. The
+    // timbre method writes a jukebox image, which the imported jukebox keeps
+    // mapped and reads in place
+    std::string tempfn_map = std::string(P_tmpdir) + "/muslytestXXXXXX";
+    std::vector<char> tempfn_buf(tempfn_map.begin(), tempfn_map.end());
+    tempfn_buf.push_back('\0');
+    int tempfd = mkstemp(&tempfn_buf[0]);
+    REQUIRE( "created temporary file", tempfd >= 0 );
+    close(tempfd);
+    const char* tempfn_name = &tempfn_buf[0];
+    REQUIRE( "exported jukebox state to file", musly_jukebox_tofile(box, tempfn_name) > 0 );
+    if (method == "timbre") {
+        char magic[8] = {0};
+        FILE* f = fopen(tempfn_name, "rb");
+        REQUIRE( "read exported file", f && (fread(magic, 1, 8, f) == 8) );
+        if (f) {
+            fclose(f);
+        }
+        REQUIRE( "exported jukebox image", memcmp(magic, "MUSLYIMG", 8) == 0 );
+    }
+    box_map = musly_jukebox_fromfile(tempfn_name);
+    REQUIRE( "imported jukebox state from file", box_map != NULL );
+    if (box_map) {
+        REQUIRE( "track count 90 (mapped jukebox)", musly_jukebox_trackcount(box_map) == 90 );
+        REQUIRE( "max seen 1040 (mapped jukebox)", musly_jukebox_maxtrackid(box_map) == 1040 );
+        REQUIRE( "computed similarities (mapped jukebox)", musly_jukebox_similarity(box_map, tracks[42], trackids[42], tracks, trackids, 90, similarities2) == 0 );
+        for (int i = 0; i < 90; i++) {
+            REQUIRE( "consistent similarities", similarities[i] == similarities2[i] );
+        }
+        REQUIRE( "guessed neighbors (mapped jukebox)", musly_jukebox_guessneighbors(box_map, trackids[30], candidates2, 20) == num_neighbors_guessed );
+        if (num_neighbors_guessed > 0) {
+            std::sort(candidates2, candidates2 + num_neighbors_guessed);
+            for (int i = 0; i < num_neighbors_guessed; i++) {
+                REQUIRE( "consistent neighbor candidates", candidates[i] == candidates2[i] );
+            }
+        }
+        if (method == "timbre") {
+            // the track store is part of the image
+            float similarities3[30];
+            REQUIRE( "computed similarities by id (mapped jukebox)", musly_jukebox_similarity_byid(box_map, trackids[10], &trackids[10], 30, similarities3) == 0 );
+            REQUIRE( "computed similarities by id", musly_jukebox_similarity_byid(box, trackids[10], &trackids[10], 30, similarities2) == 0 );
+            REQUIRE( "consistent similarities by id", std::equal(similarities2, similarities2 + 30, similarities3) );
+            musly_trackid topk_ids[2][10];
+            float topk_sims[2][10];
+            REQUIRE( "found most similar tracks (mapped jukebox)", musly_jukebox_topk(box_map, trackids[10], 10, NULL, NULL, topk_ids[0], topk_sims[0]) == 10 );
+            REQUIRE( "found most similar tracks", musly_jukebox_topk(box, trackids[10], 10, NULL, NULL, topk_ids[1], topk_sims[1]) == 10 );
+            REQUIRE( "consistent most similar tracks", std::equal(topk_ids[0], topk_ids[0] + 10, topk_ids[1]) && std::equal(topk_sims[0], topk_sims[0] + 10, topk_sims[1]) );
+
+            // files in the stream format can still be read; the mapped file
+            // must not be overwritten in place, so we use another one
+            std::vector<char> tempfn_stream(tempfn_map.begin(), tempfn_map.end());
+            tempfn_stream.push_back('\0');
+            tempfd = mkstemp(&tempfn_stream[0]);
+            REQUIRE( "created temporary file", tempfd >= 0 );
+            FILE* f = fdopen(tempfd, "wb");
+            REQUIRE( "exported jukebox stream to file", f && (musly_jukebox_tostream(box, f) > 0) );
+            if (f) {
+                fclose(f);
+            }
+            musly_jukebox* box_stream = musly_jukebox_fromfile(&tempfn_stream[0]);
+            REQUIRE( "imported jukebox stream from file", box_stream != NULL );
+            if (box_stream) {
+                REQUIRE( "computed similarities (streamed jukebox)", musly_jukebox_similarity(box_stream, tracks[42], trackids[42], tracks, trackids, 90, similarities2) == 0 );
+                for (int i = 0; i < 90; i++) {
+                    REQUIRE( "consistent similarities", similarities[i] == similarities2[i] );
+                }
+                musly_jukebox_poweroff(box_stream);
+            }
+            remove(&tempfn_stream[0]);
+        }
+    }
+    remove(tempfn_name);
+#endif
+
+    if (method == "timbre") {
+        // The timbre track data includes pivot distances since the metadata
+        // starts with a format tag. Earlier versions wrote neither, we
+        // convert the state to their layout and check it is still read,
+        // without a neighbor index, and written back unchanged
+        const int header_bytes = musly_jukebox_binsize(box, 1, 0);
+        const int track_bytes = musly_jukebox_binsize(box, 0, 1);
+        const int old_header_bytes = header_bytes - sizeof(int);
+        const int old_track_bytes = sizeof(musly_trackid) + 2 * sizeof(float);
+        std::vector<unsigned char> header(header_bytes);
+        std::vector<unsigned char> trackdata((size_t)track_bytes * 90);
+        REQUIRE( "exported jukebox metadata", musly_jukebox_tobin(box, &header[0], 1, 0, 0) == header_bytes );
+        REQUIRE( "exported jukebox track data", musly_jukebox_tobin(box, &trackdata[0], 0, 90, 0) == track_bytes * 90 );
+        std::vector<unsigned char> old_state(header.begin() + sizeof(int), header.end());
+        for (int i = 0; i < 90; i++) {
+            const unsigned char* row = &trackdata[(size_t)track_bytes * i];
+            old_state.insert(old_state.end(), row, row + old_track_bytes);
+        }
+        musly_jukebox* box_old = musly_jukebox_poweron(method.c_str(), NULL);
+        REQUIRE( "imported metadata of an earlier version", musly_jukebox_frombin(box_old, &old_state[0], 1, 0) == 90 );
+        REQUIRE( "imported track data of an earlier version", musly_jukebox_frombin(box_old, &old_state[old_header_bytes], 0, 90) == 90 );
+        std::vector<float> old_similarities(90);
+        REQUIRE( "computed similarities (earlier version)", musly_jukebox_similarity(box_old, tracks[42], trackids[42], tracks, trackids, 90, &old_similarities[0]) == 0 );
+        REQUIRE( "computed similarities", musly_jukebox_similarity(box, tracks[42], trackids[42], tracks, trackids, 90, similarities2) == 0 );
+        REQUIRE( "consistent similarities (earlier version)", std::equal(old_similarities.begin(), old_similarities.end(), similarities2) );
+        REQUIRE( "no neighbor index (earlier version)", musly_jukebox_guessneighbors(box_old, trackids[30], candidates2, 20) == -1 );
+        REQUIRE( "exported in the layout of earlier versions", (musly_jukebox_binsize(box_old, 1, 0) == old_header_bytes) && (musly_jukebox_binsize(box_old, 0, 1) == old_track_bytes) );
+        std::vector<unsigned char> rewritten(old_state.size());
+        REQUIRE( "exported metadata (earlier version)", musly_jukebox_tobin(box_old, &rewritten[0], 1, 0, 0) == old_header_bytes );
+        REQUIRE( "exported track data (earlier version)", musly_jukebox_tobin(box_old, &rewritten[old_header_bytes], 0, 90, 0) == old_track_bytes * 90 );
+        REQUIRE( "exported the same state (earlier version)", rewritten == old_state );
+        musly_jukebox_poweroff(box_old);
+
+        musly_jukebox* box_new = musly_jukebox_poweron(method.c_str(), NULL);
+        REQUIRE( "imported metadata with format tag", musly_jukebox_frombin(box_new, &header[0], 1, 0) == 90 );
+        musly_jukebox_poweroff(box_new);
+
+        // unknown format tags are rejected
+        *(int*)&header[0] = -3;
+        musly_jukebox* box_unknown = musly_jukebox_poweron(method.c_str(), NULL);
+        REQUIRE( "rejected metadata with unknown format tag", musly_jukebox_frombin(box_unknown, &header[0], 1, 0) == -1 );
+        musly_jukebox_poweroff(box_unknown);
+    }
+
     // We check if the two jukeboxes are also consistent when adding new tracks
     // (so the music style state has been exported and imported properly)
     REQUIRE( "added 10 tracks to first jukebox", musly_jukebox_addtracks(box, &tracks[90], &trackids[90], 10, true) == 0 );
@@ -461,6 +1543,13 @@ void test_method(std::string method) {
     for (int i = 0; i < 10; i++) {
         REQUIRE( "generated track ids", trackids[90 + i] == 1041 + i );
     }
+    if (box_map) {
+        // modifying the mapped jukebox copies the state it changes
+        REQUIRE( "added 10 tracks to mapped jukebox", musly_jukebox_addtracks(box_map, &tracks[90], &trackids[90], 10, true) == 0 );
+        for (int i = 0; i < 10; i++) {
+            REQUIRE( "generated track ids", trackids[90 + i] == 1041 + i );
+        }
+    }
     REQUIRE( "computed similarities (first jukebox)", musly_jukebox_similarity(box, tracks[10], trackids[10], tracks, trackids, 100, similarities) == 0 );
     REQUIRE( "computed similarities (imported jukebox)", musly_jukebox_similarity(box2, tracks[10], trackids[10], tracks, trackids, 100, similarities2) == 0 );
     for (int i = 0; i < 100; i++) {
@@ -475,6 +1564,59 @@ void test_method(std::string method) {
             REQUIRE( "consistent neighbor candidates", candidates[i] == candidates2[i] );
         }
     }
+#if !defined(WIN32) && !defined(_WIN32) && !defined(__WIN32)
+    if (box_map) {
+        REQUIRE( "computed similarities (mapped jukebox)", musly_jukebox_similarity(box_map, tracks[10], trackids[10], tracks, trackids, 100, similarities2) == 0 );
+        for (int i = 0; i < 100; i++) {
+            REQUIRE( "consistent similarities", similarities[i] == similarities2[i] );
+        }
+        REQUIRE( "guessed neighbors (mapped jukebox)", musly_jukebox_guessneighbors(box_map, trackids[23], candidates2, 20) == num_neighbors_guessed );
+        if (num_neighbors_guessed > 0) {
+            std::sort(candidates2, candidates2 + num_neighbors_guessed);
+            REQUIRE( "consistent neighbor candidates", std::equal(candidates, candidates + num_neighbors_guessed, candidates2) );
+        }
+
+        // We export the modified jukebox and import it again, then export the
+        // imported jukebox over the file it reads from, which must not
+        // disturb it
+        tempfn_buf.assign(tempfn_map.begin(), tempfn_map.end());
+        tempfn_buf.push_back('\0');
+        tempfn_name = &tempfn_buf[0];
+        tempfd = mkstemp(&tempfn_buf[0]);
+        REQUIRE( "created temporary file", tempfd >= 0 );
+        close(tempfd);
+        REQUIRE( "exported mapped jukebox to file", musly_jukebox_tofile(box_map, tempfn_name) > 0 );
+        musly_jukebox* box_remap = musly_jukebox_fromfile(tempfn_name);
+        REQUIRE( "imported re-exported jukebox", box_remap != NULL );
+        if (box_remap) {
+            REQUIRE( "exported mapped jukebox over its file", musly_jukebox_tofile(box_remap, tempfn_name) > 0 );
+            REQUIRE( "track count 100 (re-imported jukebox)", musly_jukebox_trackcount(box_remap) == 100 );
+            REQUIRE( "computed similarities (re-imported jukebox)", musly_jukebox_similarity(box_remap, tracks[10], trackids[10], tracks, trackids, 100, similarities2) == 0 );
+            for (int i = 0; i < 100; i++) {
+                REQUIRE( "consistent similarities", similarities[i] == similarities2[i] );
+            }
+            musly_jukebox_poweroff(box_remap);
+        }
+        remove(tempfn_name);
+        musly_jukebox_poweroff(box_map);
+    }
+#endif
+
+    // We check whether similarities can be computed while tracks are added,
+    // and that a steady stream of queries on three threads does not starve
+    // adding tracks
+    musly_jukebox* box3 = musly_jukebox_poweron(method.c_str(), NULL);
+    musly_trackid trackids3[100];
+    REQUIRE( "set music style (concurrent jukebox)", musly_jukebox_setmusicstyle(box3, tracks, 25) == 0 );
+    REQUIRE( "added tracks (concurrent jukebox)", musly_jukebox_addtracks(box3, tracks, trackids3, 50, true) == 0 );
+    add_while_querying_task concurrent(box3, tracks, trackids3, 4);
+    musly::run_workers(concurrent, 4);
+    REQUIRE( "computed similarities on all threads before adding tracks", concurrent.querying_before == 3 );
+    REQUIRE( "added tracks while computing similarities", concurrent.added == 0 );
+    REQUIRE( "computed similarities while adding tracks", concurrent.failed.get() == 0 );
+    REQUIRE( "queries did not starve adding tracks", concurrent.starved.get() == 0 );
+    REQUIRE( "track count 100 (concurrent jukebox)", musly_jukebox_trackcount(box3) == 100 );
+    musly_jukebox_poweroff(box3);
 
     // Clean up whatever is left on the heap
     for (int i = 0; i < 100; i++) {
@@ -489,10 +1631,15 @@ int main() {
     musly_debug(1);  // set verbosity level to logERROR
 
     // Unit tests
-    std::cout << "Components to test: unordered_idpool,ordered_idpool,findmin" << std::endl;
+    std::cout << "Components to test: unordered_idpool,ordered_idpool,findmin,gaussian_statistics,resampler,sampleconversion,pivotindex,workers" << std::endl;
     test_unordered_idpool();
     test_ordered_idpool();
     test_findmin();
+    test_gaussian_statistics();
+    test_resampler();
+    test_sampleconversion();
+    test_pivotindex();
+    test_workers();
     std::cout << std::endl;
 
     // Tests of the full library